@@ -59,6 +59,7 @@ CreateBarCodeHashTable(memory_arena *arena, u32 nEntries)
     barcode_hash_table *table = PushStructP(arena, barcode_hash_table);
     table->size = size;
     table->table = PushArrayP(arena, barcode_hash_table_node *, size);
+    AdviseHugePages(table->table, sizeof(barcode_hash_table_node *) * size);
     memset(table->table, 0, size * sizeof(barcode_hash_table_node *));
 
     return(table);
@@ -119,15 +120,93 @@ PackBarCode(u08 *buff)
             (u32)(((buff[10] - '0') * 10) + (buff[11] - '0')));
 }
 
+// Parses the 12 byte barcode names held in the benchmark's bytes
+global_function
+void
+PackBarCodeKernel(void *in, u64 n)
+{
+    kernel_benchmark *bench = (kernel_benchmark *)in;
+    u32 sum = 0;
+    ForLoop64(n) sum += PackBarCode(bench->bytes + (12 * index));
+    Benchmark_Sink = Benchmark_Sink + sum;
+}
+
+global_function
+void
+FastHash32Kernel(void *in, u64 n)
+{
+    kernel_benchmark *bench = (kernel_benchmark *)in;
+    u32 hash = 0;
+    ForLoop64(n) hash ^= FastHash32(bench->barcodes + index, sizeof(u32), BarCodeHashTableSeed);
+    Benchmark_Sink = Benchmark_Sink + hash;
+}
+
+global_function
+void
+GetBarCodeIndexFromHashTableKernel(void *in, u64 n)
+{
+    kernel_benchmark *bench = (kernel_benchmark *)in;
+    barcode_hash_table *table = (barcode_hash_table *)bench->table;
+    u32 sum = 0;
+    ForLoop64(n) sum += GetBarCodeIndexFromHashTable(table, bench->barcodes[index]);
+    Benchmark_Sink = Benchmark_Sink + sum;
+}
+
+global_function
+void
+RunKernelBenchmarks()
+{
+    memory_arena arena;
+    CreateMemoryArena(arena, MegaByte(256));
+
+    kernel_benchmark *pack = CreateKernelBenchmark(&arena, Kernel_Benchmark_Items, 1, 12);
+    ForLoop(Kernel_Benchmark_Items) FormatPackedBarCode(pack->bytes + (12 * index), pack->barcodes[index]);
+    RunKernelBenchmark("PackBarCode", PackBarCodeKernel, pack, 12);
+
+    RunKernelBenchmark("FastHash32", FastHash32Kernel, pack, sizeof(u32));
+
+    // every barcode is in the table, as every clear barcode is in a real run
+    kernel_benchmark *lookup = CreateKernelBenchmark(&arena, Kernel_Benchmark_Items, 1, 0);
+    lookup->table = CreateBarCodeHashTable(&arena, Kernel_Benchmark_Items);
+    ForLoop(Kernel_Benchmark_Items) AddBarCodeToHashTable((barcode_hash_table *)lookup->table, &arena, lookup->barcodes[index], index + 1);
+    RunKernelBenchmark("GetBarCodeIndexFromHashTable", GetBarCodeIndexFromHashTableKernel, lookup, sizeof(u32));
+
+    // barcodes ordered by read count, so many share a value
+    kernel_benchmark *tree = CreateKernelBenchmark(&arena, Kernel_Benchmark_Items, 4096, 0);
+    PrepareWavlTreeBenchmark(&arena, tree);
+    RunKernelBenchmark("WavlTreeInsertValue", WavlTreeInsertKernel, tree, 2 * sizeof(u32));
+
+    FreeMemoryArena(arena);
+}
+
 MainArgs
 {
     s32 exitCode = EXIT_SUCCESS;
     u08 logError = 0;
     char *logName = (char *)"10xSpoof_HaploTag_to_10x";
+    const char *clearLogName = 0;
+    const char *prefix = 0;
+    u08 benchmark = 0;
+    pipeline_options pipeline = {};
+
+    ForLoop(ArgCount - 1)
+    {
+        if (IsPipelineOption(ArgBuffer[index + 1]))
+        {
+            if (!ParsePipelineOption(&pipeline, ArgCount, ArgBuffer, &index))
+            {
+                exitCode = EXIT_FAILURE;
+                goto End;
+            }
+        }
+        else if (!strcmp(ArgBuffer[index + 1], "--benchmark")) benchmark = 1;
+        else if (!clearLogName) clearLogName = ArgBuffer[index + 1];
+        else if (!prefix) prefix = ArgBuffer[index + 1];
+    }
     
     if (ArgCount > 1 && AreNullTerminatedStringsEqual((u08 *)"--help", (u08 *)ArgBuffer[1])) 
     {
-        fprintf(stderr, ProgramName " " ProgramVersion "\nUsage: <fastq format> | " ProgramName " <clear barcode log> <prefix>? | <fastq format>\n\n");
+        fprintf(stderr, ProgramName " " ProgramVersion "\nUsage: <fastq format> | " ProgramName " [--io-buffers N] [--io-buffer-size MB] [--trace FILE] [--cpus LIST | --pin] <clear barcode log> <prefix>? | <fastq format>\n\n");
         
         fprintf(stderr, "Reads/writes fastq formatted reads from <stdin>/<stdout>.\n");
         fprintf(stderr, "Any read with a BX SAM tag in its comment field will be prepended by 23 bases; a 16-base valid 10x barcode and 7 joining bases.\n\n");
@@ -136,18 +215,25 @@ MainArgs
         fprintf(stderr, "e.g. '... BX:Z:A01C02B03D04 ...'\n\n");
        
         fprintf(stderr, "The one required argument <clear barcode log> is a 3-column, tab-delimited text file with one header line; with the columns being: haplotag barcode, clear-count and correct-count.\n");
-        fprintf(stderr, "Such a log file will be created by running 'SamHaplotag'.\n\n");
+        fprintf(stderr, "Such a log file will be created by running 'SamHaplotag'. The binary 'SamHaplotag_BC_Stats' file it also creates can be given instead, and is used without parsing.\n\n");
 
         fprintf(stderr, "One log file: '%s' will created with an optional '<prefix>_' at the start of the file-name if supplied as a second argument.\n", logName);
         fprintf(stderr, "The log file is a map between haplotag and 10x barcodes.\n\n");
 
+        fprintf(stderr, "'--io-buffers' and '--io-buffer-size' set the number (default %u) and size in MB (default %u) of the input/output buffers.\n", Default_IO_Buffers, Default_IO_Buffer_Size_MB);
+        fprintf(stderr, "'--trace FILE' writes a Chrome trace JSON timeline of the I/O tasks, parse blocks, waits to FILE at exit (chrome://tracing, ui.perfetto.dev).\n");
+        fprintf(stderr, "'--cpus LIST' pins the main thread, then the log, input and output I/O threads as they are created, to the CPUs in LIST (e.g. 0-3) in order; '--pin' does the same with every CPU the process may run on, those on the main thread's NUMA node first.\n");
+        fprintf(stderr, "'--benchmark' times the barcode kernels on generated data, printing one JSON object per kernel to <stdout>, and exits.\n");
+        fprintf(stderr, "A report of each pipeline stage (log, input, parse, output: busy and waited time, buffers, bytes and records), and of memory arena use (in use, peak and committed bytes), is printed at exit, and whenever the process receives SIGUSR1 (e.g. 'pkill -USR1 " ProgramName "').\n\n");
+
         fprintf(stderr, "Usage example:\n");
         fprintf(stderr, "samtools fastq -@ 16 -nT BX -0 /dev/null -s /dev/null tagged_reads_123.cram | " ProgramName " 123_SamHaplotag_Clear_BC 123 | bgzip -@ 16 >10x_spoofed_reads_123.fq.gz\n");
         
         goto End;
     }
 
-    if (ArgCount < 2)
+    if (benchmark) RunKernelBenchmarks();
+    else if (!clearLogName)
     {
         PrintError("Clear Barcode log required");
         exitCode = EXIT_FAILURE;
@@ -155,27 +241,48 @@ MainArgs
     else
     {
         char logNameBuffer[256];
-        if (ArgCount > 2)
+        if (prefix)
         {
-            stbsp_snprintf((char *)logNameBuffer, (s32)sizeof(logNameBuffer), "%s_%s", ArgBuffer[2], logName);
+            stbsp_snprintf((char *)logNameBuffer, (s32)sizeof(logNameBuffer), "%s_%s", prefix, logName);
             logName = (char *)logNameBuffer;
         }
 
+        if (!StartPipeline(&pipeline))
+        {
+            exitCode = EXIT_FAILURE;
+            goto End;
+        }
+
         s32 log;
         if ((log = open((const char *)logName, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR)) > 0)
         {
-            PrintStatus("Clear Barcode log: %s", ArgBuffer[1]);
+            PrintStatus("Clear Barcode log: %s", clearLogName);
 
             memory_arena workingSet;
             CreateMemoryArena(workingSet, MegaByte(512));
+            RegisterArena(&workingSet, "working");
 
             buffer_pool *readPool = CreatePool(&workingSet);
-            readPool->handle = open(ArgBuffer[1], O_RDONLY);
+            readPool->handle = open(clearLogName, O_RDONLY);
 
             if (readPool->handle > 0)
             {
-                barcode_hash_table *barcodeHashTable;
+                barcode_hash_table *barcodeHashTable = 0;
                 wavl_tree *barcodeTree = InitialiseWavlTree(&workingSet);
+
+                // with a binary stats file, 10x indexes are kept in a column parallel to its barcodes and found by binary search
+                barcode_stats stats = {};
+                u08 haveStats = IsBarCodeStatsFile(clearLogName);
+                u32 *statsIndexes = 0;
+                if (haveStats && !MapBarCodeStats(clearLogName, &stats))
+                {
+                    PrintError("Error, '%s' is not a complete barcode statistics file", clearLogName);
+                    exitCode = EXIT_FAILURE;
+                    goto End;
+                }
+                if (!haveStats && !MapInputFile(readPool)) EnableIORing(&workingSet, readPool, 0);
+                RegisterStage(&readPool->stats, "log");
+
                 {
                     u32 barcode = 0;
                     u32 count = 0;
@@ -186,9 +293,15 @@ MainArgs
                     u08 buff[16];
                     u08 buffPtr = 0;
 
-                    buffer *readBuffer = GetNextBuffer_Read(readPool);
                     u32 nBC = 0;
-                    do
+                    if (haveStats) ForLoop(stats.nBarCodes) if (!stats.unclear[index])
+                    {
+                        WavlTreeInsertValue(&workingSet, barcodeTree, stats.correct[index] + stats.corrected[index], stats.barcodes[index]);
+                        ++nBC;
+                    }
+
+                    buffer *readBuffer = haveStats ? 0 : GetNextBuffer_Read(readPool);
+                    if (!haveStats) do
                     {
                         readBuffer = GetNextBuffer_Read(readPool);
 
@@ -242,7 +355,12 @@ MainArgs
                     WavlTreeFreeze_HighToLow(barcodeTree);
 
                     PrintStatus("Barcode count: %u", nBC);
-                    barcodeHashTable = CreateBarCodeHashTable(&workingSet, nBC);
+                    if (haveStats)
+                    {
+                        statsIndexes = PushArray(workingSet, u32, stats.nBarCodes);
+                        memset(statsIndexes, 0, stats.nBarCodes * sizeof(u32));
+                    }
+                    else barcodeHashTable = CreateBarCodeHashTable(&workingSet, nBC);
 
                     if (nBC > ArrayCount(TenX_BarCodes)) PrintWarning("Barcode count > 10x count, %u barcodes will be discarded!", nBC - ArrayCount(TenX_BarCodes));
 
@@ -260,11 +378,8 @@ MainArgs
                         TraverseLinkedList2(node->head, barcode_ll_node)
                         {
                             u08 lineBuffer[30];
-                            u08 a = (u08)((node2->barcode >> 24) & ((1 << 8) - 1));
-                            u08 c = (u08)((node2->barcode >> 16) & ((1 << 8) - 1));
-                            u08 b = (u08)((node2->barcode >> 8) & ((1 << 8) - 1));
-                            u08 d = (u08)(node2->barcode & ((1 << 8) - 1));
-                            stbsp_snprintf((char *)lineBuffer, sizeof(lineBuffer), "A%02uC%02uB%02uD%02u\t", a, c, b, d);
+                            FormatPackedBarCode(lineBuffer, node2->barcode);
+                            lineBuffer[12] = '\t';
                             UnPackTenX(index - 1, lineBuffer + 13);
                             lineBuffer[29] = '\n';
 
@@ -274,7 +389,8 @@ MainArgs
                                 goto End;
                             }
 
-                            AddBarCodeToHashTable(barcodeHashTable, &workingSet, node2->barcode, index++);
+                            if (haveStats) statsIndexes[FindBarCodeInStats(&stats, node2->barcode)] = index++;
+                            else AddBarCodeToHashTable(barcodeHashTable, &workingSet, node2->barcode, index++);
 
                             if (index > ArrayCount(TenX_BarCodes)) break;
                         }
@@ -282,13 +398,21 @@ MainArgs
                     }
                 }
                 {
+                    // the log's read buffers may be views into its mapping, so the reads get a pool of their own
+                    readPool = CreatePool(&workingSet);
 #ifdef DEBUG
                     readPool->handle = open("test_in", O_RDONLY);
 #else
                     readPool->handle = STDIN_FILENO;
 #endif     
+                    if (!MapInputFile(readPool)) EnableIORing(&workingSet, readPool, 0);
                     buffer_pool *writePool = CreatePool(&workingSet);
                     writePool->handle = STDOUT_FILENO;
+                    EnableIORing(&workingSet, writePool, 1);
+
+                    RegisterStage(&readPool->stats, "input");
+                    stage_stats *parse = CreateStage(&workingSet, "parse");
+                    RegisterStage(&writePool->stats, "output");
 
                     char printNBuffers[2][32] = {{0}};
                     u08 printNBufferPtr = 0;
@@ -303,9 +427,12 @@ MainArgs
                     buffer *readBuffer = GetNextBuffer_Read(readPool);
                     u64 totalReads = 0;
                     u64 bcAdded = 0;
+                    BeginParse(parse);
                     do
                     {
                         readBuffer = GetNextBuffer_Read(readPool);
+                        CountBuffer(parse, readBuffer->size);
+                        u64 parseStart = TraceStart();
 
                         for (   u64 bufferIndex = 0;
                                 bufferIndex < readBuffer->size;
@@ -357,7 +484,12 @@ MainArgs
                             else if (mode == write1)
                             {
                                 if ((BufferSize - writeBuffer->size - 1) < 23) writeBuffer = GetNextBuffer_Write(writePool);
-                                bcIndex = GetBarCodeIndexFromHashTable(barcodeHashTable, PackBarCode(bcBuffer));
+                                if (haveStats)
+                                {
+                                    s64 row = FindBarCodeInStats(&stats, PackBarCode(bcBuffer));
+                                    bcIndex = row < 0 ? 0 : statsIndexes[row];
+                                }
+                                else bcIndex = GetBarCodeIndexFromHashTable(barcodeHashTable, PackBarCode(bcBuffer));
                                 u08 tenx[16];
                                 if (bcIndex) UnPackTenX(bcIndex - 1, tenx);
                                 ForLoop(16) writeBuffer->buffer[writeBuffer->size++] = bcIndex ? tenx[index] : 'N';
@@ -390,7 +522,10 @@ MainArgs
                                 printNBufferPtr = otherPtr;
                             }
                         }
+                        parse->records = totalReads;
+                        TraceEvent("parse", 0, "main", parseStart, readBuffer->size);
                     } while (readBuffer->size);
+                    EndParse(parse);
 
                     GetNextBuffer_Write(writePool);
                     GetNextBuffer_Write(writePool);
@@ -399,11 +534,14 @@ MainArgs
                         PrintError("Error writing");
                         exitCode = EXIT_FAILURE;
                     }
+                    PrintBufferPoolStats(readPool, 0);
+                    PrintBufferPoolStats(writePool, 1);
+                    WritePipelineReport();
                 } 
             }
             else
             {
-                PrintError("Error opening log file '%s'", ArgBuffer[1]);
+                PrintError("Error opening log file '%s'", clearLogName);
                 exitCode = EXIT_FAILURE;
             }
         }
@@ -415,6 +553,11 @@ MainArgs
     }
 
 End:
+    if (Trace_Enabled && WriteTrace())
+    {
+        PrintError("Error writing trace file");
+        exitCode = EXIT_FAILURE;
+    }
     if (logError)
     {
         PrintError("Error writing log file");
@@ -45,11 +45,7 @@ global_function
 void
 UnpackBarCode(u32 barcode, u08 *buff)
 {
-    u08 a = (u08)((barcode >> 24) & ((1 << 8) - 1));
-    u08 c = (u08)((barcode >> 16) & ((1 << 8) - 1));
-    u08 b = (u08)((barcode >> 8) & ((1 << 8) - 1));
-    u08 d = (u08)(barcode & ((1 << 8) - 1));
-    stbsp_snprintf((char *)buff, 13, "A%02uC%02uB%02uD%02u", a, c, b, d);
+    FormatPackedBarCode(buff, barcode);
 }
 
 global_function
@@ -77,12 +73,17 @@ CreateTransferPool(memory_arena *arena, wavl_tree *tree)
     pool->arena = arena;
 
     pool->bufferPool.bufferPtr = 0;
+    pool->bufferPool.nBuffers = 2;
+    pool->bufferPool.buffers = PushArrayP(arena, buffer *, 2);
     pool->bufferPool.buffers[0] = PushStructP(arena, buffer);
     pool->bufferPool.buffers[0]->buffer = PushArrayP(arena, u08, BufferSize);
     pool->bufferPool.buffers[0]->size = 0;
     pool->bufferPool.buffers[1] = PushStructP(arena, buffer);
     pool->bufferPool.buffers[1]->buffer = PushArrayP(arena, u08, BufferSize);
     pool->bufferPool.buffers[1]->size = 0;
+    pool->bufferPool.buffers[0]->task.done = 1;
+    pool->bufferPool.buffers[1]->task.done = 1;
+    memset(&pool->bufferPool.stats, 0, sizeof(pool->bufferPool.stats));
 
     return(pool);
 }
@@ -93,6 +94,7 @@ ProcessBuffer(void *in)
 {
     transfer_buffer_pool *pool = (transfer_buffer_pool *)in;
     buffer *buffer = pool->bufferPool.buffers[pool->bufferPool.bufferPtr];
+    u64 start = GetNanoSeconds();
     ForLoop64(buffer->size / 4)
     {
         u32 barcode;
@@ -103,29 +105,118 @@ ProcessBuffer(void *in)
 
         WavlTreeInsertValue(pool->arena, pool->tree, barcode, 0);
     }
+    pool->bufferPool.stats.records += buffer->size / 4;
+    pool->bufferPool.stats.busyTime += GetNanoSeconds() - start;
+    TraceEvent("ProcessBuffer", 0, "stats", start, buffer->size);
 }
 
 global_function
 buffer *
 GetNextTransferBuffer(transfer_buffer_pool *pool)
 {
-    FenceIn(ThreadPoolWait(pool->bufferPool.pool));
+    // the stats thread may still be inserting the buffer handed over last time
     buffer *buffer = pool->bufferPool.buffers[pool->bufferPool.bufferPtr];
+    if (!TaskDone(&buffer->task))
+    {
+        BeginWait(&pool->bufferPool.stats);
+        FenceIn(ThreadPoolWaitTask(pool->bufferPool.pool, &buffer->task));
+        EndWait(&pool->bufferPool.stats);
+    }
+
     pool->bufferPool.bufferPtr = (pool->bufferPool.bufferPtr + 1) & 1;
-    ThreadPoolAddTask(pool->bufferPool.pool, ProcessBuffer, pool);
+    struct buffer *full = pool->bufferPool.buffers[pool->bufferPool.bufferPtr];
+    CountBuffer(&pool->bufferPool.stats, full->size);
+    ThreadPoolAddTaskWithHandle(pool->bufferPool.pool, ProcessBuffer, pool, &full->task);
     buffer->size = 0;
     return(buffer);
 }
 
+// Parses the 12 byte barcode names held in the benchmark's bytes
+global_function
+void
+PackBarCodeKernel(void *in, u64 n)
+{
+    kernel_benchmark *bench = (kernel_benchmark *)in;
+    u32 sum = 0;
+    ForLoop64(n) sum += PackBarCode(bench->bytes + (12 * index));
+    Benchmark_Sink = Benchmark_Sink + sum;
+}
+
+global_function
+void
+Unpack16BaseBarCodeKernel(void *in, u64 n)
+{
+    kernel_benchmark *bench = (kernel_benchmark *)in;
+    ForLoop64(n) Unpack16BaseBarCode(bench->values[index], bench->bytes + (16 * index));
+    Benchmark_Sink = Benchmark_Sink + bench->bytes[(16 * n) - 1];
+}
+
+global_function
+void
+RunKernelBenchmarks()
+{
+    memory_arena arena;
+    CreateMemoryArena(arena, MegaByte(256));
+
+    kernel_benchmark *pack = CreateKernelBenchmark(&arena, Kernel_Benchmark_Items, 1, 12);
+    ForLoop(Kernel_Benchmark_Items) FormatPackedBarCode(pack->bytes + (12 * index), pack->barcodes[index]);
+    RunKernelBenchmark("PackBarCode", PackBarCodeKernel, pack, 12);
+
+    // any 32-bit value is a 16-base barcode
+    kernel_benchmark *unpack = CreateKernelBenchmark(&arena, Kernel_Benchmark_Items, 0xffffffff, 16);
+    RunKernelBenchmark("Unpack16BaseBarCode", Unpack16BaseBarCodeKernel, unpack, 16);
+
+    // the tree is keyed on the packed barcode itself
+    kernel_benchmark *tree = CreateKernelBenchmark(&arena, Kernel_Benchmark_Items, 1, 0);
+    ForLoop(Kernel_Benchmark_Items)
+    {
+        tree->values[index] = tree->barcodes[index];
+        tree->barcodes[index] = 0;
+    }
+    PrepareWavlTreeBenchmark(&arena, tree);
+    RunKernelBenchmark("WavlTreeInsertValue", WavlTreeInsertKernel, tree, sizeof(u32));
+
+    FreeMemoryArena(arena);
+}
+
 MainArgs
 {
     s32 exitCode = EXIT_SUCCESS;
     u08 logError = 0;
     char *logName = (char *)"HaploTag_to_16BaseBCs";
+    const char *prefix = 0;
+    const char *statsName = 0;
+    barcode_stats stats = {};
+    u08 benchmark = 0;
+    pipeline_options pipeline = {};
+
+    ForLoop(ArgCount - 1)
+    {
+        if (!strcmp(ArgBuffer[index + 1], "--stats"))
+        {
+            if (index < (ArgCount - 2)) statsName = ArgBuffer[index++ + 2];
+            else
+            {
+                PrintError("Error, stats option requires an argument");
+                exitCode = EXIT_FAILURE;
+                goto End;
+            }
+        }
+        else if (IsPipelineOption(ArgBuffer[index + 1]))
+        {
+            if (!ParsePipelineOption(&pipeline, ArgCount, ArgBuffer, &index))
+            {
+                exitCode = EXIT_FAILURE;
+                goto End;
+            }
+        }
+        else if (!strcmp(ArgBuffer[index + 1], "--benchmark")) benchmark = 1;
+        else if (!prefix) prefix = ArgBuffer[index + 1];
+    }
 
     if (ArgCount > 1 && AreNullTerminatedStringsEqual((u08 *)"--help", (u08 *)ArgBuffer[1])) 
     {
-        fprintf(stderr, ProgramName " " ProgramVersion "\nUsage: <fastq format> | " ProgramName " <prefix>? | <fastq format>\n\n");
+        fprintf(stderr, ProgramName " " ProgramVersion "\nUsage: <fastq format> | " ProgramName " [--stats <barcode stats>] [--io-buffers N] [--io-buffer-size MB] [--trace FILE] [--cpus LIST | --pin] <prefix>? | <fastq format>\n\n");
 
         fprintf(stderr, "Reads/writes fastq formatted reads from <stdin>/<stdout>.\n");
         fprintf(stderr, "Any read with a BX SAM tag in its comment field will be prepended by 23 bases; a 16-base barcode and 7 joining bases.\n\n");
@@ -135,7 +226,13 @@ MainArgs
 
         fprintf(stderr, "One log file: '%s' will created with an optional '<prefix>_' at the start of the file-name if supplied as an argument.\n", logName);
         fprintf(stderr, "The log file is a map between haplotag and 16-base barcodes.\n");
-        fprintf(stderr, "Run 'cut -f 2 HaploTag_to_16BaseBCs | tail -n +2 >16BaseBCs' to extract a list of barcodes suitable for passing as a substitute for a barcode whitelist to other programs.\n\n");
+        fprintf(stderr, "Run 'cut -f 2 HaploTag_to_16BaseBCs | tail -n +2 >16BaseBCs' to extract a list of barcodes suitable for passing as a substitute for a barcode whitelist to other programs.\n");
+        fprintf(stderr, "With '--stats SamHaplotag_BC_Stats', the binary barcode statistics written by 'SamHaplotag', the log lists every clear barcode in the statistics instead of collecting barcodes from the reads.\n");
+        fprintf(stderr, "'--io-buffers' and '--io-buffer-size' set the number (default %u) and size in MB (default %u) of the input/output buffers.\n", Default_IO_Buffers, Default_IO_Buffer_Size_MB);
+        fprintf(stderr, "'--trace FILE' writes a Chrome trace JSON timeline of the I/O tasks, parse blocks, barcode stats thread and waits to FILE at exit (chrome://tracing, ui.perfetto.dev).\n");
+        fprintf(stderr, "'--cpus LIST' pins the main thread, then the barcode stats thread and the input and output I/O threads as they are created, to the CPUs in LIST (e.g. 0-3) in order; '--pin' does the same with every CPU the process may run on, those on the main thread's NUMA node first.\n");
+        fprintf(stderr, "'--benchmark' times the barcode kernels on generated data, printing one JSON object per kernel to <stdout>, and exits.\n");
+        fprintf(stderr, "A report of each pipeline stage (input, parse, stats, output: busy and waited time, buffers, bytes and records), and of memory arena use (in use, peak and committed bytes), is printed at exit, and whenever the process receives SIGUSR1 (e.g. 'pkill -USR1 " ProgramName "').\n\n");
 
         fprintf(stderr, "Usage example:\n");
         fprintf(stderr, "samtools fastq -@ 16 -nT BX -0 /dev/null -s /dev/null tagged_reads_123.cram | " ProgramName " 123 | bgzip -@ 16 >16BaseBC_reads_123.fq.gz\n");
@@ -143,18 +240,42 @@ MainArgs
         goto End;
     }
 
+    if (benchmark)
+    {
+        RunKernelBenchmarks();
+        goto End;
+    }
+
     char logNameBuffer[256];
-    if (ArgCount > 1)
+    if (prefix)
     {
-        stbsp_snprintf((char *)logNameBuffer, (s32)sizeof(logNameBuffer), "%s_%s", ArgBuffer[1], logName);
+        stbsp_snprintf((char *)logNameBuffer, (s32)sizeof(logNameBuffer), "%s_%s", prefix, logName);
         logName = (char *)logNameBuffer;
     }
 
+    if (statsName)
+    {
+        if (!MapBarCodeStats(statsName, &stats))
+        {
+            PrintError("Error, '%s' is not a barcode statistics file", statsName);
+            exitCode = EXIT_FAILURE;
+            goto End;
+        }
+        PrintStatus("Barcode statistics: %s", statsName);
+    }
+
+    if (!StartPipeline(&pipeline))
+    {
+        exitCode = EXIT_FAILURE;
+        goto End;
+    }
+
     s32 log;
     if ((log = open((const char *)logName, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR)) > 0)
     {
         memory_arena workingSet;
         CreateMemoryArena(workingSet, MegaByte(512));
+        RegisterArena(&workingSet, "working");
         
         wavl_tree *barcodeTree = InitialiseWavlTree(&workingSet);
         transfer_buffer_pool *transferBufferPool = CreateTransferPool(&workingSet, barcodeTree);
@@ -165,8 +286,15 @@ MainArgs
 #else
         readPool->handle = STDIN_FILENO;
 #endif     
+        if (!MapInputFile(readPool)) EnableIORing(&workingSet, readPool, 0);
         buffer_pool *writePool = CreatePool(&workingSet);
         writePool->handle = STDOUT_FILENO;
+        EnableIORing(&workingSet, writePool, 1);
+
+        RegisterStage(&readPool->stats, "input");
+        stage_stats *parse = CreateStage(&workingSet, "parse");
+        RegisterStage(&transferBufferPool->bufferPool.stats, "stats");
+        RegisterStage(&writePool->stats, "output");
 
         char printNBuffers[2][32] = {{0}};
         u08 printNBufferPtr = 0;
@@ -182,9 +310,12 @@ MainArgs
         buffer *transferBuffer = GetNextTransferBuffer(transferBufferPool);
         u64 totalReads = 0;
         u64 bcAdded = 0;
+        BeginParse(parse);
         do
         {
             readBuffer = GetNextBuffer_Read(readPool);
+            CountBuffer(parse, readBuffer->size);
+            u64 parseStart = TraceStart();
 
             for (   u64 bufferIndex = 0;
                     bufferIndex < readBuffer->size;
@@ -242,11 +373,14 @@ MainArgs
 
                     if (barcode)
                     {
-                        transferBuffer->buffer[transferBuffer->size++] = ((u08 *)&barcode)[0];
-                        transferBuffer->buffer[transferBuffer->size++] = ((u08 *)&barcode)[1];
-                        transferBuffer->buffer[transferBuffer->size++] = ((u08 *)&barcode)[2];
-                        transferBuffer->buffer[transferBuffer->size++] = ((u08 *)&barcode)[3];
-                        if (transferBuffer->size == BufferSize) transferBuffer = GetNextTransferBuffer(transferBufferPool);
+                        if (!statsName)
+                        {
+                            transferBuffer->buffer[transferBuffer->size++] = ((u08 *)&barcode)[0];
+                            transferBuffer->buffer[transferBuffer->size++] = ((u08 *)&barcode)[1];
+                            transferBuffer->buffer[transferBuffer->size++] = ((u08 *)&barcode)[2];
+                            transferBuffer->buffer[transferBuffer->size++] = ((u08 *)&barcode)[3];
+                            if (transferBuffer->size == BufferSize) transferBuffer = GetNextTransferBuffer(transferBufferPool);
+                        }
                         
                         Unpack16BaseBarCode(barcode, tenx);
                     }
@@ -283,7 +417,10 @@ MainArgs
                     printNBufferPtr = otherPtr;
                 }
             }
+            parse->records = totalReads;
+            TraceEvent("parse", 0, "main", parseStart, readBuffer->size);
         } while (readBuffer->size);
+        EndParse(parse);
 
         GetNextBuffer_Write(writePool);
         if (Global_Write_Error)
@@ -304,7 +441,22 @@ MainArgs
                 goto End;
             }
 
-            TraverseLinkedList(WavlTreeGetBottom(barcodeTree)->next, wavl_node)
+            if (statsName) ForLoop(stats.nBarCodes) if (!stats.unclear[index])
+            {
+                u08 lineBuffer[30];
+                UnpackBarCode(stats.barcodes[index], lineBuffer);
+                lineBuffer[12] = '\t';
+                Unpack16BaseBarCode(stats.barcodes[index], lineBuffer + 13);
+                lineBuffer[29] = '\n';
+
+                if (WriteToLogFile(log, (char *)lineBuffer, 30))
+                {
+                    logError = 1;
+                    goto End;
+                }
+            }
+
+            if (!statsName) TraverseLinkedList(WavlTreeGetBottom(barcodeTree)->next, wavl_node)
             {
                 u08 lineBuffer[30];
                 UnpackBarCode(node->value, lineBuffer);
@@ -326,6 +478,9 @@ MainArgs
             PrintError("Error writing");
             exitCode = EXIT_FAILURE;
         }
+        PrintBufferPoolStats(readPool, 0);
+        PrintBufferPoolStats(writePool, 1);
+        WritePipelineReport();
     }
     else
     {
@@ -334,6 +489,11 @@ MainArgs
     }
 
 End:
+    if (Trace_Enabled && WriteTrace())
+    {
+        PrintError("Error writing trace file");
+        exitCode = EXIT_FAILURE;
+    }
     if (logError)
     {
         PrintError("Error writing log file");
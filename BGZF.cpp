@@ -0,0 +1,437 @@
+/*
+Copyright (c) 2021 Ed Harry, Wellcome Sanger Institute, Genome Research Limited
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include <zlib.h>
+
+// BGZF (blocked gzip), the container format of BAM
+// A BGZF stream is a series of independent gzip members holding at most 64KB of data each, so blocks are inflated/deflated in parallel and kept in stream order.
+// A codec is attached to a buffer_pool as its task: the pool's buffers then hold uncompressed data and the codec runs on the pool's I/O thread.
+
+#define BGZF_Max_Block_Size KiloByte(64)
+#define BGZF_Max_Block_Data 0xff00
+#define BGZF_Header_Size 18
+#define BGZF_Footer_Size 8
+#define BGZF_Compressed_Buffer_Size MegaByte(8)
+#define BGZF_Max_Blocks_Per_Run 4096
+#define BGZF_Tasks_Per_Thread 4
+
+global_variable
+u08
+BGZF_EOF[28] = {0x1f, 0x8b, 0x08, 0x04, 0x00, 0x00, 0x00, 0x00, 0x00, 0xff, 0x06, 0x00, 0x42, 0x43, 0x02, 0x00, 0x1b, 0x00, 0x03, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00};
+
+global_function
+u32
+ReadLE16(u08 *ptr)
+{
+    return((u32)ptr[0] | ((u32)ptr[1] << 8));
+}
+
+global_function
+u32
+ReadLE32(u08 *ptr)
+{
+    return((u32)ptr[0] | ((u32)ptr[1] << 8) | ((u32)ptr[2] << 16) | ((u32)ptr[3] << 24));
+}
+
+global_function
+void
+WriteLE32(u08 *ptr, u32 value)
+{
+    ptr[0] = (u08)value;
+    ptr[1] = (u08)(value >> 8);
+    ptr[2] = (u08)(value >> 16);
+    ptr[3] = (u08)(value >> 24);
+}
+
+struct
+bgzf_block
+{
+    u08 *in;
+    u08 *out;
+    u32 inSize;
+    u32 outSize;
+    u32 crc;
+    u32 pad;
+};
+
+struct
+bgzf_task
+{
+    z_stream stream;
+    bgzf_block *blocks;
+    u32 nBlocks;
+    u08 initialised;
+    u08 error;
+    u08 pad[2];
+};
+
+struct
+bgzf_codec
+{
+    thread_pool *pool;
+    bgzf_task *tasks;
+    bgzf_block *blocks;
+    u08 *data;
+    u64 dataStart;
+    u64 dataEnd;
+    struct iovec *spans;
+    u32 nTasks;
+    s32 level;
+    u08 error;
+    u08 eof;
+    u08 pad[6];
+};
+
+global_function
+bgzf_codec *
+CreateBGZFCodec(memory_arena *arena, u32 nThreads, u32 nBlocks)
+{
+    bgzf_codec *codec = PushStructP(arena, bgzf_codec);
+    codec->pool = ThreadPoolInit(arena, nThreads);
+    codec->nTasks = nThreads > 1 ? (nThreads * BGZF_Tasks_Per_Thread) : 1;
+    codec->tasks = PushArrayP(arena, bgzf_task, codec->nTasks);
+    ForLoop(codec->nTasks)
+    {
+        memset(&codec->tasks[index].stream, 0, sizeof(z_stream));
+        codec->tasks[index].initialised = 0;
+        codec->tasks[index].error = 0;
+    }
+    codec->blocks = PushArrayP(arena, bgzf_block, nBlocks);
+    codec->dataStart = 0;
+    codec->dataEnd = 0;
+    codec->spans = 0;
+    codec->level = Z_DEFAULT_COMPRESSION;
+    codec->error = 0;
+    codec->eof = 0;
+
+    return(codec);
+}
+
+// Returns the total size of the block starting at 'block', or 0 if it is not a BGZF block
+global_function
+u32
+BGZFBlockSize(u08 *block, u64 available)
+{
+    if (available < 12 || block[0] != 0x1f || block[1] != 0x8b || block[2] != 0x08 || !(block[3] & 0x04)) return(0);
+
+    u32 extraLength = ReadLE16(block + 10);
+    if (available < (12 + extraLength)) return(0);
+
+    u08 *extra = block + 12;
+    u08 *extraEnd = extra + extraLength;
+    while ((extra + 4) <= extraEnd)
+    {
+        u32 fieldLength = ReadLE16(extra + 2);
+        if (extra[0] == 'B' && extra[1] == 'C' && fieldLength == 2 && (extra + 6) <= extraEnd) return(ReadLE16(extra + 4) + 1);
+        extra += 4 + fieldLength;
+    }
+
+    return(0);
+}
+
+global_function
+u08
+IsBGZF(u08 *data, u64 size)
+{
+    return(size >= BGZF_Header_Size && BGZFBlockSize(data, size) != 0);
+}
+
+global_function
+void
+InflateBlocks(void *in)
+{
+    bgzf_task *task = (bgzf_task *)in;
+    z_stream *stream = &task->stream;
+
+    if (!task->initialised)
+    {
+        if (inflateInit2(stream, -15) != Z_OK)
+        {
+            task->error = 1;
+            return;
+        }
+        task->initialised = 1;
+    }
+
+    ForLoop(task->nBlocks)
+    {
+        bgzf_block *block = task->blocks + index;
+        if (!block->outSize) continue;
+
+        inflateReset(stream);
+        stream->next_in = block->in;
+        stream->avail_in = block->inSize;
+        stream->next_out = block->out;
+        stream->avail_out = block->outSize;
+
+        if (inflate(stream, Z_FINISH) != Z_STREAM_END || stream->avail_out || (u32)crc32(0, block->out, block->outSize) != block->crc)
+        {
+            task->error = 1;
+            return;
+        }
+    }
+}
+
+global_function
+void
+DeflateBlocks(void *in)
+{
+    bgzf_task *task = (bgzf_task *)in;
+    z_stream *stream = &task->stream;
+
+    ForLoop(task->nBlocks)
+    {
+        bgzf_block *block = task->blocks + index;
+
+        deflateReset(stream);
+        stream->next_in = block->in;
+        stream->avail_in = block->inSize;
+        stream->next_out = block->out + BGZF_Header_Size;
+        stream->avail_out = BGZF_Max_Block_Size - BGZF_Header_Size - BGZF_Footer_Size;
+
+        if (deflate(stream, Z_FINISH) != Z_STREAM_END)
+        {
+            task->error = 1;
+            return;
+        }
+
+        u32 size = BGZF_Header_Size + (u32)stream->total_out + BGZF_Footer_Size;
+        memcpy(block->out, BGZF_EOF, BGZF_Header_Size);
+        block->out[16] = (u08)(size - 1);
+        block->out[17] = (u08)((size - 1) >> 8);
+        WriteLE32(block->out + size - 8, (u32)crc32(0, block->in, block->inSize));
+        WriteLE32(block->out + size - 4, block->inSize);
+        block->outSize = size;
+    }
+}
+
+global_function
+void
+RunBGZFTasks(bgzf_codec *codec, u32 nBlocks, void (*function)(void *))
+{
+    u32 nTasks = Min(codec->nTasks, nBlocks);
+    u32 blockIndex = 0;
+    ForLoop(nTasks)
+    {
+        bgzf_task *task = codec->tasks + index;
+        u32 nextIndex = (u32)(((u64)nBlocks * (index + 1)) / nTasks);
+        task->blocks = codec->blocks + blockIndex;
+        task->nBlocks = nextIndex - blockIndex;
+        blockIndex = nextIndex;
+
+        ThreadPoolAddTask(codec->pool, function, task);
+    }
+    FenceIn(ThreadPoolWait(codec->pool));
+
+    ForLoop(nTasks) if (codec->tasks[index].error) codec->error = 1;
+}
+
+// Reader
+// Compressed input is staged in codec->data; whole blocks are inflated straight into the read buffer, which is filled as far as whole blocks allow.
+global_function
+void
+FillBuffer_BGZF(void *in)
+{
+    buffer_pool *pool = (buffer_pool *)in;
+    bgzf_codec *codec = (bgzf_codec *)pool->codec;
+    buffer *buffer = pool->buffers[pool->ioPtr];
+    buffer->size = 0;
+
+    while (!codec->error)
+    {
+        u32 nBlocks = 0;
+        u64 outSize = 0;
+        u08 full = 0;
+        while (nBlocks < BGZF_Max_Blocks_Per_Run)
+        {
+            u08 *block = codec->data + codec->dataStart;
+            u64 available = codec->dataEnd - codec->dataStart;
+            if (available < BGZF_Header_Size) break;
+
+            u32 blockSize = BGZFBlockSize(block, available);
+            if (blockSize < (BGZF_Header_Size + BGZF_Footer_Size))
+            {
+                codec->error = 1;
+                break;
+            }
+            if (blockSize > available) break;
+
+            // extra fields can push the deflate data's start past the footer
+            u32 headerSize = 12 + ReadLE16(block + 10);
+            if (blockSize < (headerSize + BGZF_Footer_Size))
+            {
+                codec->error = 1;
+                break;
+            }
+
+            u32 dataSize = ReadLE32(block + blockSize - 4);
+            if (dataSize > BGZF_Max_Block_Size)
+            {
+                codec->error = 1;
+                break;
+            }
+            if ((buffer->size + outSize + dataSize) > BufferSize)
+            {
+                full = 1;
+                break;
+            }
+
+            bgzf_block *job = codec->blocks + nBlocks++;
+            job->in = block + headerSize;
+            job->inSize = blockSize - headerSize - BGZF_Footer_Size;
+            job->out = buffer->buffer + buffer->size + outSize;
+            job->outSize = dataSize;
+            job->crc = ReadLE32(block + blockSize - 8);
+
+            outSize += dataSize;
+            codec->dataStart += blockSize;
+        }
+
+        if (nBlocks)
+        {
+            RunBGZFTasks(codec, nBlocks, InflateBlocks);
+            buffer->size += outSize;
+        }
+
+        if (codec->error || full || (buffer->size + BGZF_Max_Block_Size) > BufferSize) break;
+        if (nBlocks == BGZF_Max_Blocks_Per_Run) continue;
+
+        if (codec->eof)
+        {
+            if (codec->dataEnd > codec->dataStart) codec->error = 1;
+            break;
+        }
+
+        u64 remaining = codec->dataEnd - codec->dataStart;
+        memmove(codec->data, codec->data + codec->dataStart, remaining);
+        codec->dataStart = 0;
+        codec->dataEnd = remaining;
+
+        ssize_t bytesRead = read(pool->handle, codec->data + codec->dataEnd, BGZF_Compressed_Buffer_Size - codec->dataEnd);
+        if (bytesRead > 0) codec->dataEnd += (u64)bytesRead;
+        else
+        {
+            codec->eof = 1;
+            if (bytesRead < 0) codec->error = 1;
+        }
+    }
+
+    if (codec->error) buffer->size = 0;
+}
+
+global_function
+bgzf_codec *
+EnableBGZFInput(memory_arena *arena, buffer_pool *readPool, u32 nThreads, u08 *data, u64 size)
+{
+    bgzf_codec *codec = CreateBGZFCodec(arena, nThreads, BGZF_Max_Blocks_Per_Run);
+    if (readPool->map)
+    {
+        // blocks are inflated straight out of the mapping; there is nothing left to read
+        codec->data = readPool->map + readPool->mapOffset;
+        codec->dataEnd = readPool->mapSize - readPool->mapOffset;
+        codec->eof = 1;
+    }
+    else
+    {
+        codec->data = PushArrayP(arena, u08, BGZF_Compressed_Buffer_Size);
+        memcpy(codec->data, data, size);
+        codec->dataEnd = size;
+    }
+
+    readPool->codec = codec;
+    readPool->task = FillBuffer_BGZF;
+
+    return(codec);
+}
+
+// Writer
+// Each write buffer is cut into BGZF_Max_Block_Data sized blocks; compressed blocks are written out in order with OutputSpans.
+global_function
+void
+OutputBuffer_BGZF(void *in)
+{
+    buffer_pool *pool = (buffer_pool *)in;
+    bgzf_codec *codec = (bgzf_codec *)pool->codec;
+    buffer *buffer = pool->buffers[pool->ioPtr];
+    if (codec->error) Global_Write_Error = 1;
+    if (!buffer->size || Global_Write_Error) return;
+
+    u32 nBlocks = 0;
+    for (   u64 offset = 0;
+            offset < buffer->size;
+            offset += BGZF_Max_Block_Data )
+    {
+        bgzf_block *block = codec->blocks + nBlocks;
+        block->in = buffer->buffer + offset;
+        block->inSize = (u32)Min(BGZF_Max_Block_Data, buffer->size - offset);
+        block->out = codec->data + ((u64)nBlocks * BGZF_Max_Block_Size);
+        ++nBlocks;
+    }
+
+    RunBGZFTasks(codec, nBlocks, DeflateBlocks);
+    if (codec->error)
+    {
+        Global_Write_Error = 1;
+        return;
+    }
+
+    struct buffer compressed = {};
+    compressed.spans = codec->spans;
+    ForLoop(nBlocks)
+    {
+        compressed.spans[index].iov_base = codec->blocks[index].out;
+        compressed.spans[index].iov_len = codec->blocks[index].outSize;
+    }
+    compressed.nSpans = nBlocks;
+    OutputSpans(pool, &compressed);
+}
+
+global_function
+bgzf_codec *
+EnableBGZFOutput(memory_arena *arena, buffer_pool *writePool, u32 nThreads)
+{
+    // a whole write buffer is deflated in one run, which for large buffers is more than a reader's run
+    u32 maxBlocks = (BufferSize / BGZF_Max_Block_Data) + 1;
+    bgzf_codec *codec = CreateBGZFCodec(arena, nThreads, Max(BGZF_Max_Blocks_Per_Run, maxBlocks));
+    codec->data = PushArrayP(arena, u08, (u64)maxBlocks * BGZF_Max_Block_Size);
+    codec->spans = PushArrayP(arena, struct iovec, maxBlocks);
+
+    ForLoop(codec->nTasks)
+    {
+        if (deflateInit2(&codec->tasks[index].stream, codec->level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) codec->error = 1;
+        else codec->tasks[index].initialised = 1;
+    }
+
+    writePool->codec = codec;
+    writePool->task = OutputBuffer_BGZF;
+
+    return(codec);
+}
+
+// Waits for the last buffer to be written and closes the stream with the BGZF end-of-file marker
+global_function
+void
+FinishBGZFOutput(buffer_pool *writePool)
+{
+    FenceIn(ThreadPoolWait(writePool->pool));
+    if (!Global_Write_Error && (u64)write(writePool->handle, BGZF_EOF, sizeof(BGZF_EOF)) != sizeof(BGZF_EOF)) Global_Write_Error = 1;
+}
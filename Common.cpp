@@ -38,6 +38,14 @@ SOFTWARE.
 
 #include "WAVLTree.cpp"
 
+#include <errno.h>
+#include <time.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <signal.h>
+#ifdef __linux__
+#endif
+
 #define String_(x) #x
 #define String(x) String_(x)
 
@@ -71,17 +79,695 @@ buffer
 {
     u08 *buffer;
     u64 size;
+    struct iovec *spans;
+    task_handle task;
+    u32 nSpans;
+    u64 fragmentStart;
+};
+
+struct io_ring;
+
+// Buffer rings
+// A pool cycles through nBuffers buffers of BufferSize bytes. The caller holds one; the rest are queued for (or done with) I/O, so either side can run up to nBuffers - 1 buffers ahead of the other.
+// Both are set once at start-up (--io-buffers, --io-buffer-size). Each pool counts the time its caller was blocked on I/O and the time its I/O side sat idle, waiting on the caller.
+#define Default_IO_Buffers 4
+#define Max_IO_Buffers 64
+#define Default_IO_Buffer_Size_MB 16
+#define Max_IO_Buffer_Size_MB 1024
+
+global_variable
+u32
+IO_Buffers = Default_IO_Buffers;
+
+global_variable
+u64
+IO_Buffer_Size = MegaByte(Default_IO_Buffer_Size_MB);
+
+#define BufferSize IO_Buffer_Size
+
+global_function
+u08
+SetIOBuffers(const char *value)
+{
+    u32 n;
+    if (!StringToInt_Check((char *)value, &n) || n < 2 || n > Max_IO_Buffers) return(0);
+    IO_Buffers = n;
+    return(1);
+}
+
+global_function
+u08
+SetIOBufferSize(const char *value)
+{
+    u32 n;
+    if (!StringToInt_Check((char *)value, &n) || !n || n > Max_IO_Buffer_Size_MB) return(0);
+    IO_Buffer_Size = (u64)n << 20;
+    return(1);
+}
+
+// Thread placement
+// '--cpus LIST' pins the main thread, then each pool thread as it is created, to the CPUs of LIST in the order given.
+// '--pin' does the same over every CPU the process may run on, ordered by NUMA node starting with the main thread's, so the pipeline's threads share a node for as long as it has CPUs.
+#define Max_NUMA_Nodes 64
+
+// Parses a list such as "0-3,8,10-11" into cpus; returns the number of CPUs, or 0 if it is not a list of at most max CPUs below Max_Thread_CPUs
+global_function
+u32
+ParseCPUList(const char *list, u16 *cpus, u32 max)
+{
+    u32 nCPUs = 0;
+    const char *ptr = list;
+    for (;;)
+    {
+        char *end;
+        if (*ptr < '0' || *ptr > '9') return(0);
+        u64 first = strtoull(ptr, &end, 10);
+        u64 last = first;
+        if (*end == '-')
+        {
+            ptr = end + 1;
+            if (*ptr < '0' || *ptr > '9') return(0);
+            last = strtoull(ptr, &end, 10);
+        }
+        if (last < first || last >= Max_Thread_CPUs) return(0);
+
+        for (u64 cpu = first; cpu <= last; ++cpu)
+        {
+            if (nCPUs == max) return(0);
+            cpus[nCPUs++] = (u16)cpu;
+        }
+
+        if (*end == ',') ptr = end + 1;
+        else if (!*end || *end == '\n') break;
+        else return(0);
+    }
+
+    return(nCPUs);
+}
+
+// Fills nodes with the NUMA node of every CPU; all 0 without NUMA information
+global_function
+void
+ReadCPUNodes(u08 *nodes)
+{
+    memset(nodes, 0, Max_Thread_CPUs);
+#ifdef __linux__
+    ForLoop(Max_NUMA_Nodes)
+    {
+        char name[64];
+        stbsp_snprintf(name, sizeof(name), "/sys/devices/system/node/node%u/cpulist", index);
+        s32 handle = open(name, O_RDONLY);
+        if (handle < 0) continue;
+
+        char list[4096];
+        ssize_t size = read(handle, list, sizeof(list) - 1);
+        close(handle);
+        if (size <= 0) continue;
+        list[size] = 0;
+
+        u16 cpus[Max_Thread_CPUs];
+        u32 nCPUs = ParseCPUList(list, cpus, Max_Thread_CPUs);
+        ForLoop2(nCPUs) nodes[cpus[index2]] = (u08)index;
+    }
+#endif
+}
+
+// Sets the CPUs for --cpus (cpuList) or --pin (0) and pins the calling thread to the first; returns 0 if cpuList names a CPU the process can't run on, or pinning isn't supported
+global_function
+u08
+SetThreadPlacement(const char *cpuList)
+{
+#ifdef __linux__
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed)) return(0);
+
+    if (cpuList)
+    {
+        if (!(Thread_CPU_Count = ParseCPUList(cpuList, Thread_CPUs, Max_Thread_CPUs))) return(0);
+        ForLoop(Thread_CPU_Count) if (!CPU_ISSET(Thread_CPUs[index], &allowed))
+        {
+            Thread_CPU_Count = 0;
+            return(0);
+        }
+    }
+    else
+    {
+        u08 nodes[Max_Thread_CPUs];
+        ReadCPUNodes(nodes);
+        s32 cpu = sched_getcpu();
+        u32 firstNode = (cpu >= 0 && cpu < Max_Thread_CPUs) ? nodes[cpu] : 0;
+
+        Thread_CPU_Count = 0;
+        ForLoop(Max_NUMA_Nodes)
+        {
+            u32 node = (firstNode + index) % Max_NUMA_Nodes;
+            ForLoop2(Max_Thread_CPUs) if (CPU_ISSET(index2, &allowed) && nodes[index2] == node) Thread_CPUs[Thread_CPU_Count++] = (u16)index2;
+        }
+        if (!Thread_CPU_Count) return(0);
+    }
+
+    Thread_CPU_Next = 0;
+    PinThread(NextThreadCPU());
+    return(1);
+#else
+    (void)cpuList;
+    return(0);
+#endif
+}
+
+// Writes the placement as 'cpu:node' pairs in the order they are handed out
+global_function
+void
+FormatThreadPlacement(char *text, u32 size)
+{
+    u08 nodes[Max_Thread_CPUs];
+    ReadCPUNodes(nodes);
+
+    u32 length = (u32)stbsp_snprintf(text, (s32)size, "%u CPUs (cpu:node)", Thread_CPU_Count);
+    ForLoop(Thread_CPU_Count)
+    {
+        if (length >= size - 16)
+        {
+            stbsp_snprintf(text + length, (s32)(size - length), " ...");
+            break;
+        }
+        length += (u32)stbsp_snprintf(text + length, (s32)(size - length), "%s%u:%u", index ? "," : " ", Thread_CPUs[index], nodes[Thread_CPUs[index]]);
+    }
+}
+
+global_function
+u64
+GetNanoSeconds()
+{
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return(((u64)time.tv_sec * 1000000000) + (u64)time.tv_nsec);
+}
+
+// Tracing
+// With --trace FILE, each thread records an event per I/O task, parse block, worker task and wait into a ring of its own, claimed on its first event; only that thread writes to it, so recording takes no locks.
+// A full ring overwrites its oldest events. At exit the rings are written to FILE as Chrome trace JSON (chrome://tracing, ui.perfetto.dev), one track per thread.
+#define Max_Trace_Threads 64
+#define Trace_Ring_Events (1 << 15)
+#define Trace_Output_Size MegaByte(1)
+
+struct
+trace_event
+{
+    const char *name;
+    const char *stage;
+    u64 start;
+    u64 end;
+    u64 bytes;
+};
+
+struct
+trace_ring
+{
+    trace_event *events;
+    const char *thread;
+    volatile u64 nEvents;
+};
+
+global_variable
+u08
+Trace_Enabled = 0;
+
+global_variable
+s32
+Trace_Handle = -1;
+
+global_variable
+u64
+Trace_Start;
+
+global_variable
+memory_arena
+Trace_Arena;
+
+global_variable
+trace_ring *
+Trace_Rings;
+
+global_variable
+u32
+Trace_Ring_Count = 0;
+
+global_variable
+trace_ring
+Trace_Overflow_Ring = {};
+
+global_variable
+thread_local
+trace_ring *
+Thread_Trace_Ring = 0;
+
+global_function
+u08
+EnableTrace(const char *fileName)
+{
+    Trace_Handle = open(fileName, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+    if (Trace_Handle < 0) return(0);
+
+    // untouched ring pages are never faulted in, so threads that are never traced cost address space only
+    CreateMemoryArena(Trace_Arena, (Max_Trace_Threads * ((sizeof(trace_event) * Trace_Ring_Events) + sizeof(trace_ring))) + Trace_Output_Size);
+    Trace_Rings = PushArray(Trace_Arena, trace_ring, Max_Trace_Threads);
+    ForLoop(Max_Trace_Threads)
+    {
+        Trace_Rings[index].events = PushArray(Trace_Arena, trace_event, Trace_Ring_Events);
+        Trace_Rings[index].thread = 0;
+        Trace_Rings[index].nEvents = 0;
+    }
+
+    Trace_Start = GetNanoSeconds();
+    Trace_Enabled = 1;
+    return(1);
+}
+
+global_function
+u64
+TraceStart()
+{
+    return(Trace_Enabled ? GetNanoSeconds() : 0);
+}
+
+// Records an event from start to now on the calling thread's ring; thread names the ring when this is the thread's first event
+global_function
+void
+TraceEvent(const char *name, const char *stage, const char *thread, u64 start, u64 bytes)
+{
+    if (!Trace_Enabled) return;
+
+    trace_ring *ring = Thread_Trace_Ring;
+    if (!ring)
+    {
+        u32 index = __atomic_fetch_add(&Trace_Ring_Count, 1, __ATOMIC_RELAXED);
+        ring = index < Max_Trace_Threads ? (Trace_Rings + index) : &Trace_Overflow_Ring;
+        ring->thread = thread;
+        Thread_Trace_Ring = ring;
+    }
+    if (!ring->events) return;
+
+    u64 n = ring->nEvents;
+    trace_event *event = ring->events + (n & (Trace_Ring_Events - 1));
+    event->name = name;
+    event->stage = stage;
+    event->start = start;
+    event->end = GetNanoSeconds();
+    event->bytes = bytes;
+    __atomic_store_n(&ring->nEvents, n + 1, __ATOMIC_RELEASE);
+}
+
+// Writes the trace and closes the file; returns non-zero on a write error
+global_function
+u08
+WriteTrace()
+{
+    Trace_Enabled = 0;
+
+    u08 *output = PushArray(Trace_Arena, u08, Trace_Output_Size);
+    u64 size = 0;
+    u08 error = 0;
+    u64 nDropped = 0;
+
+    size += (u64)stbsp_snprintf((char *)output, 256, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"tid\":0,\"args\":{\"name\":\"" ProgramName "\"}}");
+
+    u32 nRings = Min(Trace_Ring_Count, Max_Trace_Threads);
+    ForLoop(nRings)
+    {
+        trace_ring *ring = Trace_Rings + index;
+        u64 nEvents = __atomic_load_n(&ring->nEvents, __ATOMIC_ACQUIRE);
+        u64 first = nEvents > Trace_Ring_Events ? nEvents - Trace_Ring_Events : 0;
+        nDropped += first;
+
+        size += (u64)stbsp_snprintf((char *)output + size, 256, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":\"%s %u\"}}", index + 1, ring->thread, index + 1);
+
+        for (   u64 eventIndex = first;
+                eventIndex < nEvents && !error;
+                ++eventIndex )
+        {
+            trace_event *event = ring->events + (eventIndex & (Trace_Ring_Events - 1));
+            u64 start = event->start > Trace_Start ? event->start - Trace_Start : 0;
+            u64 end = event->end > Trace_Start ? event->end - Trace_Start : 0;
+
+            size += (u64)stbsp_snprintf((char *)output + size, 256, ",\n{\"name\":\"%s%s%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"bytes\":%" PRIu64 "}}",
+                    event->name, event->stage ? " " : "", event->stage ? event->stage : "", index + 1, (f64)start / 1e3, (f64)(end - start) / 1e3, event->bytes);
+
+            if ((Trace_Output_Size - size) < 512)
+            {
+                error = (u64)write(Trace_Handle, output, size) != size;
+                size = 0;
+            }
+        }
+    }
+
+    size += (u64)stbsp_snprintf((char *)output + size, 256, "\n]}\n");
+    if (!error) error = (u64)write(Trace_Handle, output, size) != size;
+    close(Trace_Handle);
+
+    if (nDropped) PrintWarning("Trace: %" PRIu64 " oldest events were overwritten; only the last %u of each thread are kept", nDropped, Trace_Ring_Events);
+    if (Trace_Ring_Count > Max_Trace_Threads) PrintWarning("Trace: only the first %u threads were traced", Max_Trace_Threads);
+
+    return(error);
+}
+
+// Pipeline stages
+// Every handoff between stages (input, output, transfer to worker threads) counts the time its caller was blocked (wait), the time the other side spent working (busy) and the bytes, records and buffers passed through.
+// Counters are updated once per buffer, not per record. The parse stage is the main thread: its busy time is its run time less every wait it made at a handoff.
+// io_uring I/O runs in the kernel, which gives no timings, so ring pools are untimed: they report waits and idle time but no busy time.
+// Registered stages are reported at exit and whenever the process receives SIGUSR1; the report is formatted on the stack and written straight to stderr, so it is safe to print from the signal handler.
+// Registered memory arenas (or groups of them, such as per-thread shards) are reported after the stages, with the bytes in use, the peak and the bytes committed.
+// The handler can run on any thread in the middle of a registration, so a slot is filled in before the count that covers it is published (release), and the report loads the counts with acquire.
+#define Max_Pipeline_Stages 16
+#define Max_Reported_Arenas 8
+
+struct
+stage_stats
+{
+    const char *name;
+    u64 waitTime;
+    u64 nWaits;
+    u64 busyTime;
+    u64 idleTime;
+    u64 bytes;
+    u64 records;
+    u64 nBuffers;
+    volatile u64 waitStart;
+    u64 start;
+    u64 waitBase;
+    u08 untimed;
+    u08 pad[7];
+};
+
+global_variable
+stage_stats *
+Pipeline_Stages[Max_Pipeline_Stages];
+
+global_variable
+u32
+Pipeline_Stage_Count = 0;
+
+global_function
+void
+RegisterStage(stage_stats *stats, const char *name)
+{
+    stats->name = name;
+    u32 count = Pipeline_Stage_Count;
+    if (count < Max_Pipeline_Stages)
+    {
+        Pipeline_Stages[count] = stats;
+        __atomic_store_n(&Pipeline_Stage_Count, count + 1, __ATOMIC_RELEASE);
+    }
+}
+
+struct
+arena_report
+{
+    const char *name;
+    memory_arena **arenas;
+    memory_arena *arena;
+    u32 nArenas;
+    u32 pad;
 };
 
+global_variable
+arena_report
+Reported_Arenas[Max_Reported_Arenas];
+
+global_variable
+u32
+Reported_Arena_Count = 0;
+
+global_function
+void
+RegisterArenas(memory_arena **arenas, u32 nArenas, const char *name)
+{
+    u32 count = Reported_Arena_Count;
+    if (count < Max_Reported_Arenas)
+    {
+        arena_report *report = Reported_Arenas + count;
+        report->name = name;
+        report->arenas = arenas;
+        report->nArenas = nArenas;
+        __atomic_store_n(&Reported_Arena_Count, count + 1, __ATOMIC_RELEASE);
+    }
+}
+
+global_function
+void
+RegisterArena(memory_arena *arena, const char *name)
+{
+    if (Reported_Arena_Count < Max_Reported_Arenas)
+    {
+        Reported_Arenas[Reported_Arena_Count].arena = arena;
+        RegisterArenas(&Reported_Arenas[Reported_Arena_Count].arena, 1, name);
+    }
+}
+
+global_function
+stage_stats *
+CreateStage(memory_arena *arena, const char *name)
+{
+    stage_stats *stats = PushStructP(arena, stage_stats);
+    memset(stats, 0, sizeof(*stats));
+    RegisterStage(stats, name);
+    return(stats);
+}
+
+global_function
+void
+BeginWait(stage_stats *stats)
+{
+    stats->waitStart = GetNanoSeconds();
+}
+
+global_function
+void
+EndWait(stage_stats *stats)
+{
+    stats->waitTime += GetNanoSeconds() - stats->waitStart;
+    ++stats->nWaits;
+    TraceEvent("wait", stats->name, "main", stats->waitStart, 0);
+    stats->waitStart = 0;
+}
+
+global_function
+u64
+TotalWaitTime()
+{
+    u64 total = 0;
+    ForLoop(Pipeline_Stage_Count) total += Pipeline_Stages[index]->waitTime;
+    return(total);
+}
+
+// The parse stage runs from BeginParse to EndParse; waits made in between, at any stage, are not counted as parse time
+global_function
+void
+BeginParse(stage_stats *stats)
+{
+    stats->waitBase = TotalWaitTime();
+    stats->start = GetNanoSeconds();
+}
+
+global_function
+u64
+ParseBusyTime(stage_stats *stats)
+{
+    u64 elapsed = GetNanoSeconds() - stats->start;
+    u64 waited = TotalWaitTime() - stats->waitBase;
+    return(stats->busyTime + (elapsed > waited ? elapsed - waited : 0));
+}
+
+global_function
+void
+EndParse(stage_stats *stats)
+{
+    if (stats->start) stats->busyTime = ParseBusyTime(stats);
+    stats->start = 0;
+}
+
+global_function
+void
+WritePipelineReport()
+{
+    char line[512];
+    u64 now = GetNanoSeconds();
+    u32 nStages = __atomic_load_n(&Pipeline_Stage_Count, __ATOMIC_ACQUIRE);
+    u32 nArenas = __atomic_load_n(&Reported_Arena_Count, __ATOMIC_ACQUIRE);
+    ForLoop(nStages)
+    {
+        stage_stats *stats = Pipeline_Stages[index];
+        u64 waitStart = stats->waitStart;
+        f64 busy = (f64)(stats->start ? ParseBusyTime(stats) : stats->busyTime) / 1e9;
+        char busyBuffer[16];
+        if (stats->untimed) stbsp_snprintf(busyBuffer, sizeof(busyBuffer), "     n/a");
+        else stbsp_snprintf(busyBuffer, sizeof(busyBuffer), "%8.3f s", busy);
+
+        s32 n = stbsp_snprintf(line, sizeof(line), "[" ProgramName " Status] :: Stage %-6s busy %s, waited %8.3f s over %" PRIu64 " stalls, idle %8.3f s; %" PRIu64 " buffers, %$.1fB, %" PRIu64 " records",
+                stats->name, busyBuffer, (f64)stats->waitTime / 1e9, stats->nWaits, (f64)stats->idleTime / 1e9, stats->nBuffers, (f64)stats->bytes, stats->records);
+        if (waitStart && now > waitStart) n += stbsp_snprintf(line + n, (s32)sizeof(line) - n, "; blocked now for %.3f s", (f64)(now - waitStart) / 1e9);
+        line[n++] = '\n';
+        if (write(STDERR_FILENO, line, (u64)n) < 0) return;
+    }
+
+    ForLoop(nArenas)
+    {
+        arena_report *report = Reported_Arenas + index;
+        u64 current = 0, peak = 0, committed = 0;
+        ForLoop2(report->nArenas) if (report->arenas[index2])
+        {
+            u64 arenaCurrent, arenaPeak, arenaCommitted;
+            MemoryArenaUsage(report->arenas[index2], &arenaCurrent, &arenaPeak, &arenaCommitted);
+            current += arenaCurrent;
+            peak += arenaPeak;
+            committed += arenaCommitted;
+        }
+
+        s32 n = stbsp_snprintf(line, sizeof(line), "[" ProgramName " Status] :: Arena %-7s in use %$.1fB, peak %$.1fB, committed %$.1fB", report->name, (f64)current, (f64)peak, (f64)committed);
+        if (report->nArenas > 1) n += stbsp_snprintf(line + n, (s32)sizeof(line) - n, " over %u arenas", report->nArenas);
+        line[n++] = '\n';
+        if (write(STDERR_FILENO, line, (u64)n) < 0) return;
+    }
+}
+
+global_function
+void
+PipelineReportSignal(s32 signal)
+{
+    (void)signal;
+    s32 savedErrno = errno;
+    WritePipelineReport();
+    errno = savedErrno;
+}
+
+// Reports on SIGUSR1 from here on
+global_function
+void
+EnablePipelineReport()
+{
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = PipelineReportSignal;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGUSR1, &action, 0);
+}
+
+// Pipeline options
+// The options every pipeline tool takes: '--io-buffers N', '--io-buffer-size MB', '--trace FILE', '--cpus LIST' and '--pin'. A tool's argument loop hands them to ParsePipelineOption, then calls StartPipeline before creating any pools.
+struct
+pipeline_options
+{
+    const char *traceName;
+    const char *cpuList;
+    u08 pinThreads;
+    u08 pad[7];
+};
+
+global_function
+u08
+IsPipelineOption(const char *arg)
+{
+    return(!strcmp(arg, "--io-buffers") || !strcmp(arg, "--io-buffer-size") || !strcmp(arg, "--trace") || !strcmp(arg, "--cpus") || !strcmp(arg, "--pin"));
+}
+
+// Parses the pipeline option at argBuffer[*index + 1], stepping *index over its value; returns 0 (after printing an error) if the value is missing or invalid
+global_function
+u08
+ParsePipelineOption(pipeline_options *options, s32 argCount, const char **argBuffer, u32 *index)
+{
+    const char *arg = argBuffer[*index + 1];
+    const char *value = (s32)*index < (argCount - 2) ? argBuffer[*index + 2] : 0;
+    u08 result;
+
+    if (!strcmp(arg, "--pin"))
+    {
+        options->pinThreads = 1;
+        return(1);
+    }
+    else if (!strcmp(arg, "--io-buffers"))
+    {
+        if (!(result = value && SetIOBuffers(value))) PrintError("Error, io-buffers option requires an integer argument from 2 to %u", Max_IO_Buffers);
+    }
+    else if (!strcmp(arg, "--io-buffer-size"))
+    {
+        if (!(result = value && SetIOBufferSize(value))) PrintError("Error, io-buffer-size option requires an integer argument (MB) from 1 to %u", Max_IO_Buffer_Size_MB);
+    }
+    else if (!strcmp(arg, "--trace"))
+    {
+        if ((result = value != 0)) options->traceName = value;
+        else PrintError("Error, trace option requires an argument");
+    }
+    else
+    {
+        if ((result = value != 0)) options->cpuList = value;
+        else PrintError("Error, cpus option requires an argument");
+    }
+
+    if (result) ++*index;
+    return(result);
+}
+
+// Enables the stage report, the trace and thread placement, and reports the placement; returns 0 (after printing an error) if the trace file can't be opened or the threads can't be pinned
+global_function
+u08
+StartPipeline(pipeline_options *options)
+{
+    EnablePipelineReport();
+    if (options->traceName && !EnableTrace(options->traceName))
+    {
+        PrintError("Error opening trace file '%s'", options->traceName);
+        return(0);
+    }
+    if ((options->cpuList || options->pinThreads) && !SetThreadPlacement(options->cpuList))
+    {
+        PrintError("Error, can't pin threads to %s", options->cpuList ? options->cpuList : "the available CPUs");
+        return(0);
+    }
+    if (Thread_CPU_Count)
+    {
+        char placement[256];
+        FormatThreadPlacement(placement, sizeof(placement));
+        PrintStatus("Thread placement: %s", placement);
+    }
+
+    return(1);
+}
+
 struct
 buffer_pool
 {
     thread_pool *pool;
     s32 handle;
     u32 bufferPtr;
-    buffer *buffers[2];
+    buffer **buffers;
+    u32 nBuffers;
+    u32 ioPtr;
+    buffer_pool *writePool;
+    void (*task)(void *);
+    void *codec;
+    u08 *preload;
+    u64 preloadSize;
+    u08 *map;
+    u64 mapSize;
+    u64 mapOffset;
+    io_ring *ring;
+    stage_stats stats;
+    u64 lastIOEnd;
+    u08 zeroCopy;
+    volatile u08 writeError;
+    u08 started;
+    u08 pad[4];
 };
 
+global_function
+void
+TouchPoolBuffers(void *in)
+{
+    buffer_pool *pool = (buffer_pool *)in;
+    ForLoop(pool->nBuffers) FirstTouch(pool->buffers[index]->buffer, BufferSize);
+}
+
 global_function
 buffer_pool *
 CreatePool(memory_arena *arena)
@@ -89,63 +775,433 @@ CreatePool(memory_arena *arena)
     buffer_pool *pool = PushStructP(arena, buffer_pool);
     pool->pool = ThreadPoolInit(arena, 1);
 
-#define BufferSize MegaByte(16)
     pool->bufferPtr = 0;
-    pool->buffers[0] = PushStructP(arena, buffer);
-    pool->buffers[0]->buffer = PushArrayP(arena, u08, BufferSize);
-    pool->buffers[0]->size = 0;
-    pool->buffers[1] = PushStructP(arena, buffer);
-    pool->buffers[1]->buffer = PushArrayP(arena, u08, BufferSize);
-    pool->buffers[1]->size = 0;
+    pool->ioPtr = 0;
+    pool->nBuffers = IO_Buffers;
+    pool->buffers = PushArrayP(arena, buffer *, pool->nBuffers);
+    ForLoop(pool->nBuffers)
+    {
+        pool->buffers[index] = PushStructP(arena, buffer);
+        buffer *buffer = pool->buffers[index];
+        buffer->buffer = PushArrayP(arena, u08, BufferSize);
+        AdviseHugePages(buffer->buffer, BufferSize);
+        buffer->size = 0;
+        buffer->spans = 0;
+        buffer->nSpans = 0;
+        buffer->fragmentStart = 0;
+        buffer->task.done = 1;
+    }
+    // with placement on, the I/O worker touches the buffers first, putting them on its node
+    if (Thread_CPU_Count)
+    {
+        ThreadPoolAddTask(pool->pool, TouchPoolBuffers, pool);
+        ThreadPoolWait(pool->pool);
+    }
+    pool->writePool = 0;
+    pool->task = 0;
+    pool->codec = 0;
+    pool->preload = 0;
+    pool->preloadSize = 0;
+    pool->map = 0;
+    pool->mapSize = 0;
+    pool->mapOffset = 0;
+    pool->ring = 0;
+    memset(&pool->stats, 0, sizeof(pool->stats));
+    pool->stats.name = "";
+    pool->lastIOEnd = 0;
+    pool->started = 0;
+    pool->zeroCopy = 0;
+    pool->writeError = 0;
 
     return(pool);
 }
 
+// Zero-copy output
+// A zero-copy write pool does not copy pass-through data; its buffers hold a list of spans that point either into a read buffer or at bytes generated into the buffer itself (fragments).
+// Spans are flushed with writev, which copies them into the kernel, so a buffer can be reused as soon as it has been written. vmsplice is not used: a pipe would only borrow the pages, and a reader that splices them onward keeps referencing them after the pipe is empty.
+// Read buffers linked to the write pool are not refilled until it has been written out.
+#define Max_Write_Spans 65536
+
+global_function
+void
+EnableZeroCopy(memory_arena *arena, buffer_pool *writePool, buffer_pool *readPool)
+{
+    ForLoop(writePool->nBuffers)
+    {
+        writePool->buffers[index]->spans = PushArrayP(arena, struct iovec, Max_Write_Spans);
+        writePool->buffers[index]->nSpans = 0;
+        writePool->buffers[index]->fragmentStart = 0;
+    }
+    writePool->zeroCopy = 1;
+    if (readPool) readPool->writePool = writePool;
+
+#ifdef __linux__
+    // fewer, larger writes into a pipe
+    struct stat fileStat;
+    if (!fstat(writePool->handle, &fileStat) && S_ISFIFO(fileStat.st_mode)) fcntl(writePool->handle, F_SETPIPE_SZ, MegaByte(1));
+#endif
+}
+
+global_function
+void
+CloseFragment(buffer *buffer)
+{
+    if (buffer->size > buffer->fragmentStart)
+    {
+        buffer->spans[buffer->nSpans].iov_base = buffer->buffer + buffer->fragmentStart;
+        buffer->spans[buffer->nSpans++].iov_len = buffer->size - buffer->fragmentStart;
+        buffer->fragmentStart = buffer->size;
+    }
+}
+
 global_function
 void
 FillBuffer(void *in)
 {
     buffer_pool *pool = (buffer_pool *)in;
-    buffer *buffer = pool->buffers[pool->bufferPtr];
-    buffer->size = (u64)read(pool->handle, buffer->buffer, BufferSize);
+    if (pool->writePool) ThreadPoolWait(pool->writePool->pool);
+    buffer *buffer = pool->buffers[pool->ioPtr];
+
+    // bytes already taken from the input (e.g. to detect its format) go first
+    u64 preloadSize = pool->preloadSize;
+    if (preloadSize)
+    {
+        memcpy(buffer->buffer, pool->preload, preloadSize);
+        pool->preloadSize = 0;
+    }
+
+    ssize_t bytesRead = read(pool->handle, buffer->buffer + preloadSize, BufferSize - preloadSize);
+    buffer->size = preloadSize + (bytesRead > 0 ? (u64)bytesRead : 0);
+}
+
+// Mapped input
+// A regular file is mapped whole and read buffers become views into the mapping, so records are parsed in place without a copy.
+// The mapping is private and lives until exit, so views stay valid for any write spans that point into them.
+global_function
+u08
+MapInputFile(buffer_pool *pool)
+{
+    struct stat fileStat;
+    if (fstat(pool->handle, &fileStat) || !S_ISREG(fileStat.st_mode)) return(0);
+
+    off_t offset = lseek(pool->handle, 0, SEEK_CUR);
+    if (offset < 0 || (u64)offset >= (u64)fileStat.st_size) return(0);
+
+    void *map = mmap(0, (size_t)fileStat.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, pool->handle, 0);
+    if (map == MAP_FAILED) return(0);
+
+    madvise(map, (size_t)fileStat.st_size, MADV_SEQUENTIAL);
+#ifdef MADV_HUGEPAGE
+    madvise(map, (size_t)fileStat.st_size, MADV_HUGEPAGE);
+#endif
+
+    pool->map = (u08 *)map;
+    pool->mapSize = (u64)fileStat.st_size;
+    pool->mapOffset = (u64)offset;
+
+    return(1);
+}
+
+global_function
+void
+FillBuffer_Mapped(buffer_pool *pool, buffer *buffer)
+{
+    buffer->buffer = pool->map + pool->mapOffset;
+    buffer->size = Min(BufferSize, pool->mapSize - pool->mapOffset);
+    pool->mapOffset += buffer->size;
 }
 
 global_variable
 u08
 Global_Write_Error = 0;
 
+global_function
+void
+OutputSpans(buffer_pool *pool, buffer *buffer)
+{
+    CloseFragment(buffer);
+
+    struct iovec *spans = buffer->spans;
+    u32 nSpans = buffer->nSpans;
+    while (nSpans && !Global_Write_Error)
+    {
+        u32 n = Min(nSpans, 1024);
+        ssize_t written = writev(pool->handle, spans, (s32)n);
+        if (written < 0)
+        {
+            if (errno == EINTR) continue;
+            Global_Write_Error = 1;
+            break;
+        }
+
+        u64 remaining = (u64)written;
+        while (nSpans && remaining >= spans->iov_len)
+        {
+            remaining -= spans->iov_len;
+            ++spans;
+            --nSpans;
+        }
+        if (remaining)
+        {
+            spans->iov_base = (u08 *)spans->iov_base + remaining;
+            spans->iov_len -= remaining;
+        }
+    }
+
+    buffer->nSpans = 0;
+    buffer->fragmentStart = 0;
+}
+
 global_function
 void
 OutputBuffer(void *in)
 {
     buffer_pool *pool = (buffer_pool *)in;
-    buffer *buffer = pool->buffers[pool->bufferPtr];
-    if ((u64)write(pool->handle, buffer->buffer, buffer->size) != buffer->size) Global_Write_Error = 1;
+    buffer *buffer = pool->buffers[pool->ioPtr];
+    if (pool->zeroCopy) OutputSpans(pool, buffer);
+    else if ((u64)write(pool->handle, buffer->buffer, buffer->size) != buffer->size) Global_Write_Error = 1;
+}
+
+#include "IORing.cpp"
+
+global_function
+void
+CountBuffer(stage_stats *stats, u64 bytes)
+{
+    if (bytes)
+    {
+        stats->bytes += bytes;
+        ++stats->nBuffers;
+    }
+}
+
+// Bytes held by a write buffer, including those its spans point at
+global_function
+u64
+BufferBytes(buffer_pool *pool, buffer *buffer)
+{
+    if (!pool->zeroCopy) return(buffer->size);
+
+    u64 bytes = buffer->size - buffer->fragmentStart;
+    ForLoop(buffer->nSpans) bytes += buffer->spans[index].iov_len;
+    return(bytes);
 }
 
+// I/O tasks run in the order they were queued on the pool's one thread, so ioPtr follows the buffers they were queued for
+global_function
+void
+RunIOTask(buffer_pool *pool, void (*task)(void *), const char *name, u08 output)
+{
+    u64 start = GetNanoSeconds();
+    if (pool->lastIOEnd) pool->stats.idleTime += start - pool->lastIOEnd;
+
+    buffer *buffer = pool->buffers[pool->ioPtr];
+    u64 bytes = (output && Trace_Enabled) ? BufferBytes(pool, buffer) : 0;
+
+    task(pool);
+
+    TraceEvent(name, 0, *pool->stats.name ? pool->stats.name : "I/O", start, output ? bytes : buffer->size);
+    pool->ioPtr = (pool->ioPtr + 1) % pool->nBuffers;
+    pool->lastIOEnd = GetNanoSeconds();
+    pool->stats.busyTime += pool->lastIOEnd - start;
+}
+
+global_function
+void
+FillTask(void *in)
+{
+    buffer_pool *pool = (buffer_pool *)in;
+    RunIOTask(pool, pool->task ? pool->task : FillBuffer, "FillBuffer", 0);
+}
+
+global_function
+void
+OutputTask(void *in)
+{
+    buffer_pool *pool = (buffer_pool *)in;
+    RunIOTask(pool, pool->task ? pool->task : OutputBuffer, "OutputBuffer", 1);
+}
+
+global_function
+void
+QueueIOTask(buffer_pool *pool, u32 index, void (*task)(void *))
+{
+    ThreadPoolAddTaskWithHandle(pool->pool, task, pool, &pool->buffers[index]->task);
+}
+
+// Takes a buffer back from the I/O thread, counting the wait if its I/O had not finished
+global_function
+void
+WaitForBuffer(buffer_pool *pool, buffer *buffer)
+{
+    if (TaskDone(&buffer->task)) return;
+
+    BeginWait(&pool->stats);
+    FenceIn(ThreadPoolWaitTask(pool->pool, &buffer->task));
+    EndWait(&pool->stats);
+}
+
+// The first call hands out an empty buffer while the others are filled
 global_function
 buffer *
 GetNextBuffer_Read(buffer_pool *pool)
 {
-    FenceIn(ThreadPoolWait(pool->pool));
+    if (pool->ring)
+    {
+        buffer *buffer = GetNextBuffer_Read_Ring(pool);
+        CountBuffer(&pool->stats, buffer->size);
+        return(buffer);
+    }
+
+    u08 mapped = pool->map && !pool->task;
+    if (!pool->started)
+    {
+        pool->started = 1;
+        pool->bufferPtr = 0;
+        pool->ioPtr = 1;
+        pool->buffers[0]->size = 0;
+        if (!mapped) ForLoop(pool->nBuffers - 1) QueueIOTask(pool, index + 1, FillTask);
+        return(pool->buffers[0]);
+    }
+
+    if (!mapped) QueueIOTask(pool, pool->bufferPtr, FillTask);
+    pool->bufferPtr = (pool->bufferPtr + 1) % pool->nBuffers;
     buffer *buffer = pool->buffers[pool->bufferPtr];
-    pool->bufferPtr = (pool->bufferPtr + 1) & 1;
-    ThreadPoolAddTask(pool->pool, FillBuffer, pool);
+    if (mapped) FillBuffer_Mapped(pool, buffer);
+    else WaitForBuffer(pool, buffer);
+    CountBuffer(&pool->stats, buffer->size);
     return(buffer);
 }
 
+// Hands over the caller's buffer to be written and returns the next one; handing over an empty buffer waits for everything queued to be written
 global_function
 buffer *
 GetNextBuffer_Write(buffer_pool *pool)
 {
-    FenceIn(ThreadPoolWait(pool->pool));
     buffer *buffer = pool->buffers[pool->bufferPtr];
-    pool->bufferPtr = (pool->bufferPtr + 1) & 1;
-    ThreadPoolAddTask(pool->pool, OutputBuffer, pool);
+    if (pool->started) CountBuffer(&pool->stats, BufferBytes(pool, buffer));
+    if (pool->ring) return(GetNextBuffer_Write_Ring(pool));
+
+    if (!pool->started)
+    {
+        pool->started = 1;
+        pool->ioPtr = pool->bufferPtr;
+    }
+    else if (buffer->size || buffer->nSpans)
+    {
+        QueueIOTask(pool, pool->bufferPtr, OutputTask);
+        pool->bufferPtr = (pool->bufferPtr + 1) % pool->nBuffers;
+        buffer = pool->buffers[pool->bufferPtr];
+        WaitForBuffer(pool, buffer);
+    }
+    else
+    {
+        u08 pending = 0;
+        ForLoop(pool->nBuffers) pending |= !TaskDone(&pool->buffers[index]->task);
+        if (pending)
+        {
+            BeginWait(&pool->stats);
+            ForLoop(pool->nBuffers) ThreadPoolWaitTask(pool->pool, &pool->buffers[index]->task);
+            ThreadFence;
+            EndWait(&pool->stats);
+        }
+    }
+
     buffer->size = 0;
     return(buffer);
 }
 
+global_function
+void
+PrintBufferPoolStats(buffer_pool *pool, u08 output)
+{
+    PrintStatus("%s buffers: %u x %" PRIu64 " MB; waited %.3f s for %s over %" PRIu64 " stalls; %s idle %.3f s %s",
+            output ? "Output" : "Input", pool->nBuffers, (u64)BufferSize >> 20, (f64)pool->stats.waitTime / 1e9, output ? "output" : "input", pool->stats.nWaits,
+            output ? "writer" : "reader", (f64)pool->stats.idleTime / 1e9, output ? "with nothing to write" : "with every buffer full");
+}
+
+// Copies generated or short-lived data into a write buffer. Without a pool the buffer must already have room for it.
+global_function
+buffer *
+CopyToWriteBuffer(buffer_pool *pool, buffer *buffer, u08 *data, u64 size)
+{
+    if (!pool)
+    {
+        memcpy(buffer->buffer + buffer->size, data, size);
+        buffer->size += size;
+        return(buffer);
+    }
+
+    while (size)
+    {
+        u64 n = Min(size, BufferSize - buffer->size);
+        memcpy(buffer->buffer + buffer->size, data, n);
+        buffer->size += n;
+        data += n;
+        size -= n;
+        if (BufferSize == buffer->size) buffer = GetNextBuffer_Write(pool);
+    }
+    return(buffer);
+}
+
+// Appends pass-through data to a write buffer. With a zero-copy pool the data is referenced rather than copied, so must stay valid until the buffer has been written.
+global_function
+buffer *
+AppendToWriteBuffer(buffer_pool *pool, buffer *buffer, u08 *data, u64 size)
+{
+    if (pool && pool->zeroCopy)
+    {
+        if ((buffer->nSpans + 2) > Max_Write_Spans) buffer = GetNextBuffer_Write(pool);
+        CloseFragment(buffer);
+
+        struct iovec *last = buffer->nSpans ? (buffer->spans + buffer->nSpans - 1) : 0;
+        if (last && ((u08 *)last->iov_base + last->iov_len) == data) last->iov_len += size;
+        else
+        {
+            buffer->spans[buffer->nSpans].iov_base = data;
+            buffer->spans[buffer->nSpans++].iov_len = size;
+        }
+    }
+    else buffer = CopyToWriteBuffer(pool, buffer, data, size);
+
+    return(buffer);
+}
+
+// Barcode formatting
+// Two ASCII digits per value as a little-endian u16 ("00".."99"); haplotag barcode groups only go up to 96, so 100..127 just wrap.
+global_variable
+u16
+Barcode_Digits[128] =
+{
+0x3030, 0x3130, 0x3230, 0x3330, 0x3430, 0x3530, 0x3630, 0x3730, 0x3830, 0x3930, 0x3031, 0x3131, 0x3231, 0x3331, 0x3431, 0x3531,
+0x3631, 0x3731, 0x3831, 0x3931, 0x3032, 0x3132, 0x3232, 0x3332, 0x3432, 0x3532, 0x3632, 0x3732, 0x3832, 0x3932, 0x3033, 0x3133,
+0x3233, 0x3333, 0x3433, 0x3533, 0x3633, 0x3733, 0x3833, 0x3933, 0x3034, 0x3134, 0x3234, 0x3334, 0x3434, 0x3534, 0x3634, 0x3734,
+0x3834, 0x3934, 0x3035, 0x3135, 0x3235, 0x3335, 0x3435, 0x3535, 0x3635, 0x3735, 0x3835, 0x3935, 0x3036, 0x3136, 0x3236, 0x3336,
+0x3436, 0x3536, 0x3636, 0x3736, 0x3836, 0x3936, 0x3037, 0x3137, 0x3237, 0x3337, 0x3437, 0x3537, 0x3637, 0x3737, 0x3837, 0x3937,
+0x3038, 0x3138, 0x3238, 0x3338, 0x3438, 0x3538, 0x3638, 0x3738, 0x3838, 0x3938, 0x3039, 0x3139, 0x3239, 0x3339, 0x3439, 0x3539,
+0x3639, 0x3739, 0x3839, 0x3939, 0x3030, 0x3130, 0x3230, 0x3330, 0x3430, 0x3530, 0x3630, 0x3730, 0x3830, 0x3930, 0x3031, 0x3131,
+0x3231, 0x3331, 0x3431, 0x3531, 0x3631, 0x3731, 0x3831, 0x3931, 0x3032, 0x3132, 0x3232, 0x3332, 0x3432, 0x3532, 0x3632, 0x3732
+};
+
+// Writes the 12 byte barcode name 'AxxCxxBxxDxx' into buff
+global_function
+void
+FormatBarCode(u08 *buff, u08 a, u08 c, u08 b, u08 d)
+{
+    u64 head = (u64)'A' | ((u64)Barcode_Digits[a & 127] << 8) | ((u64)'C' << 24) | ((u64)Barcode_Digits[c & 127] << 32) | ((u64)'B' << 48) | ((u64)(Barcode_Digits[b & 127] & 0xff) << 56);
+    u32 tail = (u32)(Barcode_Digits[b & 127] >> 8) | ((u32)'D' << 8) | ((u32)Barcode_Digits[d & 127] << 16);
+    memcpy(buff, &head, sizeof(head));
+    memcpy(buff + 8, &tail, sizeof(tail));
+}
+
+// Barcodes packed as (a << 24) | (c << 16) | (b << 8) | d
+global_function
+void
+FormatPackedBarCode(u08 *buff, u32 barcode)
+{
+    FormatBarCode(buff, (u08)(barcode >> 24), (u08)(barcode >> 16), (u08)(barcode >> 8), (u08)barcode);
+}
+
 global_function
 u08
 WriteToLogFile(s32 handle, void *buffer, u64 size)
@@ -153,3 +1209,207 @@ WriteToLogFile(s32 handle, void *buffer, u64 size)
     return((u64)write(handle, buffer, size) != size);
 }
 
+// Task for pools writing to a log file rather than the main output, so a failed write is only reported against that log
+global_function
+void
+OutputLogBuffer(void *in)
+{
+    buffer_pool *pool = (buffer_pool *)in;
+    buffer *buffer = pool->buffers[pool->ioPtr];
+    if (!pool->writeError && WriteToLogFile(pool->handle, buffer->buffer, buffer->size)) pool->writeError = 1;
+}
+
+// Binary barcode statistics
+// Written by SamHaplotag next to its text logs: a header, then nBarCodes packed barcodes in ascending order followed by their correct, corrected and unclear counts, each a u32 column (little-endian).
+// Readers map the file and binary search the barcode column.
+#define BarCode_Stats_Magic "HTBCSTS1"
+
+struct
+barcode_stats_header
+{
+    u08 magic[8];
+    u32 nBarCodes;
+    u32 pad;
+};
+
+struct
+barcode_stats
+{
+    u32 *barcodes;
+    u32 *correct;
+    u32 *corrected;
+    u32 *unclear;
+    u32 nBarCodes;
+    u32 pad;
+};
+
+global_function
+u08
+IsBarCodeStatsFile(const char *fileName)
+{
+    u08 magic[8];
+    s32 file = open(fileName, O_RDONLY);
+    u08 result = file >= 0 && read(file, magic, sizeof(magic)) == (ssize_t)sizeof(magic) && !memcmp(magic, BarCode_Stats_Magic, sizeof(magic));
+    if (file >= 0) close(file);
+    return(result);
+}
+
+// Returns 0 if fileName is not a complete barcode statistics file
+global_function
+u08
+MapBarCodeStats(const char *fileName, barcode_stats *stats)
+{
+    u08 result = 0;
+    s32 file = open(fileName, O_RDONLY);
+    if (file >= 0)
+    {
+        struct stat fileStat;
+        if (!fstat(file, &fileStat) && (u64)fileStat.st_size >= sizeof(barcode_stats_header))
+        {
+            void *map = mmap(0, (size_t)fileStat.st_size, PROT_READ, MAP_PRIVATE, file, 0);
+            if (map != MAP_FAILED)
+            {
+                barcode_stats_header *header = (barcode_stats_header *)map;
+                if (!memcmp(header->magic, BarCode_Stats_Magic, sizeof(header->magic)) && (u64)fileStat.st_size == sizeof(barcode_stats_header) + (16 * (u64)header->nBarCodes))
+                {
+                    stats->nBarCodes = header->nBarCodes;
+                    stats->barcodes = (u32 *)(header + 1);
+                    stats->correct = stats->barcodes + stats->nBarCodes;
+                    stats->corrected = stats->correct + stats->nBarCodes;
+                    stats->unclear = stats->corrected + stats->nBarCodes;
+                    result = 1;
+                }
+                else munmap(map, (size_t)fileStat.st_size);
+            }
+        }
+        close(file);
+    }
+    return(result);
+}
+
+// Returns the row of barcode in stats, or -1
+global_function
+s64
+FindBarCodeInStats(barcode_stats *stats, u32 barcode)
+{
+    u32 *rows = stats->barcodes;
+    u32 n = stats->nBarCodes;
+    while (n > 1)
+    {
+        u32 half = n / 2;
+        if (rows[half] <= barcode) rows += half;
+        n -= half;
+    }
+    return((n && *rows == barcode) ? (s64)(rows - stats->barcodes) : -1);
+}
+
+
+// Kernel benchmarks
+// With '--benchmark' a tool times its hot kernels on generated inputs and prints one JSON object per kernel to <stdout>, so builds can be compared ('meson test --benchmark').
+// A kernel is run over nItems inputs per pass, once to warm up and then for as many passes as fit in Benchmark_Min_Time.
+#define Benchmark_Min_Time 250000000
+#define Kernel_Benchmark_Items (1 << 18)
+
+// Kernels fold their results into the sink so their work can't be optimised away
+global_variable
+volatile u64
+Benchmark_Sink;
+
+// splitmix64
+global_function
+u64
+NextRandom(u64 *state)
+{
+    u64 z = (*state += 0x9e3779b97f4a7c15);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+    return(z ^ (z >> 31));
+}
+
+struct
+kernel_benchmark
+{
+    u32 *values;
+    u32 *barcodes;
+    u08 *bytes;
+    void *table;
+    memory_arena *arena;
+    memory_arena_snapshot snapshot;
+    u64 nItems;
+};
+
+// Random packed barcodes with every group from 1 to 96, values uniform on [0, maxValue) and space for bytesPerItem bytes of input or output per item
+global_function
+kernel_benchmark *
+CreateKernelBenchmark(memory_arena *arena, u64 nItems, u32 maxValue, u32 bytesPerItem)
+{
+    kernel_benchmark *bench = PushStructP(arena, kernel_benchmark);
+    bench->nItems = nItems;
+    bench->values = PushArrayP(arena, u32, nItems);
+    bench->barcodes = PushArrayP(arena, u32, nItems);
+    bench->bytes = bytesPerItem ? PushArrayP(arena, u08, nItems * bytesPerItem) : 0;
+    bench->table = 0;
+    bench->arena = 0;
+
+    u64 state = 0x5eed;
+    ForLoop64(nItems)
+    {
+        u64 random = NextRandom(&state);
+        bench->values[index] = (u32)((random >> 32) % maxValue);
+        ForLoop2(4) bench->barcodes[index] = (bench->barcodes[index] << 8) | ((u32)(((random >> (8 * index2)) & 0xff) % 96) + 1);
+    }
+
+    return(bench);
+}
+
+global_function
+void
+RunKernelBenchmark(const char *kernelName, void (*kernel)(void *, u64), kernel_benchmark *bench, u32 bytesPerItem)
+{
+    kernel(bench, bench->nItems);
+
+    u64 nPasses = 0;
+    u64 start = GetNanoSeconds();
+    u64 time;
+    do
+    {
+        kernel(bench, bench->nItems);
+        ++nPasses;
+    } while ((time = GetNanoSeconds() - start) < Benchmark_Min_Time);
+
+    f64 items = (f64)bench->nItems * (f64)nPasses;
+    f64 seconds = (f64)time / 1e9;
+    printf("{\"program\": \"" ProgramName "\", \"kernel\": \"%s\", \"items\": %.0f, \"seconds\": %.3f, \"ns_per_item\": %.3f, \"items_per_s\": %.0f, \"mb_per_s\": %.1f}\n",
+            kernelName, items, seconds, (f64)time / items, items / seconds, (items * (f64)bytesPerItem) / (seconds * 1e6));
+}
+
+// BX formatting, 12 bytes per barcode
+global_function
+void
+FormatBarCodeKernel(void *in, u64 n)
+{
+    kernel_benchmark *bench = (kernel_benchmark *)in;
+    ForLoop64(n) FormatPackedBarCode(bench->bytes + (12 * index), bench->barcodes[index]);
+    Benchmark_Sink = Benchmark_Sink + bench->bytes[(12 * n) - 1];
+}
+
+// Builds a fresh tree of (value, barcode) each pass, in an arena rewound to its snapshot
+global_function
+void
+WavlTreeInsertKernel(void *in, u64 n)
+{
+    kernel_benchmark *bench = (kernel_benchmark *)in;
+    RestoreMemoryArenaFromSnapshot(bench->arena, &bench->snapshot);
+    wavl_tree *tree = InitialiseWavlTree(bench->arena);
+    ForLoop64(n) WavlTreeInsertValue(bench->arena, tree, bench->values[index], bench->barcodes[index]);
+    Benchmark_Sink = Benchmark_Sink + tree->count;
+}
+
+// Room for a tree of every item; each item pushes at most a wavl_node and a barcode_ll_node, each with alignment and size overhead
+global_function
+void
+PrepareWavlTreeBenchmark(memory_arena *arena, kernel_benchmark *bench)
+{
+    bench->arena = PushSubArenaP(arena, ((bench->nItems + 1) * (sizeof(wavl_node) + sizeof(barcode_ll_node) + 64)) + sizeof(wavl_tree) + 64);
+    TakeMemoryArenaSnapshot(bench->arena, &bench->snapshot);
+}
@@ -0,0 +1,494 @@
+/*
+Copyright (c) 2021 Ed Harry, Wellcome Sanger Institute, Genome Research Limited
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#define ProgramName "HaplotagBench"
+
+#include "Common.cpp"
+
+#define ProgramVersion String(PV)
+
+#include "BC.cpp"
+#include "BGZF.cpp"
+#include "ReadGen.cpp"
+
+#include <dirent.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+// Benchmark runs
+// Each run execs the program in a scratch directory (where its logs land) with the corpus as <stdin> and <stdout> to /dev/null (or a scratch file, to be checked), and reports one JSON object to <stdout>.
+// Stage times are read from the buffer statistics the program prints to <stderr>; the last Run_Log_Size bytes of <stderr> are kept and echoed if a run fails.
+#define Run_Log_Size KiloByte(64)
+
+struct
+run_result
+{
+    f64 seconds;
+    f64 userSeconds;
+    f64 systemSeconds;
+    f64 inputWait;
+    f64 readerIdle;
+    f64 outputWait;
+    f64 writerIdle;
+    u64 inputStalls;
+    u64 outputStalls;
+    u64 peakRSS;
+    s32 status;
+    u32 logSize;
+    u08 log[Run_Log_Size + 1]; // room for the terminator ParseRunLog puts after a last line without a newline
+};
+
+global_function
+void
+ParseRunLog(run_result *result)
+{
+    u08 *ptr = result->log;
+    u08 *end = result->log + result->logSize;
+    while (ptr < end)
+    {
+        u08 *lineEnd = ptr;
+        while (lineEnd < end && *lineEnd != '\n') ++lineEnd;
+        *lineEnd = 0;
+
+        char *stats;
+        u32 nBuffers;
+        u64 size;
+        if ((stats = strstr((char *)ptr, "Input buffers: ")))
+            sscanf(stats, "Input buffers: %u x %" SCNu64 " MB; waited %lf s for input over %" SCNu64 " stalls; reader idle %lf s", &nBuffers, &size, &result->inputWait, &result->inputStalls, &result->readerIdle);
+        else if ((stats = strstr((char *)ptr, "Output buffers: ")))
+            sscanf(stats, "Output buffers: %u x %" SCNu64 " MB; waited %lf s for output over %" SCNu64 " stalls; writer idle %lf s", &nBuffers, &size, &result->outputWait, &result->outputStalls, &result->writerIdle);
+
+        if (lineEnd < end) *lineEnd = '\n';
+        ptr = lineEnd + 1;
+    }
+}
+
+// Returns 0 if the program could not be started
+global_function
+u08
+RunProgram(const char *directory, const char *corpusName, const char *outputName, const char **programArgs, run_result *result)
+{
+    memset(result, 0, sizeof(run_result));
+
+    s32 errorPipe[2];
+    if (pipe(errorPipe)) return(0);
+
+    u64 start = GetNanoSeconds();
+    pid_t pid = fork();
+    if (pid < 0)
+    {
+        close(errorPipe[0]);
+        close(errorPipe[1]);
+        return(0);
+    }
+
+    if (!pid)
+    {
+        s32 input = open(corpusName, O_RDONLY);
+        s32 output = outputName ? open(outputName, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR) : open("/dev/null", O_WRONLY);
+        if (input < 0 || output < 0 || chdir(directory) || dup2(input, STDIN_FILENO) < 0 || dup2(output, STDOUT_FILENO) < 0 || dup2(errorPipe[1], STDERR_FILENO) < 0) _exit(127);
+        close(errorPipe[0]);
+        close(errorPipe[1]);
+        close(input);
+        close(output);
+        execvp(programArgs[0], (char *const *)programArgs);
+        _exit(127);
+    }
+
+    close(errorPipe[1]);
+    ssize_t bytesRead;
+    u08 chunk[KiloByte(4)];
+    while ((bytesRead = read(errorPipe[0], chunk, sizeof(chunk))) != 0)
+    {
+        if (bytesRead < 0)
+        {
+            if (errno == EINTR) continue;
+            break;
+        }
+
+        if (result->logSize + (u32)bytesRead > Run_Log_Size)
+        {
+            u32 drop = Min(result->logSize, (u32)Run_Log_Size / 2);
+            memmove(result->log, result->log + drop, result->logSize - drop);
+            result->logSize -= drop;
+        }
+        memcpy(result->log + result->logSize, chunk, (u64)bytesRead);
+        result->logSize += (u32)bytesRead;
+    }
+    close(errorPipe[0]);
+
+    s32 status;
+    struct rusage usage;
+    while (wait4(pid, &status, 0, &usage) < 0 && errno == EINTR) {}
+    result->seconds = (f64)(GetNanoSeconds() - start) / 1e9;
+    result->status = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+    result->userSeconds = (f64)usage.ru_utime.tv_sec + ((f64)usage.ru_utime.tv_usec / 1e6);
+    result->systemSeconds = (f64)usage.ru_stime.tv_sec + ((f64)usage.ru_stime.tv_usec / 1e6);
+#ifdef __APPLE__
+    result->peakRSS = (u64)usage.ru_maxrss;
+#else
+    result->peakRSS = (u64)usage.ru_maxrss << 10;
+#endif
+
+    ParseRunLog(result);
+    return(1);
+}
+
+// Output checks
+// With --check-output the program's output is read back after each run and must hold one record per corpus read, in the corpus format: SAM lines other than the header, four FASTQ lines, or BAM records.
+// BAM output is decompressed with the BGZF reader, which checks every block's CRC.
+#define Output_Check_Invalid ((u64)-1)
+
+// Returns the number of records in the output, or Output_Check_Invalid
+global_function
+u64
+CountOutputRecords(memory_arena *arena, const char *outputName, u08 format)
+{
+    buffer_pool *pool = CreatePool(arena);
+    pool->handle = open(outputName, O_RDONLY);
+    if (pool->handle < 0) return(Output_Check_Invalid);
+
+    u08 peek[BGZF_Header_Size];
+    u64 peekSize = 0;
+    for (   ssize_t bytesRead;
+            peekSize < sizeof(peek) && (bytesRead = read(pool->handle, peek + peekSize, sizeof(peek) - peekSize)) > 0;
+            peekSize += (u64)bytesRead ) {}
+
+    if (format == readGenBAM)
+    {
+        if (!IsBGZF(peek, peekSize))
+        {
+            close(pool->handle);
+            return(Output_Check_Invalid);
+        }
+        EnableBGZFInput(arena, pool, 1, peek, peekSize);
+    }
+    else
+    {
+        pool->preload = peek;
+        pool->preloadSize = peekSize;
+    }
+
+    // BAM is walked as little-endian u32 fields, each followed by the bytes it gives the size of: magic, l_text, n_ref, then l_name per reference and block_size per record
+    enum {bamMagic, bamText, bamNRef, bamReference, bamRecord} field = bamMagic;
+    u08 word[4];
+    u32 wordSize = 0;
+    u32 nReferences = 0;
+    u64 skip = 0;
+    u64 nLines = 0;
+    u64 nHeaderLines = 0;
+    u64 nRecords = 0;
+    u08 lineStart = 1;
+    u08 valid = 1;
+
+    GetNextBuffer_Read(pool);
+    for (   buffer *buffer = GetNextBuffer_Read(pool);
+            buffer->size && valid;
+            buffer = GetNextBuffer_Read(pool) )
+    {
+        u08 *ptr = buffer->buffer;
+        u08 *end = buffer->buffer + buffer->size;
+        if (format != readGenBAM)
+        {
+            for (; ptr < end; ++ptr)
+            {
+                if (lineStart && *ptr == '@') ++nHeaderLines;
+                lineStart = *ptr == '\n';
+                nLines += lineStart;
+            }
+            continue;
+        }
+
+        while (ptr < end && valid)
+        {
+            if (skip)
+            {
+                u64 n = Min(skip, (u64)(end - ptr));
+                ptr += n;
+                skip -= n;
+                continue;
+            }
+
+            word[wordSize++] = *ptr++;
+            if (wordSize < 4) continue;
+            wordSize = 0;
+
+            u32 value = ReadLE32(word);
+            switch (field)
+            {
+                case bamMagic:
+                    valid = !memcmp(word, "BAM\1", 4);
+                    field = bamText;
+                    break;
+
+                case bamText:
+                    skip = value;
+                    field = bamNRef;
+                    break;
+
+                case bamNRef:
+                    nReferences = value;
+                    field = nReferences ? bamReference : bamRecord;
+                    break;
+
+                case bamReference:
+                    skip = (u64)value + 4;
+                    if (!--nReferences) field = bamRecord;
+                    break;
+
+                case bamRecord:
+                    skip = value;
+                    ++nRecords;
+                    break;
+            }
+        }
+    }
+    close(pool->handle);
+
+    if (format == readGenBAM) valid &= !((bgzf_codec *)pool->codec)->error && field == bamRecord && !skip && !wordSize;
+    else
+    {
+        valid &= lineStart;
+        nRecords = format == readGenFASTQ ? (nLines / 4) : (nLines - nHeaderLines);
+    }
+
+    return(valid ? nRecords : Output_Check_Invalid);
+}
+
+global_function
+void
+RemoveDirectory(const char *directory)
+{
+    DIR *dir = opendir(directory);
+    if (dir)
+    {
+        struct dirent *entry;
+        while ((entry = readdir(dir))) if (strcmp(entry->d_name, ".") && strcmp(entry->d_name, ".."))
+        {
+            char name[4096];
+            stbsp_snprintf(name, sizeof(name), "%s/%s", directory, entry->d_name);
+            unlink(name);
+        }
+        closedir(dir);
+    }
+    rmdir(directory);
+}
+
+MainArgs
+{
+    s32 exitCode = EXIT_SUCCESS;
+    u64 nReads = Default_Read_Gen_Reads;
+    u32 nBarCodes = Default_Read_Gen_BarCodes;
+    u32 nRuns = 1;
+    u08 format = readGenSAM;
+    u08 clearLog = 0;
+    u08 checkOutput = 0;
+    u08 showHelp = ArgCount < 2;
+    s32 programArg = 0;
+    const char *formatNames[] = {"sam", "fastq", "bam"}; // by read_gen_format
+    char directory[4096] = {};
+    char corpusName[4096];
+    char clearLogName[4096];
+    char outputName[4096];
+    char program[4096];
+    const char **programArgs = 0;
+
+    ForLoop(ArgCount - 1)
+    {
+        const char *arg = ArgBuffer[index + 1];
+        if (!strcmp(arg, "--help") || !strcmp(arg, "-h")) showHelp = 1;
+        else if (!strcmp(arg, "--sam")) format = readGenSAM;
+        else if (!strcmp(arg, "--fastq")) format = readGenFASTQ;
+        else if (!strcmp(arg, "--bam")) format = readGenBAM;
+        else if (!strcmp(arg, "--clear-log")) clearLog = 1;
+        else if (!strcmp(arg, "--check-output")) checkOutput = 1;
+        else if (!strcmp(arg, "--reads") || !strcmp(arg, "--barcodes") || !strcmp(arg, "--runs"))
+        {
+            u32 value;
+            if (index < (u32)(ArgCount - 2) && StringToInt_Check((char *)ArgBuffer[index + 2], &value) && value)
+            {
+                if (arg[2] == 'r' && arg[3] == 'e') nReads = value;
+                else if (arg[2] == 'b') nBarCodes = Min(value, (u32)Read_Gen_BarCode_Space);
+                else nRuns = value;
+                ++index;
+            }
+            else
+            {
+                PrintError("Error, %s option requires a positive integer argument", arg + 2);
+                exitCode = EXIT_FAILURE;
+                goto End;
+            }
+        }
+        else
+        {
+            programArg = (s32)index + 1;
+            break;
+        }
+    }
+
+    if (showHelp || !programArg)
+    {
+        fprintf(stderr, ProgramName " " ProgramVersion "\nUsage: " ProgramName " [options] <program> [program arguments]\n\n");
+
+        fprintf(stderr, "Generates a SAM, BAM or FASTQ corpus of haplotagged reads, as HaplotagReadGen does with its default options, and times <program> reading it from <stdin>, with <stdout> discarded unless it is checked.\n");
+        fprintf(stderr, "Each run is reported to <stdout> as one JSON object: wall, user and system time, reads/s, MB/s, peak RSS and the I/O stage times <program> reports.\n");
+        fprintf(stderr, "<program> runs in a scratch directory, removed afterwards along with the corpus and any logs it writes.\n\n");
+
+        fprintf(stderr, "Options:\n");
+        fprintf(stderr, "   --sam:          Unmapped read pairs with BC/QT tags, for SamHaplotag (default)\n");
+        fprintf(stderr, "   --bam:          The SAM corpus as BAM, for SamHaplotag\n");
+        fprintf(stderr, "   --fastq:        Reads with BX tags, for 10xSpoof and 16BaseBCGen\n");
+        fprintf(stderr, "   --reads N:      Number of reads (default %u)\n", Default_Read_Gen_Reads);
+        fprintf(stderr, "   --barcodes N:   Number of distinct barcodes to draw from (default %u)\n", Default_Read_Gen_BarCodes);
+        fprintf(stderr, "   --clear-log:    Write a clear barcode log for the corpus and pass it as the first program argument (10xSpoof)\n");
+        fprintf(stderr, "   --runs N:       Time N runs on the same corpus (default 1)\n");
+        fprintf(stderr, "   --check-output: Keep <program>'s output in the scratch directory and fail a run unless it holds one record per read, in the corpus format\n");
+        fprintf(stderr, "   -h/--help:      Show help\n\n");
+
+        fprintf(stderr, "Usage example:\n");
+        fprintf(stderr, ProgramName " --fastq --reads 4000000 --clear-log 10xSpoof\n");
+
+        goto End;
+    }
+
+    {
+        const char *tmp = getenv("TMPDIR");
+        stbsp_snprintf(directory, sizeof(directory), "%s/" ProgramName ".XXXXXX", tmp ? tmp : "/tmp");
+        if (!mkdtemp(directory))
+        {
+            PrintError("Error creating a scratch directory in '%s'", tmp ? tmp : "/tmp");
+            directory[0] = 0;
+            exitCode = EXIT_FAILURE;
+            goto End;
+        }
+        stbsp_snprintf(corpusName, sizeof(corpusName), "%s/corpus.%s", directory, format == readGenFASTQ ? "fq" : formatNames[format]);
+        stbsp_snprintf(clearLogName, sizeof(clearLogName), "%s/Clear_BC", directory);
+        stbsp_snprintf(outputName, sizeof(outputName), "%s/output", directory);
+
+        // the program runs in the scratch directory, so a relative path to it has to be resolved first
+        const char *programName = ArgBuffer[programArg];
+        if (strchr(programName, '/'))
+        {
+            if (!realpath(programName, program))
+            {
+                PrintError("Error, can't find '%s'", programName);
+                exitCode = EXIT_FAILURE;
+                goto End;
+            }
+        }
+        else stbsp_snprintf(program, sizeof(program), "%s", programName);
+
+        memory_arena workingSet;
+        CreateMemoryArena(workingSet, MegaByte(512));
+
+        u32 nArgs = (u32)(ArgCount - programArg);
+        programArgs = PushArray(workingSet, const char *, nArgs + 2);
+        u32 argPtr = 0;
+        programArgs[argPtr++] = program;
+        if (clearLog) programArgs[argPtr++] = clearLogName;
+        ForLoop(nArgs - 1) programArgs[argPtr++] = ArgBuffer[programArg + 1 + (s32)index];
+        programArgs[argPtr] = 0;
+
+        read_generator *gen = CreateReadGenerator(&workingSet, nReads, nBarCodes, Default_Read_Gen_Skew, Default_Read_Gen_Error_Rate, Default_Read_Gen_N_Rate, Default_Read_Gen_Missing,
+                Default_Read_Gen_Read1_Fraction, Default_Read_Gen_Seed, format, clearLog);
+        buffer_pool *writePool = CreatePool(&workingSet);
+        writePool->handle = open(corpusName, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+        u64 corpusSize = 0;
+        if (writePool->handle >= 0)
+        {
+            if (format == readGenBAM) EnableBGZFOutput(&workingSet, writePool, 1);
+            else EnableZeroCopy(&workingSet, writePool, 0);
+            corpusSize = WriteReads(&workingSet, gen, writePool, 1);
+            if (format == readGenBAM) FinishBGZFOutput(writePool);
+            close(writePool->handle);
+        }
+        if (writePool->handle < 0 || Global_Write_Error)
+        {
+            PrintError("Error writing corpus '%s'", corpusName);
+            exitCode = EXIT_FAILURE;
+            goto End;
+        }
+
+        if (clearLog)
+        {
+            s32 handle = open(clearLogName, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+            if (handle < 0 || !WriteClearBarCodeLog(gen, handle))
+            {
+                PrintError("Error writing clear barcode log '%s'", clearLogName);
+                if (handle >= 0) close(handle);
+                exitCode = EXIT_FAILURE;
+                goto End;
+            }
+            close(handle);
+        }
+
+        PrintStatus("%s corpus: %" PRIu64 " reads, %.1f MB", format == readGenFASTQ ? "FASTQ" : (format == readGenBAM ? "BAM" : "SAM"), nReads, (f64)corpusSize / 1e6);
+
+        const char *baseName = strrchr(program, '/');
+        baseName = baseName ? baseName + 1 : program;
+
+        run_result *result = PushStruct(workingSet, run_result);
+        ForLoop(nRuns)
+        {
+            if (!RunProgram(directory, corpusName, checkOutput ? outputName : 0, programArgs, result))
+            {
+                PrintError("Error starting '%s'", program);
+                exitCode = EXIT_FAILURE;
+                goto End;
+            }
+
+            printf("{\"program\": \"%s\", \"format\": \"%s\", \"reads\": %" PRIu64 ", \"bytes\": %" PRIu64 ", \"run\": %u, \"exit_status\": %d, "
+                    "\"seconds\": %.3f, \"user_seconds\": %.3f, \"system_seconds\": %.3f, \"reads_per_s\": %.0f, \"mb_per_s\": %.1f, \"peak_rss_mb\": %.1f, "
+                    "\"input_wait_seconds\": %.3f, \"input_stalls\": %" PRIu64 ", \"reader_idle_seconds\": %.3f, "
+                    "\"output_wait_seconds\": %.3f, \"output_stalls\": %" PRIu64 ", \"writer_idle_seconds\": %.3f}\n",
+                    baseName, formatNames[format], nReads, corpusSize, index + 1, result->status,
+                    result->seconds, result->userSeconds, result->systemSeconds, (f64)nReads / result->seconds, (f64)corpusSize / (result->seconds * 1e6), (f64)result->peakRSS / (1024.0 * 1024.0),
+                    result->inputWait, result->inputStalls, result->readerIdle,
+                    result->outputWait, result->outputStalls, result->writerIdle);
+            fflush(stdout);
+
+            if (result->status)
+            {
+                PrintError("'%s' exited with status %d:", baseName, result->status);
+                fwrite(result->log, 1, result->logSize, stderr);
+                exitCode = EXIT_FAILURE;
+                break;
+            }
+
+            if (checkOutput)
+            {
+                u64 nRecords = CountOutputRecords(&workingSet, outputName, format);
+                if (nRecords != nReads)
+                {
+                    if (nRecords == Output_Check_Invalid) PrintError("'%s' output is not valid %s", baseName, format == readGenFASTQ ? "FASTQ" : (format == readGenBAM ? "BAM" : "SAM"));
+                    else PrintError("'%s' output holds %" PRIu64 " records, expected %" PRIu64, baseName, nRecords, nReads);
+                    exitCode = EXIT_FAILURE;
+                    break;
+                }
+            }
+        }
+    }
+
+End:
+    if (directory[0]) RemoveDirectory(directory);
+    return(exitCode);
+}
@@ -0,0 +1,284 @@
+/*
+Copyright (c) 2021 Ed Harry, Wellcome Sanger Institute, Genome Research Limited
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#define ProgramName "HaplotagReadGen"
+
+#include "Common.cpp"
+
+#define ProgramVersion String(PV)
+
+#include "BC.cpp"
+#include "BGZF.cpp"
+#include "ReadGen.cpp"
+
+// Returns 0 unless value is a number from min to max
+global_function
+u08
+ParseNumber(const char *value, f64 min, f64 max, f64 *result)
+{
+    char *end;
+    *result = strtod(value, &end);
+    return(end != value && !*end && *result >= min && *result <= max);
+}
+
+MainArgs
+{
+    s32 exitCode = EXIT_SUCCESS;
+    u64 nReads = Default_Read_Gen_Reads;
+    u64 seed = Default_Read_Gen_Seed;
+    u32 nBarCodes = Default_Read_Gen_BarCodes;
+    u32 nThreads = 1;
+    f64 skew = Default_Read_Gen_Skew;
+    f64 errorRate = Default_Read_Gen_Error_Rate;
+    f64 nRate = Default_Read_Gen_N_Rate;
+    f64 missing = Default_Read_Gen_Missing;
+    f64 read1Fraction = Default_Read_Gen_Read1_Fraction;
+    u08 format = readGenSAM;
+    u08 showHelp = 0;
+    const char *outputName = 0;
+    const char *clearLogName = 0;
+    pipeline_options pipeline = {};
+
+    ForLoop(ArgCount - 1)
+    {
+        const char *arg = ArgBuffer[index + 1];
+        const char *value = index < (u32)(ArgCount - 2) ? ArgBuffer[index + 2] : 0;
+        f64 number;
+
+        if (!strcmp(arg, "-h") || !strcmp(arg, "--help")) showHelp = 1;
+        else if (!strcmp(arg, "--sam")) format = readGenSAM;
+        else if (!strcmp(arg, "--fastq")) format = readGenFASTQ;
+        else if (!strcmp(arg, "--bam")) format = readGenBAM;
+        else if (!strcmp(arg, "-n") || !strcmp(arg, "--reads"))
+        {
+            if (value && ParseNumber(value, 0, 1e15, &number) && number == (f64)(u64)number)
+            {
+                nReads = (u64)number;
+                ++index;
+            }
+            else
+            {
+                PrintError("Error, reads option requires a non-negative integer argument");
+                exitCode = EXIT_FAILURE;
+                goto End;
+            }
+        }
+        else if (!strcmp(arg, "-b") || !strcmp(arg, "--barcodes"))
+        {
+            if (value && ParseNumber(value, 1, Read_Gen_BarCode_Space, &number) && number == (f64)(u32)number)
+            {
+                nBarCodes = (u32)number;
+                ++index;
+            }
+            else
+            {
+                PrintError("Error, barcodes option requires an integer argument from 1 to %u", Read_Gen_BarCode_Space);
+                exitCode = EXIT_FAILURE;
+                goto End;
+            }
+        }
+        else if (!strcmp(arg, "--skew"))
+        {
+            if (value && ParseNumber(value, 0.01, 100, &skew)) ++index;
+            else
+            {
+                PrintError("Error, skew option requires a numeric argument from 0.01 to 100");
+                exitCode = EXIT_FAILURE;
+                goto End;
+            }
+        }
+        else if (!strcmp(arg, "--error-rate") || !strcmp(arg, "--n-rate") || !strcmp(arg, "--missing") || !strcmp(arg, "--read1-fraction"))
+        {
+            f64 *rate = arg[2] == 'e' ? &errorRate : (arg[2] == 'n' ? &nRate : (arg[2] == 'm' ? &missing : &read1Fraction));
+            if (value && ParseNumber(value, 0, 1, rate)) ++index;
+            else
+            {
+                PrintError("Error, %s option requires a numeric argument from 0 to 1", arg + 2);
+                exitCode = EXIT_FAILURE;
+                goto End;
+            }
+        }
+        else if (!strcmp(arg, "--seed"))
+        {
+            char *end;
+            if (value && (seed = strtoull(value, &end, 0), *value && !*end)) ++index;
+            else
+            {
+                PrintError("Error, seed option requires an integer argument");
+                exitCode = EXIT_FAILURE;
+                goto End;
+            }
+        }
+        else if (!strcmp(arg, "-t") || !strcmp(arg, "--threads"))
+        {
+            if (value && StringToInt_Check((char *)value, &nThreads) && nThreads) ++index;
+            else
+            {
+                PrintError("Error, threads option requires a positive integer argument");
+                exitCode = EXIT_FAILURE;
+                goto End;
+            }
+        }
+        else if (!strcmp(arg, "-o") || !strcmp(arg, "--output"))
+        {
+            if (value) outputName = ArgBuffer[index++ + 2];
+            else
+            {
+                PrintError("Error, output option requires an argument");
+                exitCode = EXIT_FAILURE;
+                goto End;
+            }
+        }
+        else if (!strcmp(arg, "--clear-log"))
+        {
+            if (value) clearLogName = ArgBuffer[index++ + 2];
+            else
+            {
+                PrintError("Error, clear-log option requires an argument");
+                exitCode = EXIT_FAILURE;
+                goto End;
+            }
+        }
+        else if (IsPipelineOption(arg))
+        {
+            if (!ParsePipelineOption(&pipeline, ArgCount, ArgBuffer, &index))
+            {
+                exitCode = EXIT_FAILURE;
+                goto End;
+            }
+        }
+        else
+        {
+            PrintError("Unknown option '%s'", arg);
+            exitCode = EXIT_FAILURE;
+            goto End;
+        }
+    }
+
+    if (showHelp)
+    {
+        fprintf(stderr, ProgramName " " ProgramVersion "\nUsage: " ProgramName " [options] | <sam/bam/fastq format>\n\n");
+
+        fprintf(stderr, "Writes synthetic haplotagged reads to <stdout>: unmapped SAM or BAM records with BC/QT tags, or FASTQ records with a BX tag in the comment field.\n");
+        fprintf(stderr, "Barcodes are drawn from a pool of distinct haplotag barcodes with skewed abundance; barcode bases can be substituted or N, and tags can be missing.\n");
+        fprintf(stderr, "A read1 followed by a read2 is a pair, sharing a name and tags. Output depends only on the options and seed, not the number of threads.\n\n");
+
+        fprintf(stderr, "Options:\n");
+        fprintf(stderr, "   --sam:                 Write SAM (default)\n");
+        fprintf(stderr, "   --bam:                 Write BAM, the same records as SAM compressed on the generating threads\n");
+        fprintf(stderr, "   --fastq:               Write FASTQ; BX groups with more than one error are written as 00 (unclear)\n");
+        fprintf(stderr, "   -n/--reads N:          Number of reads (default %u)\n", Default_Read_Gen_Reads);
+        fprintf(stderr, "   -b/--barcodes N:       Number of distinct barcodes in the pool (default %u)\n", Default_Read_Gen_BarCodes);
+        fprintf(stderr, "   --skew S:              Barcode n of the pool is drawn as u^S for uniform u; 1 is uniform, larger is more skewed (default %.1f)\n", Default_Read_Gen_Skew);
+        fprintf(stderr, "   --error-rate P:        Probability each barcode base is substituted (default %.3f)\n", Default_Read_Gen_Error_Rate);
+        fprintf(stderr, "   --n-rate P:            Probability each barcode base is an N (default %.3f)\n", Default_Read_Gen_N_Rate);
+        fprintf(stderr, "   --missing P:           Fraction of pairs and single reads without tags (default %.3f)\n", Default_Read_Gen_Missing);
+        fprintf(stderr, "   --read1-fraction F:    Fraction of reads that are read1 (default %.1f, all pairs)\n", Default_Read_Gen_Read1_Fraction);
+        fprintf(stderr, "   --seed N:              Random seed\n");
+        fprintf(stderr, "   -t/--threads N:        Generate on N threads (default 1)\n");
+        fprintf(stderr, "   -o/--output FILE:      Write to FILE instead of <stdout>\n");
+        fprintf(stderr, "   --clear-log FILE:      Also write the clear barcodes of the read1s in the format of SamHaplotag's clear barcode log, for 10xSpoof\n");
+        fprintf(stderr, "   --io-buffers N:        Output buffers (default %u)\n", Default_IO_Buffers);
+        fprintf(stderr, "   --io-buffer-size MB:   Size of each output buffer (default %u)\n", Default_IO_Buffer_Size_MB);
+        fprintf(stderr, "   --cpus LIST:           Pin the main thread, then the output I/O and generating threads as they are created, to the CPUs in LIST (e.g. 0-7) in order\n");
+        fprintf(stderr, "   --pin:                 As --cpus, with every CPU the process may run on, those on the main thread's NUMA node first\n");
+        fprintf(stderr, "   --trace FILE:          Write a Chrome trace JSON timeline of the I/O tasks and waits to FILE at exit (chrome://tracing, ui.perfetto.dev)\n");
+        fprintf(stderr, "   -h/--help:             Show help\n\n");
+
+        fprintf(stderr, "Usage example:\n");
+        fprintf(stderr, ProgramName " -t 8 -n 1000000000 -b 4000000 | SamHaplotag -t 8 >/dev/null\n");
+
+        goto End;
+    }
+
+    {
+        s32 output = outputName ? open(outputName, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH) : STDOUT_FILENO;
+        if (output < 0)
+        {
+            PrintError("Error opening '%s'", outputName);
+            exitCode = EXIT_FAILURE;
+            goto End;
+        }
+
+        PrintStatus("Starting...");
+        if (!StartPipeline(&pipeline))
+        {
+            exitCode = EXIT_FAILURE;
+            goto End;
+        }
+        PrintStatus("Run options:");
+        PrintStatus("\tFormat: %s", format == readGenFASTQ ? "FASTQ" : (format == readGenBAM ? "BAM" : "SAM"));
+        PrintStatus("\tReads: %" PRIu64, nReads);
+        PrintStatus("\tBarcodes: %u, skew %.2f", nBarCodes, skew);
+        PrintStatus("\tBarcode base error rate: %.4f, N rate: %.4f", errorRate, nRate);
+        PrintStatus("\tMissing tags: %.4f", missing);
+        PrintStatus("\tRead1 fraction: %.4f", read1Fraction);
+        PrintStatus("\tSeed: %" PRIu64, seed);
+        PrintStatus("\tThreads: %u", nThreads);
+        PrintStatus("\tI/O buffers: %u x %" PRIu64 " MB", IO_Buffers, (u64)BufferSize >> 20);
+
+        memory_arena workingSet;
+        CreateMemoryArena(workingSet, MegaByte(512));
+        RegisterArena(&workingSet, "working");
+
+        read_generator *gen = CreateReadGenerator(&workingSet, nReads, nBarCodes, skew, errorRate, nRate, missing, read1Fraction, seed, format, clearLogName != 0);
+
+        buffer_pool *writePool = CreatePool(&workingSet);
+        writePool->handle = output;
+        if (format == readGenBAM) EnableBGZFOutput(&workingSet, writePool, nThreads);
+        else EnableZeroCopy(&workingSet, writePool, 0);
+        RegisterStage(&writePool->stats, "output");
+
+        u64 start = GetNanoSeconds();
+        u64 size = WriteReads(&workingSet, gen, writePool, nThreads);
+        if (format == readGenBAM) FinishBGZFOutput(writePool);
+        f64 seconds = (f64)(GetNanoSeconds() - start) / 1e9;
+
+        if (Global_Write_Error)
+        {
+            PrintError("Error writing");
+            exitCode = EXIT_FAILURE;
+            goto End;
+        }
+        PrintStatus("%$" PRIu64 " reads, %$" PRIu64 "B in %.2f s (%$.1fB/s)", nReads, size, seconds, (f64)size / seconds);
+        PrintBufferPoolStats(writePool, 1);
+
+        if (clearLogName)
+        {
+            s32 log = open(clearLogName, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+            if (log < 0 || !WriteClearBarCodeLog(gen, log))
+            {
+                PrintError("Error writing clear barcode log '%s'", clearLogName);
+                exitCode = EXIT_FAILURE;
+            }
+            if (log >= 0) close(log);
+        }
+    }
+
+End:
+    if (Trace_Enabled && WriteTrace())
+    {
+        PrintError("Error writing trace file");
+        exitCode = EXIT_FAILURE;
+    }
+    return(exitCode);
+}
@@ -46,6 +46,9 @@ SOFTWARE.
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
 
 #ifdef _WIN32
 #include <intrin.h>
@@ -207,26 +210,49 @@ binary_semaphore
     u64 v;
 };
 
+// Thread pool
+// Jobs go through a bounded lock-free multi-producer/multi-consumer ring of Number_Thread_Jobs cells, each with its own sequence number (Vyukov's bounded queue).
+// Idle workers, producers waiting on a full ring and threads waiting on tasks park on event counts: a futex on Linux, a mutex and condition variable elsewhere. Notifying costs two atomics unless someone is parked.
+// A job can carry a task_handle, marked done once its function has returned, so a caller can wait on its own task rather than on the whole pool.
+struct
+event_count
+{
+    threadSig epoch;
+    threadSig nWaiters;
+#ifndef __linux__
+    mutex mut;
+    cond con;
+#endif
+};
+
+struct
+task_handle
+{
+    threadSig done;
+};
+
 struct
 thread_job
 {
-    thread_job *prev;
+    threadSig sequence;
+    u32 pad;
     void (*function)(void *arg);
     void *arg;
+    task_handle *handle;
 };
 
 struct
 job_queue
 {
-    mutex rwMutex;
-    thread_job *front;
-    thread_job *rear;
-    binary_semaphore *hasJobs;
-    u32 len;
-    u32 nFree;
-    binary_semaphore *hasFree;
-    thread_job *freeFront;
-    thread_job *freeRear;
+    thread_job *jobs;
+    u32 mask;
+    u32 pad0[15];
+    threadSig enqueuePos;
+    u32 pad1[15];
+    threadSig dequeuePos;
+    u32 pad2[15];
+    event_count hasJobs;
+    event_count hasFree;
 };
 
 struct thread_context;
@@ -236,10 +262,9 @@ thread_pool
 {
     thread_context **threads;
     threadSig numThreadsAlive;
-    threadSig numThreadsWorking;
-    mutex threadCountLock;
-    cond threadsAllIdle;
+    threadSig nPending;
     job_queue jobQueue;
+    event_count jobDone;
 };
 
 struct
@@ -248,6 +273,8 @@ thread_context
     u64	id;
     thread th;
     thread_pool *pool;
+    s32 cpu;
+    u32 pad;
 };
 
 #ifdef DEBUG
@@ -271,6 +298,9 @@ memory_arena
    u64 currentSize;
    u64 maxSize;
    u64 active;
+   u64 committed;
+   u64 peakSize;
+   u64 mapSize;
 };
 
 struct
@@ -313,6 +343,20 @@ AlignUp(u32 x, u32 alignment_pow2)
 	return(result);
 }
 
+// Arenas reserve address space up front and commit it in Memory_Arena_Commit_Size steps as pushes reach it, so an arena grows in place well past the size it was created with, and only pays for what it uses.
+// Reservations are aligned to Memory_Arena_Huge_Page_Size. Large, densely used pushes (hash tables, I/O buffers) are advised to use transparent huge pages with AdviseHugePages; sparse ones are left alone, as a huge page is faulted in whole.
+// Where the full reservation is refused (e.g. 'ulimit -v'), an arena reserves just its size, and overflows into a chained arena as before.
+#define Memory_Arena_Reserve_Size ((u64)64 << 30)
+#define Memory_Arena_Commit_Size ((u64)2 << 20)
+#define Memory_Arena_Huge_Page_Size ((u64)2 << 20)
+
+global_function
+u64
+AlignUp64(u64 x, u64 alignment)
+{
+   return((x + alignment - 1) & ~(alignment - 1));
+}
+
 global_function
 void
 CreateMemoryArena_(memory_arena *arena, u64 size, u32 alignment_pow2 = Default_Memory_Alignment_Pow2)
@@ -322,14 +366,43 @@ CreateMemoryArena_(memory_arena *arena, u64 size, u32 alignment_pow2 = Default_M
    u64 realSize = size + linkSize;
 
 #ifndef _WIN32
-   posix_memalign((void **)&arena->base, Pow2(alignment_pow2), realSize);
+   u64 mapSize = AlignUp64(Max(realSize, Memory_Arena_Reserve_Size), Memory_Arena_Huge_Page_Size);
+   u08 *map = (u08 *)mmap(0, mapSize + Memory_Arena_Huge_Page_Size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+   if (map == (u08 *)MAP_FAILED)
+   {
+      mapSize = AlignUp64(realSize, Memory_Arena_Huge_Page_Size);
+      map = (u08 *)mmap(0, mapSize + Memory_Arena_Huge_Page_Size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+      if (map == (u08 *)MAP_FAILED)
+      {
+#ifdef __APPLE__
+	 fprintf(stderr, "Reserving %llu bytes failed, out of memory.\n", realSize);
+#else
+	 fprintf(stderr, "Reserving %lu bytes failed, out of memory.\n", realSize);
+#endif
+	 *((volatile u32 *)0) = 0;
+      }
+   }
+
+   // trim the reservation to a huge page boundary
+   u08 *block = (u08 *)AlignUp64((u64)map, Memory_Arena_Huge_Page_Size);
+   if (block > map) munmap(map, (u64)(block - map));
+   if (map + Memory_Arena_Huge_Page_Size > block) munmap(block + mapSize, (u64)(map + Memory_Arena_Huge_Page_Size - block));
+   mprotect(block, Memory_Arena_Commit_Size, PROT_READ | PROT_WRITE);
+
+   arena->base = block;
+   arena->maxSize = mapSize - linkSize;
+   arena->committed = Memory_Arena_Commit_Size - linkSize;
+   arena->mapSize = mapSize;
 #else
 #include <memoryapi.h>
    (void)alignment_pow2;
    arena->base = (u08 *)VirtualAlloc(NULL, realSize, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+   arena->maxSize = size;
+   arena->committed = size;
+   arena->mapSize = realSize;
 #endif
    arena->currentSize = 0;
-   arena->maxSize = size;
+   arena->peakSize = 0;
 #pragma clang diagnostic push
 #pragma GCC diagnostic ignored "-Wcast-align"	
    arena->next = (memory_arena *)arena->base;
@@ -340,6 +413,54 @@ CreateMemoryArena_(memory_arena *arena, u64 size, u32 alignment_pow2 = Default_M
    arena->active = 1;
 }
 
+// Commits the arena up to size bytes from its base; returns 0 if the system refuses
+global_function
+u08
+CommitMemoryArena(memory_arena *arena, u64 size)
+{
+   if (size <= arena->committed) return(1);
+
+#ifndef _WIN32
+   u64 linkSize = (u64)(arena->base - (u08 *)arena->next);
+   u64 committed = Min(AlignUp64(size + linkSize, Memory_Arena_Commit_Size), arena->mapSize) - linkSize;
+   if (mprotect(arena->base + arena->committed, committed - arena->committed, PROT_READ | PROT_WRITE)) return(0);
+   arena->committed = committed;
+   return(1);
+#else
+   return(0);
+#endif
+}
+
+global_function
+void
+AdviseHugePages(void *memory, u64 size)
+{
+#ifdef MADV_HUGEPAGE
+   u64 start = AlignUp64((u64)memory, Memory_Arena_Huge_Page_Size);
+   u64 end = ((u64)memory + size) & ~(Memory_Arena_Huge_Page_Size - 1);
+   if (end > start) madvise((void *)start, end - start, MADV_HUGEPAGE);
+#else
+   (void)memory;
+   (void)size;
+#endif
+}
+
+// Bytes in use, the most ever in use and bytes committed, over the arena and any arenas chained to it
+global_function
+void
+MemoryArenaUsage(memory_arena *arena, u64 *current, u64 *peak, u64 *committed)
+{
+   *current = 0;
+   *peak = 0;
+   *committed = 0;
+   for (memory_arena *link = arena; link; link = (link->next && link->next->base) ? link->next : 0)
+   {
+      *current += link->currentSize;
+      *peak += link->peakSize;
+      *committed += link->committed;
+   }
+}
+
 #define CreateMemoryArena(arena, size, ...) CreateMemoryArena_(&arena, size, ##__VA_ARGS__)
 #define CreateMemoryArenaP(arena, size, ...) CreateMemoryArena_(arena, size, ##__VA_ARGS__)
 
@@ -370,7 +491,11 @@ FreeMemoryArena_(memory_arena *arena)
       {
 	 FreeMemoryArena_(arena->next);
       }
-      free(arena->next);
+#ifndef _WIN32
+      munmap(arena->next, arena->mapSize);
+#else
+      VirtualFree(arena->next, 0, MEM_RELEASE);
+#endif
    }
 }
 
@@ -389,7 +514,7 @@ PushSize_(memory_arena *arena, u64 size, u32 alignment_pow2 = Default_Memory_Ali
    u64 padding = GetAlignmentPadding((u64)(arena->base + arena->currentSize), alignment_pow2);
 
    void *result;
-   if (!arena->active || ((size + arena->currentSize + padding + sizeof(u64)) > arena->maxSize))
+   if (!arena->active || ((size + arena->currentSize + padding + sizeof(u64)) > arena->maxSize) || !CommitMemoryArena(arena, size + arena->currentSize + padding + sizeof(u64)))
    {
       arena->active = 0;
       if (arena->next)
@@ -436,6 +561,7 @@ PushSize_(memory_arena *arena, u64 size, u32 alignment_pow2 = Default_Memory_Ali
 #pragma GCC diagnostic ignored "-Wcast-align"		
       *((u64 *)(arena->base + arena->currentSize - sizeof(u64))) = (size + padding);
 #pragma clang diagnostic pop
+      arena->peakSize = Max(arena->peakSize, arena->currentSize);
    }
 
    return(result);
@@ -485,6 +611,9 @@ PushSubArena_(memory_arena *mainArena, u64 size, u32 alignment_pow2 = Default_Me
    subArena->maxSize = size;
    subArena->next = 0;
    subArena->active = 1;
+   subArena->committed = size;
+   subArena->peakSize = 0;
+   subArena->mapSize = 0;
 
    return(subArena);
 }
@@ -540,88 +669,201 @@ BinarySemaphorePostAll(binary_semaphore *bsem)
     UnlockMutex(bsem->mut);
 }
 
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <limits.h>
+#include <sched.h>
+#endif
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_WIN32)
+#define CpuRelax() _mm_pause()
+#else
+#define CpuRelax()
+#endif
+
 global_function
-thread_job *
-JobQueuePull(job_queue *jobQueue)
+void
+EventCountInit(event_count *eventCount)
 {
-    LockMutex(jobQueue->rwMutex);
-    thread_job *job = jobQueue->front;
-    
-    switch (jobQueue->len)
-    {
-	case 0:
-	    break;
+    eventCount->epoch = 0;
+    eventCount->nWaiters = 0;
+#ifndef __linux__
+    InitialiseMutex(eventCount->mut);
+    InitialiseCond(eventCount->con);
+#endif
+}
 
-	case 1:
-	    jobQueue->front = 0;
-	    jobQueue->rear  = 0;
-	    jobQueue->len = 0;
-	    break;
+// A waiter calls EventCountPrepareWait, re-checks its condition, then either cancels or waits with the key; a notifier changes the condition first, so no wake-up is lost in between
+global_function
+u32
+EventCountPrepareWait(event_count *eventCount)
+{
+    __atomic_add_fetch(&eventCount->nWaiters, 1, __ATOMIC_SEQ_CST);
+    return(__atomic_load_n(&eventCount->epoch, __ATOMIC_SEQ_CST));
+}
 
-	default:
-	    jobQueue->front = job->prev;
-	    --jobQueue->len;
-	    BinarySemaphorePost(jobQueue->hasJobs);
-    }
+global_function
+void
+EventCountCancelWait(event_count *eventCount)
+{
+    __atomic_sub_fetch(&eventCount->nWaiters, 1, __ATOMIC_SEQ_CST);
+}
 
-    UnlockMutex(jobQueue->rwMutex);
-    
-    return(job);
+global_function
+void
+EventCountWait(event_count *eventCount, u32 key)
+{
+#ifdef __linux__
+    while (__atomic_load_n(&eventCount->epoch, __ATOMIC_SEQ_CST) == key) syscall(SYS_futex, &eventCount->epoch, FUTEX_WAIT_PRIVATE, key, 0, 0, 0);
+#else
+    LockMutex(eventCount->mut);
+    while (__atomic_load_n(&eventCount->epoch, __ATOMIC_SEQ_CST) == key) WaitOnCond(eventCount->con, eventCount->mut);
+    UnlockMutex(eventCount->mut);
+#endif
+    EventCountCancelWait(eventCount);
+}
+
+global_function
+void
+EventCountNotify(event_count *eventCount, u08 all)
+{
+    __atomic_add_fetch(&eventCount->epoch, 1, __ATOMIC_SEQ_CST);
+    if (!__atomic_load_n(&eventCount->nWaiters, __ATOMIC_SEQ_CST)) return;
+#ifdef __linux__
+    syscall(SYS_futex, &eventCount->epoch, FUTEX_WAKE_PRIVATE, all ? INT_MAX : 1, 0, 0, 0);
+#else
+    LockMutex(eventCount->mut);
+    if (all) BroadcastCondition(eventCount->con);
+    else SignalCondition(eventCount->con);
+    UnlockMutex(eventCount->mut);
+#endif
 }
 
 global_function
-thread_job *
-GetFreeThreadJob(job_queue *jobQueue)
+u08
+TaskDone(task_handle *handle)
 {
-    LockMutex(jobQueue->rwMutex);
-    thread_job *job = jobQueue->freeFront;
+    return(__atomic_load_n(&handle->done, __ATOMIC_ACQUIRE) != 0);
+}
 
-    switch (jobQueue->nFree)
+// Returns 0 if the ring is full
+global_function
+u08
+JobQueuePush(job_queue *jobQueue, void (*function)(void *), void *arg, task_handle *handle)
+{
+    thread_job *job;
+    u32 pos = __atomic_load_n(&jobQueue->enqueuePos, __ATOMIC_RELAXED);
+    for (;;)
     {
-	case 0:
-	    break;
-	
-	case 1:
-	    jobQueue->freeFront = 0;
-	    jobQueue->freeRear = 0;
-	    jobQueue->nFree = 0;
-	    break;
-	
-	default:
-	    jobQueue->freeFront = job->prev;
-	    --jobQueue->nFree;
-	    BinarySemaphorePost(jobQueue->hasFree);
+        job = jobQueue->jobs + (pos & jobQueue->mask);
+        s32 diff = (s32)(__atomic_load_n(&job->sequence, __ATOMIC_ACQUIRE) - pos);
+        if (!diff)
+        {
+            if (__atomic_compare_exchange_n(&jobQueue->enqueuePos, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) break;
+        }
+        else if (diff < 0) return(0);
+        else pos = __atomic_load_n(&jobQueue->enqueuePos, __ATOMIC_RELAXED);
     }
 
-    UnlockMutex(jobQueue->rwMutex);
+    job->function = function;
+    job->arg = arg;
+    job->handle = handle;
+    __atomic_store_n(&job->sequence, pos + 1, __ATOMIC_RELEASE);
 
-    return(job);
+    return(1);
 }
 
+// Returns 0 if the ring is empty
 global_function
-void
-FreeThreadJob(job_queue *jobQueue, thread_job *job)
+u08
+JobQueuePull(job_queue *jobQueue, thread_job *out)
 {
-    LockMutex(jobQueue->rwMutex);
-    job->prev = 0;
-
-    switch (jobQueue->nFree)
+    thread_job *job;
+    u32 pos = __atomic_load_n(&jobQueue->dequeuePos, __ATOMIC_RELAXED);
+    for (;;)
     {
-	case 0:
-	    jobQueue->freeFront = job;
-	    jobQueue->freeRear  = job;
-	    break;
+        job = jobQueue->jobs + (pos & jobQueue->mask);
+        s32 diff = (s32)(__atomic_load_n(&job->sequence, __ATOMIC_ACQUIRE) - (pos + 1));
+        if (!diff)
+        {
+            if (__atomic_compare_exchange_n(&jobQueue->dequeuePos, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) break;
+        }
+        else if (diff < 0) return(0);
+        else pos = __atomic_load_n(&jobQueue->dequeuePos, __ATOMIC_RELAXED);
+    }
+
+    out->function = job->function;
+    out->arg = job->arg;
+    out->handle = job->handle;
+    __atomic_store_n(&job->sequence, pos + jobQueue->mask + 1, __ATOMIC_RELEASE);
+
+    return(1);
+}
 
-	default:
-	    jobQueue->freeRear->prev = job;
-	    jobQueue->freeRear = job;
+// Number of jobs claimed for pushing but not yet pulled; only a hint, as both ends move concurrently
+global_function
+s32
+JobQueueLength(job_queue *jobQueue)
+{
+    return((s32)(__atomic_load_n(&jobQueue->enqueuePos, __ATOMIC_SEQ_CST) - __atomic_load_n(&jobQueue->dequeuePos, __ATOMIC_SEQ_CST)));
+}
+
+// Thread placement
+// With placement on, each pool thread is given the next CPU of Thread_CPUs as it is created (the main thread takes the first) and pins itself to it once running, so placement follows creation order.
+// Memory is placed on the NUMA node of the thread that first writes to it, so memory a worker uses should be first touched by that worker.
+#define Max_Thread_CPUs 1024
+#define Page_Size KiloByte(4)
+
+global_variable
+u16
+Thread_CPUs[Max_Thread_CPUs];
+
+global_variable
+u32
+Thread_CPU_Count = 0;
+
+global_variable
+threadSig
+Thread_CPU_Next = 0;
+
+// Returns -1 with placement off
+global_function
+s32
+NextThreadCPU()
+{
+    if (!Thread_CPU_Count) return(-1);
+    return((s32)Thread_CPUs[__atomic_fetch_add(&Thread_CPU_Next, 1, __ATOMIC_RELAXED) % Thread_CPU_Count]);
+}
+
+global_function
+void
+PinThread(s32 cpu)
+{
+#ifdef __linux__
+    if (cpu >= 0)
+    {
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	sched_setaffinity(0, sizeof(set), &set);
     }
-    ++jobQueue->nFree;
+#else
+    (void)cpu;
+#endif
+}
 
-    BinarySemaphorePost(jobQueue->hasFree);	
-    UnlockMutex(jobQueue->rwMutex);   
+// Writes a byte to every page, so they are placed on the calling thread's node
+global_function
+void
+FirstTouch(void *memory, u64 size)
+{
+    volatile u08 *bytes = (volatile u08 *)memory;
+    for (u64 offset = 0; offset < size; offset += Page_Size) bytes[offset] = 0;
 }
 
+#define Thread_Spin_Count 256
+
 global_function
 #ifndef _WIN32
 void *
@@ -633,48 +875,38 @@ ThreadFunc(void *in)
     thread_context *context = (thread_context *)in;
     
     thread_pool *pool = context->pool;
+    job_queue *jobQueue = &pool->jobQueue;
+    PinThread(context->cpu);
 
-    LockMutex(pool->threadCountLock);
-    pool->numThreadsAlive += 1;
-    UnlockMutex(pool->threadCountLock);
+    __atomic_add_fetch(&pool->numThreadsAlive, 1, __ATOMIC_SEQ_CST);
 
+    u32 spin = 0;
     while (Threads_KeepAlive)
     {
-	BinarySemaphoreWait(pool->jobQueue.hasJobs);
+	thread_job job;
+	if (JobQueuePull(jobQueue, &job))
+	{
+	    EventCountNotify(&jobQueue->hasFree, 0);
+
+	    job.function(job.arg);
+	    if (job.handle) __atomic_store_n(&job.handle->done, 1, __ATOMIC_RELEASE);
 
-	if (Threads_KeepAlive)
+	    __atomic_sub_fetch(&pool->nPending, 1, __ATOMIC_SEQ_CST);
+	    EventCountNotify(&pool->jobDone, 1);
+	    spin = 0;
+	}
+	else if (++spin < Thread_Spin_Count) CpuRelax();
+	else
 	{
-	    LockMutex(pool->threadCountLock);
-	    ++pool->numThreadsWorking;
-	    UnlockMutex(pool->threadCountLock);
-			
-	    void (*funcBuff)(void*);
-	    void *argBuff;
-	    thread_job *job = JobQueuePull(&pool->jobQueue);
-
-	    if (job)
-	    {
-		funcBuff = job->function;
-		argBuff  = job->arg;
-		funcBuff(argBuff);
-		FreeThreadJob(&pool->jobQueue, job);
-	    }
-			
-	    LockMutex(pool->threadCountLock);
-	    --pool->numThreadsWorking;
-
-	    if (!pool->numThreadsWorking)
-	    {
-		SignalCondition(pool->threadsAllIdle);
-	    }
-
-	    UnlockMutex(pool->threadCountLock);
+	    u32 key = EventCountPrepareWait(&jobQueue->hasJobs);
+	    if (JobQueueLength(jobQueue) > 0 || !Threads_KeepAlive) EventCountCancelWait(&jobQueue->hasJobs);
+	    else EventCountWait(&jobQueue->hasJobs, key);
+	    spin = 0;
 	}
     }
     
-    LockMutex(pool->threadCountLock);
-    --pool->numThreadsAlive;
-    UnlockMutex(pool->threadCountLock);
+    __atomic_sub_fetch(&pool->numThreadsAlive, 1, __ATOMIC_SEQ_CST);
+    EventCountNotify(&pool->jobDone, 1);
 
     return(NULL);
 }
@@ -687,6 +919,7 @@ ThreadInit(memory_arena *arena, thread_pool *pool, thread_context **context, u32
 
     (*context)->pool = pool;
     (*context)->id = id;
+    (*context)->cpu = NextThreadCPU();
 
     LaunchThread((*context)->th, ThreadFunc, *context);
 #ifndef _WIN32
@@ -699,163 +932,523 @@ global_function
 void
 JobQueueInit(memory_arena *arena, job_queue *jobQueue)
 {
-    jobQueue->hasJobs = PushStructP(arena, binary_semaphore);
-    jobQueue->hasFree = PushStructP(arena, binary_semaphore);
+    jobQueue->jobs = PushArrayP(arena, thread_job, Number_Thread_Jobs);
+    jobQueue->mask = Number_Thread_Jobs - 1;
+    ForLoop(Number_Thread_Jobs) jobQueue->jobs[index].sequence = index;
+    jobQueue->enqueuePos = 0;
+    jobQueue->dequeuePos = 0;
+
+    EventCountInit(&jobQueue->hasJobs);
+    EventCountInit(&jobQueue->hasFree);
+}
+
+// Workers start parked and jobs can be queued before they are running, so there is no need to wait for them here
+global_function
+thread_pool *
+ThreadPoolInit(memory_arena *arena, u32 nThreads)
+{
+    Threads_KeepAlive = 1;
 
-    InitialiseMutex(jobQueue->rwMutex);
-    BinarySemaphoreInit(jobQueue->hasJobs, 0);
-    BinarySemaphoreInit(jobQueue->hasFree, 0);
+    thread_pool *threadPool = PushStructP(arena, thread_pool);
+    threadPool->numThreadsAlive = 0;
+    threadPool->nPending = 0;
 
-    jobQueue->len = 0;
-    jobQueue->front = 0;
-    jobQueue->rear = 0;
+    JobQueueInit(arena, &threadPool->jobQueue);
+    EventCountInit(&threadPool->jobDone);
 
-    jobQueue->nFree = 0;
+    threadPool->threads = PushArrayP(arena, thread_context*, nThreads);
+	
     for (   u32 index = 0;
-	    index < Number_Thread_Jobs;
+	    index < nThreads;
 	    ++index )
     {
-	thread_job *job = PushStructP(arena, thread_job);
-	FreeThreadJob(jobQueue, job);
+	ThreadInit(arena, threadPool, threadPool->threads + index, index);
     }
+
+    return(threadPool);
 }
 
+#define ThreadPoolAddTask(pool, func, args) ThreadPoolAddWork(pool, (void (*)(void *))func, (void *)args)
+#define ThreadPoolAddTaskWithHandle(pool, func, args, handle) ThreadPoolAddWork(pool, (void (*)(void *))func, (void *)args, handle)
+
+// With a full ring the caller parks until a worker takes a job
 global_function
 void
-JobQueueClear(job_queue *jobQueue)
+ThreadPoolAddWork(thread_pool *threadPool, void (*function)(void*), void *arg, task_handle *handle = 0)
 {
-    while (jobQueue->len)
+    job_queue *jobQueue = &threadPool->jobQueue;
+    if (handle) __atomic_store_n(&handle->done, 0, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&threadPool->nPending, 1, __ATOMIC_SEQ_CST);
+
+    while (!JobQueuePush(jobQueue, function, arg, handle))
     {
-	thread_job *job = JobQueuePull(jobQueue);
-	FreeThreadJob(jobQueue, job);
+	u32 key = EventCountPrepareWait(&jobQueue->hasFree);
+	if (JobQueueLength(jobQueue) < (s32)Number_Thread_Jobs) EventCountCancelWait(&jobQueue->hasFree);
+	else EventCountWait(&jobQueue->hasFree, key);
     }
 
-    jobQueue->front = 0;
-    jobQueue->rear  = 0;
-    BinarySemaphoreInit(jobQueue->hasJobs, 0);
-    jobQueue->len = 0;
+    EventCountNotify(&jobQueue->hasJobs, 0);
 }
 
+// Waits for one task queued with a handle
 global_function
 void
-JobQueuePush(job_queue *jobQueue, thread_job *job)
+ThreadPoolWaitTask(thread_pool *threadPool, task_handle *handle)
 {
-    LockMutex(jobQueue->rwMutex);
-    job->prev = 0;
+    ForLoop(Thread_Spin_Count)
+    {
+	if (TaskDone(handle)) return;
+	CpuRelax();
+    }
 
-    switch (jobQueue->len)
+    while (!TaskDone(handle))
     {
-	case 0:
-	    jobQueue->front = job;
-	    jobQueue->rear  = job;
-	    break;
+	u32 key = EventCountPrepareWait(&threadPool->jobDone);
+	if (TaskDone(handle)) EventCountCancelWait(&threadPool->jobDone);
+	else EventCountWait(&threadPool->jobDone, key);
+    }
+}
+
+// Waits for every queued task
+global_function
+void
+ThreadPoolWait(thread_pool *threadPool)
+{
+    while (__atomic_load_n(&threadPool->nPending, __ATOMIC_SEQ_CST))
+    {
+	u32 key = EventCountPrepareWait(&threadPool->jobDone);
+	if (!__atomic_load_n(&threadPool->nPending, __ATOMIC_SEQ_CST)) EventCountCancelWait(&threadPool->jobDone);
+	else EventCountWait(&threadPool->jobDone, key);
+    }
+}
+
+global_function
+void
+ThreadPoolDestroy(thread_pool *threadPool)
+{
+    if (threadPool)
+    {
+	ThreadPoolWait(threadPool);
+	Threads_KeepAlive = 0;
 
-	default:
-	    jobQueue->rear->prev = job;
-	    jobQueue->rear = job;
+	while (__atomic_load_n(&threadPool->numThreadsAlive, __ATOMIC_SEQ_CST))
+	{
+	    u32 key = EventCountPrepareWait(&threadPool->jobDone);
+	    EventCountNotify(&threadPool->jobQueue.hasJobs, 1);
+	    if (!__atomic_load_n(&threadPool->numThreadsAlive, __ATOMIC_SEQ_CST)) EventCountCancelWait(&threadPool->jobDone);
+	    else EventCountWait(&threadPool->jobDone, key);
+	}
     }
-    ++jobQueue->len;
+}
+
+// Work-stealing pool
+// Every worker owns a deque of tasks (Chase and Lev's, in Le et al's C11 form): the owner pushes and pops at the bottom, idle workers steal from the top of a victim chosen at random, so a split task's halves spread out and uneven tasks balance without a shared queue.
+// Threads outside the pool share one extra deque, so only one of them can spawn or wait at a time; a thread waiting on a group runs tasks itself until the group is done.
+// A task is a range [begin, end) with a grain: it halves itself, spawning the upper halves, until it is no bigger than the grain, so a single task is the range [0, 1).
+// Tasks belong to a task_group. A group can have a continuation, run once all its tasks have finished, and can follow another group, so continuations of a chain of groups run one at a time, in order.
+#define Work_Stealing_Deque_Size 4096
+
+struct task_group;
+
+struct
+ws_task
+{
+    void (*function)(void *arg, u64 begin, u64 end);
+    void *arg;
+    task_group *group;
+    u64 begin;
+    u64 end;
+    u64 grain;
+};
+
+struct
+task_group
+{
+    threadSig pending;
+    threadSig done;
+    task_group *volatile next;
+    void (*continuation)(void *arg, u64 begin, u64 end);
+    void *continuationArg;
+};
+
+struct work_stealing_pool;
 
-    BinarySemaphorePost(jobQueue->hasJobs);	
-    UnlockMutex(jobQueue->rwMutex);
+struct
+ws_worker
+{
+    ws_task *tasks;
+    s64 mask;
+    u08 pad0[48];
+    volatile s64 top;
+    u08 pad1[56];
+    volatile s64 bottom;
+    u08 pad2[56];
+    work_stealing_pool *pool;
+    u32 id;
+    u32 seed;
+    s32 cpu;
+    u32 pad3;
+    thread th;
+};
+
+struct
+work_stealing_pool
+{
+    ws_worker *workers;
+    u32 nWorkers;
+    threadSig nAlive;
+    threadSig keepAlive;
+    u32 pad;
+    event_count hasWork;
+    event_count groupDone;
+};
+
+global_variable
+thread_local
+ws_worker *
+Thread_WS_Worker = 0;
+
+#define Task_Group_Finished ((task_group *)1)
+
+global_function
+ws_worker *
+WorkStealingSelf(work_stealing_pool *pool)
+{
+    return((Thread_WS_Worker && Thread_WS_Worker->pool == pool) ? Thread_WS_Worker : pool->workers + pool->nWorkers);
 }
 
+// Owner only; returns 0 if the deque is full
 global_function
-thread_pool *
-ThreadPoolInit(memory_arena *arena, u32 nThreads)
+u08
+WorkStealingPush(ws_worker *worker, ws_task *task)
 {
-    Threads_KeepAlive = 1;
+    s64 bottom = __atomic_load_n(&worker->bottom, __ATOMIC_RELAXED);
+    s64 top = __atomic_load_n(&worker->top, __ATOMIC_ACQUIRE);
+    if (bottom - top > worker->mask) return(0);
 
-    thread_pool *threadPool = PushStructP(arena, thread_pool);
-    threadPool->numThreadsAlive = 0;
-    threadPool->numThreadsWorking = 0;
+    worker->tasks[bottom & worker->mask] = *task;
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&worker->bottom, bottom + 1, __ATOMIC_RELAXED);
 
-    JobQueueInit(arena, &threadPool->jobQueue);
+    return(1);
+}
 
-    threadPool->threads = PushArrayP(arena, thread_context*, nThreads);
-	
-    InitialiseMutex(threadPool->threadCountLock);
-    InitialiseCond(threadPool->threadsAllIdle);
-	
-    for (   u32 index = 0;
-	    index < nThreads;
-	    ++index )
+// Owner only; returns 0 if the deque is empty
+global_function
+u08
+WorkStealingPop(ws_worker *worker, ws_task *task)
+{
+    s64 bottom = __atomic_load_n(&worker->bottom, __ATOMIC_RELAXED) - 1;
+    __atomic_store_n(&worker->bottom, bottom, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    s64 top = __atomic_load_n(&worker->top, __ATOMIC_RELAXED);
+
+    u08 result = 0;
+    if (top <= bottom)
     {
-	ThreadInit(arena, threadPool, threadPool->threads + index, index);
+	*task = worker->tasks[bottom & worker->mask];
+	result = 1;
+	if (top == bottom)
+	{
+	    // the last task, a thief may be taking it too
+	    result = __atomic_compare_exchange_n(&worker->top, &top, top + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+	    __atomic_store_n(&worker->bottom, bottom + 1, __ATOMIC_RELAXED);
+	}
     }
+    else __atomic_store_n(&worker->bottom, bottom + 1, __ATOMIC_RELAXED);
 
-    while (threadPool->numThreadsAlive != nThreads) {}
+    return(result);
+}
 
-    return(threadPool);
+// Any thread; returns 0 if the deque is empty or another thread took the task first
+global_function
+u08
+WorkStealingSteal(ws_worker *worker, ws_task *task)
+{
+    s64 top = __atomic_load_n(&worker->top, __ATOMIC_ACQUIRE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    s64 bottom = __atomic_load_n(&worker->bottom, __ATOMIC_ACQUIRE);
+
+    if (top >= bottom) return(0);
+
+    // the slot can be overwritten once top has moved on, in which case the exchange fails and the copy is dropped
+    *task = worker->tasks[top & worker->mask];
+    return(__atomic_compare_exchange_n(&worker->top, &top, top + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED));
 }
 
-#define ThreadPoolAddTask(pool, func, args) ThreadPoolAddWork(pool, (void (*)(void *))func, (void *)args)
+global_function
+u08
+WorkStealingHasWork(work_stealing_pool *pool)
+{
+    ForLoop(pool->nWorkers + 1)
+    {
+	ws_worker *worker = pool->workers + index;
+	if (__atomic_load_n(&worker->top, __ATOMIC_SEQ_CST) < __atomic_load_n(&worker->bottom, __ATOMIC_SEQ_CST)) return(1);
+    }
+    return(0);
+}
 
-#ifdef _WIN32
-#include <ctime>
-#define sleep(x) Sleep(1000 * x)
-#endif
+// Takes from the thread's own deque, then tries every other deque from a random start
+global_function
+u08
+WorkStealingFind(ws_worker *self, ws_task *task)
+{
+    if (WorkStealingPop(self, task)) return(1);
+
+    work_stealing_pool *pool = self->pool;
+    u32 nDeques = pool->nWorkers + 1;
+    self->seed = (self->seed * 1664525) + 1013904223;
+    u32 start = (u32)(((u64)self->seed * nDeques) >> 32);
+    ForLoop(nDeques)
+    {
+	ws_worker *victim = pool->workers + ((start + index) % nDeques);
+	if (victim != self && WorkStealingSteal(victim, task)) return(1);
+    }
+
+    return(0);
+}
+
+global_function void WorkStealingRun(ws_worker *self, ws_task *task);
 
 global_function
 void
-ThreadPoolAddWork(thread_pool *threadPool, void (*function)(void*), void *arg)
+WorkStealingSchedule(ws_worker *self, ws_task *task)
 {
-    thread_job *job;
-    
-    BinarySemaphoreWait(threadPool->jobQueue.hasFree);
-    while (!(job = GetFreeThreadJob(&threadPool->jobQueue)))
+    __atomic_add_fetch(&task->group->pending, 1, __ATOMIC_SEQ_CST);
+    if (WorkStealingPush(self, task)) EventCountNotify(&self->pool->hasWork, 0);
+    else WorkStealingRun(self, task);
+}
+
+global_function void TaskGroupRelease(ws_worker *self, task_group *group);
+
+global_function
+void
+TaskGroupFinish(ws_worker *self, task_group *group)
+{
+    if (group->continuation)
     {
-	printf("Waiting for a free job...\n");
-	sleep(1);
-	BinarySemaphoreWait(threadPool->jobQueue.hasFree);
+	// the continuation is the group's last task
+	ws_task task = {group->continuation, group->continuationArg, group, 0, 1, 1};
+	group->continuation = 0;
+	WorkStealingSchedule(self, &task);
+	return;
     }
-    
-    job->function = function;
-    job->arg = arg;
 
-    JobQueuePush(&threadPool->jobQueue, job);
+    task_group *next = __atomic_exchange_n(&group->next, Task_Group_Finished, __ATOMIC_ACQ_REL);
+    __atomic_store_n(&group->done, 1, __ATOMIC_RELEASE);
+    EventCountNotify(&self->pool->groupDone, 1);
+    if (next) TaskGroupRelease(self, next);
 }
 
 global_function
 void
-ThreadPoolWait(thread_pool *threadPool)
+TaskGroupRelease(ws_worker *self, task_group *group)
 {
-    LockMutex(threadPool->threadCountLock);
-    
-    while (threadPool->jobQueue.len || threadPool->numThreadsWorking)
+    if (!__atomic_sub_fetch(&group->pending, 1, __ATOMIC_ACQ_REL)) TaskGroupFinish(self, group);
+}
+
+global_function
+void
+WorkStealingRun(ws_worker *self, ws_task *task)
+{
+    while (task->end - task->begin > task->grain)
     {
-	WaitOnCond(threadPool->threadsAllIdle, threadPool->threadCountLock);
+	ws_task upper = *task;
+	upper.begin = task->begin + ((task->end - task->begin) >> 1);
+	task->end = upper.begin;
+	WorkStealingSchedule(self, &upper);
     }
-    
-    UnlockMutex(threadPool->threadCountLock);
+
+    task->function(task->arg, task->begin, task->end);
+    TaskGroupRelease(self, task->group);
 }
 
 global_function
-void
-ThreadPoolDestroy(thread_pool *threadPool)
+#ifndef _WIN32
+void *
+#else
+DWORD WINAPI
+#endif
+WorkStealingThreadFunc(void *in)
 {
-    if (threadPool)
+    ws_worker *self = (ws_worker *)in;
+    work_stealing_pool *pool = self->pool;
+    Thread_WS_Worker = self;
+    PinThread(self->cpu);
+
+    // the deque is written by its owner
+    FirstTouch(self->tasks, sizeof(ws_task) * Work_Stealing_Deque_Size);
+
+    __atomic_add_fetch(&pool->nAlive, 1, __ATOMIC_SEQ_CST);
+
+    u32 spin = 0;
+    while (__atomic_load_n(&pool->keepAlive, __ATOMIC_RELAXED))
     {
-	Threads_KeepAlive = 0;
+	ws_task task;
+	if (WorkStealingFind(self, &task))
+	{
+	    WorkStealingRun(self, &task);
+	    spin = 0;
+	}
+	else if (++spin < Thread_Spin_Count) CpuRelax();
+	else
+	{
+	    u32 key = EventCountPrepareWait(&pool->hasWork);
+	    if (WorkStealingHasWork(pool) || !__atomic_load_n(&pool->keepAlive, __ATOMIC_SEQ_CST)) EventCountCancelWait(&pool->hasWork);
+	    else EventCountWait(&pool->hasWork, key);
+	    spin = 0;
+	}
+    }
+
+    __atomic_sub_fetch(&pool->nAlive, 1, __ATOMIC_SEQ_CST);
+    EventCountNotify(&pool->groupDone, 1);
+
+    return(NULL);
+}
+
+global_function
+work_stealing_pool *
+WorkStealingPoolInit(memory_arena *arena, u32 nThreads)
+{
+    work_stealing_pool *pool = PushStructP(arena, work_stealing_pool);
+    pool->nWorkers = nThreads;
+    pool->nAlive = 0;
+    pool->keepAlive = 1;
+    EventCountInit(&pool->hasWork);
+    EventCountInit(&pool->groupDone);
+
+    // one deque per worker, plus one for threads outside the pool
+    pool->workers = PushArrayP(arena, ws_worker, (nThreads + 1), 6);
+    ForLoop(nThreads + 1)
+    {
+	ws_worker *worker = pool->workers + index;
+	worker->tasks = PushArrayP(arena, ws_task, Work_Stealing_Deque_Size);
+	worker->mask = Work_Stealing_Deque_Size - 1;
+	worker->top = 0;
+	worker->bottom = 0;
+	worker->pool = pool;
+	worker->id = index;
+	worker->seed = 0x9e3779b9 * (index + 1);
+	worker->cpu = index < nThreads ? NextThreadCPU() : -1;
+    }
+
+    ForLoop(nThreads)
+    {
+	ws_worker *worker = pool->workers + index;
+	LaunchThread(worker->th, WorkStealingThreadFunc, worker);
+#ifndef _WIN32
+	DetachThread(worker->th);
+#endif
+    }
 
-	f64 timeout = 1.0;
-	time_t start, end;
-	f64 tPassed = 0.0;
-	time (&start);
-	while (tPassed < timeout && threadPool->numThreadsAlive)
+    return(pool);
+}
+
+// Opens a group; its tasks and continuation are added with WorkStealingSpawn, WorkStealingParallelFor and WorkStealingThen.
+// With after set, the group is not done, and its continuation does not run, until after is done
+global_function
+void
+TaskGroupInit(task_group *group, task_group *after = 0)
+{
+    group->pending = 1;
+    group->done = 0;
+    group->next = 0;
+    group->continuation = 0;
+    group->continuationArg = 0;
+
+    if (after)
+    {
+	group->pending = 2;
+	task_group *expected = 0;
+	if (!__atomic_compare_exchange_n(&after->next, &expected, group, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
 	{
-	    BinarySemaphorePostAll(threadPool->jobQueue.hasJobs);
-	    time (&end);
-	    tPassed = difftime(end, start);
+	    // after is already done; a group can only be followed by one other group
+	    Assert(expected == Task_Group_Finished);
+	    group->pending = 1;
 	}
+    }
+}
+
+#define WorkStealingSpawn(pool, group, func, args) WorkStealingSpawnRange(pool, group, (void (*)(void *, u64, u64))func, (void *)args, 0, 1, 1)
+#define WorkStealingParallelFor(pool, group, n, grain, func, args) WorkStealingSpawnRange(pool, group, (void (*)(void *, u64, u64))func, (void *)args, 0, n, grain)
+
+// Calls function(arg, begin, end) over [begin, end) in pieces of at most grain
+global_function
+void
+WorkStealingSpawnRange(work_stealing_pool *pool, task_group *group, void (*function)(void *, u64, u64), void *arg, u64 begin, u64 end, u64 grain)
+{
+    if (end <= begin) return;
+    ws_task task = {function, arg, group, begin, end, Max(grain, 1)};
+    WorkStealingSchedule(WorkStealingSelf(pool), &task);
+}
 
-	while (threadPool->numThreadsAlive)
+// Closes a group: function(arg, 0, 1) runs once every task in it has finished (and the group it follows is done); then the group is done
+#define WorkStealingThen(pool, group, func, args) WorkStealingThen_(pool, group, (void (*)(void *, u64, u64))func, (void *)args)
+global_function
+void
+WorkStealingThen_(work_stealing_pool *pool, task_group *group, void (*function)(void *, u64, u64), void *arg)
+{
+    group->continuation = function;
+    group->continuationArg = arg;
+    TaskGroupRelease(WorkStealingSelf(pool), group);
+}
+
+// Closes a group with no continuation
+global_function
+void
+TaskGroupClose(work_stealing_pool *pool, task_group *group)
+{
+    TaskGroupRelease(WorkStealingSelf(pool), group);
+}
+
+global_function
+u08
+TaskGroupDone(task_group *group)
+{
+    return(__atomic_load_n(&group->done, __ATOMIC_ACQUIRE) != 0);
+}
+
+// Waits for a closed group, running tasks in the meantime
+global_function
+void
+WorkStealingWait(work_stealing_pool *pool, task_group *group)
+{
+    ws_worker *self = WorkStealingSelf(pool);
+    u32 spin = 0;
+    while (!TaskGroupDone(group))
+    {
+	ws_task task;
+	if (WorkStealingFind(self, &task))
 	{
-	    BinarySemaphorePostAll(threadPool->jobQueue.hasJobs);
-	    sleep(1);
+	    WorkStealingRun(self, &task);
+	    spin = 0;
 	}
+	else if (++spin < Thread_Spin_Count) CpuRelax();
+	else
+	{
+	    u32 key = EventCountPrepareWait(&pool->groupDone);
+	    if (TaskGroupDone(group) || WorkStealingHasWork(pool)) EventCountCancelWait(&pool->groupDone);
+	    else EventCountWait(&pool->groupDone, key);
+	    spin = 0;
+	}
+    }
+}
 
-	JobQueueClear(&threadPool->jobQueue);
+// The pool must be idle
+global_function
+void
+WorkStealingPoolDestroy(work_stealing_pool *pool)
+{
+    if (pool)
+    {
+	__atomic_store_n(&pool->keepAlive, 0, __ATOMIC_SEQ_CST);
+	while (__atomic_load_n(&pool->nAlive, __ATOMIC_SEQ_CST))
+	{
+	    u32 key = EventCountPrepareWait(&pool->groupDone);
+	    EventCountNotify(&pool->hasWork, 1);
+	    if (!__atomic_load_n(&pool->nAlive, __ATOMIC_SEQ_CST)) EventCountCancelWait(&pool->groupDone);
+	    else EventCountWait(&pool->groupDone, key);
+	}
     }
 }
 
@@ -0,0 +1,366 @@
+/*
+Copyright (c) 2021 Ed Harry, Wellcome Sanger Institute, Genome Research Limited
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+// io_uring I/O
+// A buffer_pool with a ring submits its buffers' I/O to the kernel instead of queueing it on its I/O thread.
+// Reads are queued as soon as a buffer is given back and writes as soon as a buffer is handed over; the caller only waits when the buffer it needs next is still busy.
+// Seekable streams (regular files, block devices) carry explicit offsets, so all of their I/O can be in flight at once.
+// Pipes and other streams have no offsets to order by, so their queued I/O goes to the kernel one request at a time, and a read is resubmitted until its buffer is full or the stream ends.
+// The buffers are registered with the ring when the locked memory limit allows it. The ring is set up with raw syscalls, there is no liburing dependency.
+// Pools with a task (BGZF, logs), zero-copy output or a mapped input stay on the I/O thread.
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#define IORing_Available
+#endif
+#endif
+
+#ifdef IORing_Available
+
+enum io_ring_state {ringIdle, ringQueued, ringInFlight, ringDone};
+
+struct
+io_ring
+{
+    s32 fd;
+    u32 pad0;
+    u32 *sqHead;
+    u32 *sqTail;
+    u32 *sqMask;
+    u32 *sqArray;
+    u32 *cqHead;
+    u32 *cqTail;
+    u32 *cqMask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+
+    struct iovec *spans;
+    u64 *offsets;
+    u64 *done;
+    u08 *states;
+    u64 offset;
+    u32 nextSubmit;
+    u32 nInFlight;
+    u08 write;
+    u08 seekable;
+    u08 fixed;
+    u08 pad[5];
+};
+
+global_function
+void
+SubmitIORequest(buffer_pool *pool, u32 index)
+{
+    io_ring *ring = pool->ring;
+    buffer *buffer = pool->buffers[index];
+    u64 done = ring->done[index];
+    u64 size = ring->write ? buffer->size : BufferSize;
+
+    u32 tail = *ring->sqTail;
+    u32 sqIndex = tail & *ring->sqMask;
+    struct io_uring_sqe *sqe = ring->sqes + sqIndex;
+    memset(sqe, 0, sizeof(*sqe));
+    if (!ring->nInFlight && pool->lastIOEnd)
+    {
+        pool->stats.idleTime += GetNanoSeconds() - pool->lastIOEnd;
+        pool->lastIOEnd = 0;
+    }
+    sqe->fd = pool->handle;
+    sqe->off = ring->seekable ? ring->offsets[index] + done : (u64)-1;
+    sqe->user_data = index;
+
+    if (ring->fixed)
+    {
+        sqe->opcode = ring->write ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+        sqe->addr = (u64)(buffer->buffer + done);
+        sqe->len = (u32)(size - done);
+        sqe->buf_index = (u16)index;
+    }
+    else
+    {
+        ring->spans[index].iov_base = buffer->buffer + done;
+        ring->spans[index].iov_len = size - done;
+        sqe->opcode = ring->write ? IORING_OP_WRITEV : IORING_OP_READV;
+        sqe->addr = (u64)(ring->spans + index);
+        sqe->len = 1;
+    }
+
+    ring->sqArray[sqIndex] = sqIndex;
+    __atomic_store_n(ring->sqTail, tail + 1, __ATOMIC_RELEASE);
+
+    while (syscall(__NR_io_uring_enter, ring->fd, 1, 0, 0, 0, 0) < 0 && errno == EINTR) {}
+
+    ring->states[index] = ringInFlight;
+    ++ring->nInFlight;
+}
+
+// Queued I/O is submitted in buffer order; unseekable streams keep one request in flight
+global_function
+void
+SubmitQueuedIO(buffer_pool *pool)
+{
+    io_ring *ring = pool->ring;
+    while (ring->states[ring->nextSubmit] == ringQueued && (ring->seekable || !ring->nInFlight))
+    {
+        u32 index = ring->nextSubmit;
+        ring->nextSubmit = (ring->nextSubmit + 1) % pool->nBuffers;
+
+        if (!ring->write)
+        {
+            // bytes already taken from the input (e.g. to detect its format) go first
+            ring->done[index] = pool->preloadSize;
+            if (pool->preloadSize)
+            {
+                memcpy(pool->buffers[index]->buffer, pool->preload, pool->preloadSize);
+                pool->preloadSize = 0;
+            }
+        }
+        else ring->done[index] = 0;
+
+        ring->offsets[index] = ring->offset - ring->done[index];
+        ring->offset += (ring->write ? pool->buffers[index]->size : BufferSize) - ring->done[index];
+
+        SubmitIORequest(pool, index);
+    }
+}
+
+// Waits for at least one completion, then handles everything that has completed
+global_function
+void
+ReapIOCompletions(buffer_pool *pool)
+{
+    io_ring *ring = pool->ring;
+    while (syscall(__NR_io_uring_enter, ring->fd, 0, 1, IORING_ENTER_GETEVENTS, 0, 0) < 0 && errno == EINTR) {}
+
+    u32 head = *ring->cqHead;
+    u32 tail = __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE);
+    while (head != tail)
+    {
+        struct io_uring_cqe *cqe = ring->cqes + (head & *ring->cqMask);
+        u32 index = (u32)cqe->user_data;
+        s32 result = cqe->res;
+        ++head;
+        --ring->nInFlight;
+
+        buffer *buffer = pool->buffers[index];
+        if (ring->write)
+        {
+            if (result > 0) ring->done[index] += (u64)result;
+            if (result <= 0) Global_Write_Error = 1;
+
+            if (result > 0 && ring->done[index] < buffer->size) SubmitIORequest(pool, index);
+            else ring->states[index] = ringDone;
+        }
+        else
+        {
+            if (result > 0) ring->done[index] += (u64)result;
+
+            // a short read is only the end of the stream if nothing more comes back; pipes return a pipe buffer (64 KB) at a time
+            if (result > 0 && ring->done[index] < BufferSize) SubmitIORequest(pool, index);
+            else
+            {
+                buffer->size = ring->done[index];
+                ring->states[index] = ringDone;
+            }
+        }
+    }
+    __atomic_store_n(ring->cqHead, head, __ATOMIC_RELEASE);
+
+    SubmitQueuedIO(pool);
+    if (!ring->nInFlight) pool->lastIOEnd = GetNanoSeconds();
+}
+
+// Reaps until buffer index has finished its I/O, counting the wait if it had not
+global_function
+void
+WaitForRingBuffer(buffer_pool *pool, u32 index)
+{
+    io_ring *ring = pool->ring;
+    if (ring->states[index] != ringQueued && ring->states[index] != ringInFlight) return;
+
+    BeginWait(&pool->stats);
+    while (ring->states[index] == ringQueued || ring->states[index] == ringInFlight) ReapIOCompletions(pool);
+    EndWait(&pool->stats);
+}
+
+global_function
+buffer *
+GetNextBuffer_Read_Ring(buffer_pool *pool)
+{
+    io_ring *ring = pool->ring;
+    if (!pool->started)
+    {
+        // the first buffer is handed out empty, as the I/O thread does, while the rest are read into
+        pool->started = 1;
+        pool->bufferPtr = 0;
+        ring->nextSubmit = 1;
+        pool->buffers[0]->size = 0;
+        ForLoop(pool->nBuffers - 1) ring->states[index + 1] = ringQueued;
+        SubmitQueuedIO(pool);
+        return(pool->buffers[0]);
+    }
+
+    ring->states[pool->bufferPtr] = ringQueued;
+    pool->bufferPtr = (pool->bufferPtr + 1) % pool->nBuffers;
+    SubmitQueuedIO(pool);
+    WaitForRingBuffer(pool, pool->bufferPtr);
+
+    return(pool->buffers[pool->bufferPtr]);
+}
+
+// Handing over an empty buffer waits for all queued writes, so a final call flushes the stream as the I/O thread's second call does
+global_function
+buffer *
+GetNextBuffer_Write_Ring(buffer_pool *pool)
+{
+    io_ring *ring = pool->ring;
+    buffer *buffer = pool->buffers[pool->bufferPtr];
+    if (!pool->started)
+    {
+        pool->started = 1;
+        buffer->size = 0;
+        return(buffer);
+    }
+
+    if (buffer->size)
+    {
+        ring->states[pool->bufferPtr] = ringQueued;
+        SubmitQueuedIO(pool);
+        pool->bufferPtr = (pool->bufferPtr + 1) % pool->nBuffers;
+        buffer = pool->buffers[pool->bufferPtr];
+        WaitForRingBuffer(pool, pool->bufferPtr);
+    }
+    else
+    {
+        if (ring->nInFlight)
+        {
+            BeginWait(&pool->stats);
+            while (ring->nInFlight) ReapIOCompletions(pool);
+            EndWait(&pool->stats);
+        }
+        if (ring->seekable) lseek(pool->handle, (off_t)ring->offset, SEEK_SET);
+    }
+
+    ring->states[pool->bufferPtr] = ringIdle;
+    buffer->size = 0;
+    return(buffer);
+}
+
+global_function
+u08
+EnableIORing(memory_arena *arena, buffer_pool *pool, u08 write)
+{
+    if (pool->task || pool->zeroCopy || pool->map || pool->writePool || pool->started) return(0);
+
+    u32 nBuffers = pool->nBuffers;
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    s32 fd = (s32)syscall(__NR_io_uring_setup, nBuffers, &params);
+    if (fd < 0) return(0);
+
+    u64 sqSize = params.sq_off.array + (params.sq_entries * sizeof(u32));
+    u64 cqSize = params.cq_off.cqes + (params.cq_entries * sizeof(struct io_uring_cqe));
+    u08 singleMap = (params.features & IORING_FEAT_SINGLE_MMAP) ? 1 : 0;
+    if (singleMap) sqSize = cqSize = Max(sqSize, cqSize);
+
+    u08 *sq = (u08 *)mmap(0, sqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    u08 *cq = singleMap ? sq : (u08 *)mmap(0, cqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    void *sqes = mmap(0, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if ((void *)sq == MAP_FAILED || (void *)cq == MAP_FAILED || sqes == MAP_FAILED)
+    {
+        close(fd);
+        return(0);
+    }
+
+    io_ring *ring = PushStructP(arena, io_ring);
+    ring->fd = fd;
+    ring->sqHead = (u32 *)(sq + params.sq_off.head);
+    ring->sqTail = (u32 *)(sq + params.sq_off.tail);
+    ring->sqMask = (u32 *)(sq + params.sq_off.ring_mask);
+    ring->sqArray = (u32 *)(sq + params.sq_off.array);
+    ring->cqHead = (u32 *)(cq + params.cq_off.head);
+    ring->cqTail = (u32 *)(cq + params.cq_off.tail);
+    ring->cqMask = (u32 *)(cq + params.cq_off.ring_mask);
+    ring->sqes = (struct io_uring_sqe *)sqes;
+    ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+    ring->spans = PushArrayP(arena, struct iovec, nBuffers);
+    ring->offsets = PushArrayP(arena, u64, nBuffers);
+    ring->done = PushArrayP(arena, u64, nBuffers);
+    ring->states = PushArrayP(arena, u08, nBuffers);
+    ForLoop(nBuffers)
+    {
+        ring->spans[index].iov_base = pool->buffers[index]->buffer;
+        ring->spans[index].iov_len = BufferSize;
+        ring->offsets[index] = 0;
+        ring->done[index] = 0;
+        ring->states[index] = ringIdle;
+    }
+    ring->fixed = syscall(__NR_io_uring_register, fd, IORING_REGISTER_BUFFERS, ring->spans, nBuffers) ? 0 : 1;
+
+    struct stat fileStat;
+    off_t offset = lseek(pool->handle, 0, SEEK_CUR);
+    ring->seekable = !fstat(pool->handle, &fileStat) && (S_ISREG(fileStat.st_mode) || S_ISBLK(fileStat.st_mode)) && offset >= 0;
+    // appends ignore the offset, so they have to go out in order
+    if (write && (fcntl(pool->handle, F_GETFL) & O_APPEND)) ring->seekable = 0;
+    ring->offset = ring->seekable ? (u64)offset : 0;
+    ring->nextSubmit = 0;
+    ring->nInFlight = 0;
+    ring->write = write;
+
+    pool->ring = ring;
+    pool->stats.untimed = 1;
+    return(1);
+}
+
+#else
+
+struct
+io_ring
+{
+    u08 fixed;
+};
+
+global_function
+buffer *
+GetNextBuffer_Read_Ring(buffer_pool *pool)
+{
+    return(pool->buffers[0]);
+}
+
+global_function
+buffer *
+GetNextBuffer_Write_Ring(buffer_pool *pool)
+{
+    return(pool->buffers[0]);
+}
+
+global_function
+u08
+EnableIORing(memory_arena *arena, buffer_pool *pool, u08 write)
+{
+    return(0);
+}
+
+#endif
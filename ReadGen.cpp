@@ -0,0 +1,506 @@
+/*
+Copyright (c) 2021 Ed Harry, Wellcome Sanger Institute, Genome Research Limited
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+// Synthetic haplotagged reads
+// Unmapped SAM (or BAM) records with BC/QT tags, or FASTQ records with BX tags in the comment, drawn from a pool of distinct haplotag barcodes. BAM records hold the same reads as SAM ones.
+// Records are grouped into templates: a read1 followed by a read2 is a pair sharing a name and tags, any other record is a template of its own. read1Fraction of records are read1, spread evenly, so 0.5 gives pairs.
+// A template's barcode, tags and errors depend only on its first record's index and the seed, and bases and qualities on the job the record falls in, so output doesn't depend on the number of threads.
+// Barcode n of the pool is drawn with probability falling as u^skew for uniform u (1 is uniform). Every barcode base is an N with probability nRate, else substituted with probability errorRate.
+// A group with one error is expected to be corrected and a group with more to be unclear; FASTQ BX tags write unclear groups as 00 and the clear barcode log counts templates of read1s accordingly.
+// Requires BC.cpp (the bases of each barcode come from its decode tables) and BGZF.cpp, whose writer compresses BAM output.
+
+#include <math.h>
+
+enum read_gen_format {readGenSAM, readGenFASTQ, readGenBAM};
+
+#define Read_Gen_Length 150
+#define Read_Gen_Record_Size ((2 * Read_Gen_Length) + 192)
+#define Read_Gen_Job_Records 8192
+#define Read_Gen_Jobs_Per_Thread 2
+#define Read_Gen_BarCode_Space 84934656 // 96^4
+#define Read_Gen_CDF_Bits 16
+#define Default_Read_Gen_Reads 1000000
+#define Default_Read_Gen_BarCodes 100000
+#define Default_Read_Gen_Skew 2.0
+#define Default_Read_Gen_Error_Rate 0.01
+#define Default_Read_Gen_N_Rate 0.001
+#define Default_Read_Gen_Missing 0.01
+#define Default_Read_Gen_Read1_Fraction 0.5
+#define Default_Read_Gen_Seed 0x4854424e43480001
+
+struct
+read_generator
+{
+    u08 groups[4][BC_Max_Number + 1][6]; // bases of each group's barcodes, by barcode number
+    u32 baseQuads[256]; // four bases per random byte
+    u16 qualityPairs[256]; // two qualities per random byte
+    u32 *barcodes;
+    u32 *cdf;
+    u32 *correct;
+    u32 *corrected;
+    u64 nReads;
+    u64 seed;
+    f64 read1Fraction;
+    u32 nBarCodes;
+    u32 errorThreshold; // thresholds on 16 random bits
+    u32 nThreshold;
+    u32 missingThreshold;
+    u08 format; // read_gen_format
+    u08 pad[7];
+};
+
+// Returns the generator, ready for GenerateReads; with countBarCodes set, templates are counted for WriteClearBarCodeLog
+global_function
+read_generator *
+CreateReadGenerator(memory_arena *arena, u64 nReads, u32 nBarCodes, f64 skew, f64 errorRate, f64 nRate, f64 missing, f64 read1Fraction, u64 seed, u08 format, u08 countBarCodes)
+{
+    read_generator *gen = PushStructP(arena, read_generator);
+    memset(gen, 0, sizeof(read_generator));
+    gen->nReads = nReads;
+    gen->nBarCodes = nBarCodes;
+    gen->seed = seed;
+    gen->read1Fraction = read1Fraction;
+    gen->format = format;
+    gen->nThreshold = (u32)(nRate * 65536.0);
+    gen->errorThreshold = gen->nThreshold + (u32)((1.0 - nRate) * errorRate * 65536.0);
+    gen->missingThreshold = (u32)(missing * 65536.0);
+
+    // the bases of barcode n are those of the exact (uncorrected) table entry for n
+    ForLoop(4) ForLoop2(BC_Group_Size) if (BC_Table[index][index2] && !(BC_Table[index][index2] & 128))
+    {
+        u32 code = index2;
+        for (s32 base = 5; base >= 0; --base)
+        {
+            gen->groups[index][BC_Table[index][index2]][base] = (u08)"ATGCN"[code % 5];
+            code /= 5;
+        }
+    }
+
+    ForLoop(256)
+    {
+        ForLoop2(4) ((u08 *)(gen->baseQuads + index))[index2] = (u08)"ACGT"[(index >> (2 * index2)) & 3];
+        ForLoop2(2) ((u08 *)(gen->qualityPairs + index))[index2] = (u08)"FFFFFFFFFFF:::,#"[(index >> (4 * index2)) & 15];
+    }
+
+    // an odd multiplier not divisible by 3 permutes the barcode space
+    gen->barcodes = PushArrayP(arena, u32, nBarCodes);
+    ForLoop(nBarCodes)
+    {
+        u64 code = ((u64)index * 2654435761) % Read_Gen_BarCode_Space;
+        u32 barcode = 0;
+        ForLoop2(4)
+        {
+            barcode = (barcode << 8) | (u32)((code % BC_Max_Number) + 1);
+            code /= BC_Max_Number;
+        }
+        gen->barcodes[index] = barcode;
+    }
+
+    // inverse CDF of the pool index, interpolated between entries
+    gen->cdf = PushArrayP(arena, u32, (1 << Read_Gen_CDF_Bits) + 1);
+    ForLoop((1 << Read_Gen_CDF_Bits) + 1) gen->cdf[index] = (u32)Min((f64)(nBarCodes - 1), (f64)nBarCodes * pow((f64)index / (f64)(1 << Read_Gen_CDF_Bits), skew));
+
+    if (countBarCodes)
+    {
+        gen->correct = PushArrayP(arena, u32, nBarCodes);
+        gen->corrected = PushArrayP(arena, u32, nBarCodes);
+        memset(gen->correct, 0, nBarCodes * sizeof(u32));
+        memset(gen->corrected, 0, nBarCodes * sizeof(u32));
+    }
+
+    return(gen);
+}
+
+global_function
+u08
+IsRead1(read_generator *gen, u64 record)
+{
+    f64 offset = 1.0 - gen->read1Fraction;
+    return((u64)(((f64)(record + 1) * gen->read1Fraction) + offset) != (u64)(((f64)record * gen->read1Fraction) + offset));
+}
+
+// Each random u64 gives 32 bases or 16 qualities
+global_function
+u08 *
+WriteRandomBases(read_generator *gen, u64 *state, u08 *ptr, u32 n)
+{
+    for (; n >= 32; n -= 32)
+    {
+        u64 random = NextRandom(state);
+        ForLoop(8)
+        {
+            memcpy(ptr, gen->baseQuads + (random & 0xff), 4);
+            random >>= 8;
+            ptr += 4;
+        }
+    }
+    for (u64 random = NextRandom(state); n; random >>= 8)
+    {
+        u32 written = Min(4, n);
+        memcpy(ptr, gen->baseQuads + (random & 0xff), written);
+        ptr += written;
+        n -= written;
+    }
+    return(ptr);
+}
+
+global_function
+u08 *
+WriteRandomQualities(read_generator *gen, u64 *state, u08 *ptr, u32 n)
+{
+    for (; n >= 16; n -= 16)
+    {
+        u64 random = NextRandom(state);
+        ForLoop(8)
+        {
+            memcpy(ptr, gen->qualityPairs + (random & 0xff), 2);
+            random >>= 8;
+            ptr += 2;
+        }
+    }
+    for (u64 random = NextRandom(state); n; random >>= 8)
+    {
+        u32 written = Min(2, n);
+        memcpy(ptr, gen->qualityPairs + (random & 0xff), written);
+        ptr += written;
+        n -= written;
+    }
+    return(ptr);
+}
+
+// A template's tags: BC 'C bases, linker, A bases-D bases, linker, B bases' as BC.cpp decodes them, QT, and BX with unclear groups as 00
+struct
+read_template
+{
+    u08 BC[27];
+    u08 QT[27];
+    u08 BX[12];
+    u08 missing;
+    u08 pad;
+};
+
+// A template that starts in one job and ends in the next is made by both, only the first counts it
+global_function
+void
+MakeReadTemplate(read_generator *gen, u64 start, read_template *read, u08 count)
+{
+    u64 state = gen->seed ^ (start * 0x9e3779b97f4a7c15);
+    u64 random = NextRandom(&state);
+    read->missing = (u32)(random & 0xffff) < gen->missingThreshold;
+    if (read->missing) return;
+
+    u32 uniform = (u32)(random >> 32);
+    u32 *cdf = gen->cdf + (uniform >> (32 - Read_Gen_CDF_Bits));
+    u32 poolIndex = cdf[0] + (u32)(((u64)(cdf[1] - cdf[0]) * (uniform & ((1 << (32 - Read_Gen_CDF_Bits)) - 1))) >> (32 - Read_Gen_CDF_Bits));
+    u32 barcode = gen->barcodes[poolIndex];
+    u08 numbers[4] = {(u08)(barcode >> 24), (u08)(barcode >> 8), (u08)(barcode >> 16), (u08)barcode}; // A, B, C, D
+
+    WriteRandomBases(gen, &state, read->BC, 27);
+    ForLoop(6)
+    {
+        read->BC[index] = gen->groups[2][numbers[2]][index];
+        read->BC[7 + index] = gen->groups[0][numbers[0]][index];
+        read->BC[14 + index] = gen->groups[3][numbers[3]][index];
+        read->BC[21 + index] = gen->groups[1][numbers[1]][index];
+    }
+    read->BC[13] = '-';
+
+    // errors, with the group (A, B, C, D) each position of BC belongs to
+    u32 errors[4] = {};
+    if (gen->errorThreshold)
+    {
+        const u08 positionGroup[27] = {2, 2, 2, 2, 2, 2, 4, 0, 0, 0, 0, 0, 0, 4, 3, 3, 3, 3, 3, 3, 4, 1, 1, 1, 1, 1, 1};
+        ForLoop(27) if (index != 13)
+        {
+            if (!(index & 3)) random = NextRandom(&state);
+            u32 draw = (u32)(random & 0xffff);
+            random >>= 16;
+            if (draw < gen->errorThreshold)
+            {
+                u08 base = read->BC[index];
+                read->BC[index] = draw < gen->nThreshold ? 'N' : (u08)"ACTG"[(((base >> 1) & 3) + 1 + (draw % 3)) & 3];
+                if (positionGroup[index] < 4) ++errors[positionGroup[index]];
+            }
+        }
+    }
+
+    WriteRandomQualities(gen, &state, read->QT, 27);
+    read->QT[13] = ' ';
+
+    u08 unclear = 0;
+    u08 corrected = 0;
+    ForLoop(4)
+    {
+        if (errors[index] > 1)
+        {
+            numbers[index] = 0;
+            unclear = 1;
+        }
+        else corrected |= (u08)errors[index];
+    }
+    FormatBarCode(read->BX, numbers[0], numbers[2], numbers[1], numbers[3]);
+
+    if (count && gen->correct && !unclear && IsRead1(gen, start)) __atomic_fetch_add((corrected ? gen->corrected : gen->correct) + poolIndex, 1, __ATOMIC_RELAXED);
+}
+
+global_function
+u32
+BamBaseCode(u08 base)
+{
+    return(base == 'A' ? 1 : (base == 'C' ? 2 : (base == 'G' ? 4 : 8)));
+}
+
+// Writes records [first, first + n) to output, returns the bytes written; output needs room for n * Read_Gen_Record_Size bytes
+global_function
+u64
+GenerateReads(read_generator *gen, u08 *output, u64 first, u64 n)
+{
+    u08 *ptr = output;
+    u64 state = gen->seed ^ ~(first * 0xbf58476d1ce4e5b9);
+    read_template read;
+    u64 templateStart = (u64)-1;
+
+    for (   u64 record = first;
+            record < first + n;
+            ++record )
+    {
+        u08 read1 = IsRead1(gen, record);
+        u64 start = (!read1 && record && IsRead1(gen, record - 1)) ? record - 1 : record;
+        if (start != templateStart) MakeReadTemplate(gen, templateStart = start, &read, start == record);
+
+        if (gen->format == readGenFASTQ)
+        {
+            ptr += stbsp_snprintf((char *)ptr, 32, "@read%" PRIu64, start);
+            if (!read.missing)
+            {
+                memcpy(ptr, "\tBX:Z:", 6);
+                memcpy(ptr + 6, read.BX, 12);
+                ptr += 18;
+            }
+            *ptr++ = '\n';
+            ptr = WriteRandomBases(gen, &state, ptr, Read_Gen_Length);
+            *ptr++ = '\n';
+            *ptr++ = '+';
+            *ptr++ = '\n';
+            ptr = WriteRandomQualities(gen, &state, ptr, Read_Gen_Length);
+            *ptr++ = '\n';
+        }
+        else if (gen->format == readGenBAM)
+        {
+            // block size, refID, pos, l_read_name, mapq, bin, n_cigar_op, flag, l_seq, next refID, next pos, tlen; then name, 4-bit bases, raw qualities and tags
+            u08 *record = ptr;
+            u32 nameLength = (u32)stbsp_snprintf((char *)record + 36, 32, "read%" PRIu64, start) + 1;
+            WriteLE32(record + 4, (u32)-1);
+            WriteLE32(record + 8, (u32)-1);
+            WriteLE32(record + 12, nameLength | (4680 << 16));
+            WriteLE32(record + 16, (u32)(read1 ? 77 : 141) << 16);
+            WriteLE32(record + 20, Read_Gen_Length);
+            WriteLE32(record + 24, (u32)-1);
+            WriteLE32(record + 28, (u32)-1);
+            WriteLE32(record + 32, 0);
+            ptr = record + 36 + nameLength;
+
+            u08 bases[Read_Gen_Length];
+            WriteRandomBases(gen, &state, bases, Read_Gen_Length);
+            ForLoop(Read_Gen_Length / 2) *ptr++ = (u08)((BamBaseCode(bases[2 * index]) << 4) | BamBaseCode(bases[(2 * index) + 1]));
+            u08 *qualities = ptr;
+            ptr = WriteRandomQualities(gen, &state, ptr, Read_Gen_Length);
+            ForLoop(Read_Gen_Length) qualities[index] -= 33;
+
+            if (!read.missing)
+            {
+                memcpy(ptr, "BCZ", 3);
+                memcpy(ptr + 3, read.BC, 27);
+                ptr[30] = 0;
+                memcpy(ptr + 31, "QTZ", 3);
+                memcpy(ptr + 34, read.QT, 27);
+                ptr[61] = 0;
+                ptr += 62;
+            }
+            WriteLE32(record, (u32)(ptr - record) - 4);
+        }
+        else
+        {
+            ptr += stbsp_snprintf((char *)ptr, 64, "read%" PRIu64 "\t%u\t*\t0\t0\t*\t*\t0\t0\t", start, read1 ? 77 : 141);
+            ptr = WriteRandomBases(gen, &state, ptr, Read_Gen_Length);
+            *ptr++ = '\t';
+            ptr = WriteRandomQualities(gen, &state, ptr, Read_Gen_Length);
+            if (!read.missing)
+            {
+                memcpy(ptr, "\tBC:Z:", 6);
+                memcpy(ptr + 6, read.BC, 27);
+                memcpy(ptr + 33, "\tQT:Z:", 6);
+                memcpy(ptr + 39, read.QT, 27);
+                ptr += 66;
+            }
+            *ptr++ = '\n';
+        }
+    }
+
+    return((u64)(ptr - output));
+}
+
+// Read generation engine
+// Records are cut into jobs of Read_Gen_Job_Records, generated concurrently into one of the engine's output slots and handed to a zero-copy write pool in order, which writes them out with writev.
+// Each slot is a task group on a work-stealing pool whose continuation appends the slot to the write pool; every group follows the one before it, so slots are appended one at a time, in order, while later slots are still being generated.
+// The write pool references a slot until nBuffers - 1 more slots have been appended, so with nBuffers + 1 slots, one can be reused once the slot before the last has been appended; the next slot is generated while the last is appended.
+struct
+read_gen_job
+{
+    read_generator *gen;
+    u08 *output;
+    u64 size;
+    u64 first;
+    u64 nRecords;
+};
+
+struct
+read_gen_writer
+{
+    buffer_pool *writePool;
+    buffer *writeBuffer;
+    u64 size;
+};
+
+struct
+read_gen_slot
+{
+    read_gen_job *jobs;
+    read_gen_writer *writer;
+    task_group group;
+    u32 nJobs;
+    u32 pad;
+};
+
+global_function
+void
+RunReadGenJobs(read_gen_slot *slot, u64 begin, u64 end)
+{
+    for (u64 index = begin; index < end; ++index)
+    {
+        read_gen_job *job = slot->jobs + index;
+        job->size = GenerateReads(job->gen, job->output, job->first, job->nRecords);
+    }
+}
+
+global_function
+void
+AppendReadGenSlot(read_gen_slot *slot, u64, u64)
+{
+    read_gen_writer *writer = slot->writer;
+    ForLoop(slot->nJobs)
+    {
+        writer->writeBuffer = AppendToWriteBuffer(writer->writePool, writer->writeBuffer, slot->jobs[index].output, slot->jobs[index].size);
+        writer->size += slot->jobs[index].size;
+    }
+    writer->writeBuffer = GetNextBuffer_Write(writer->writePool);
+}
+
+// Writes the generator's reads to writePool (a SAM or BAM header first), returns the number of bytes; BAM needs writePool to have BGZF output
+global_function
+u64
+WriteReads(memory_arena *arena, read_generator *gen, buffer_pool *writePool, u32 nThreads)
+{
+    // the calling thread generates too while it waits on a slot
+    work_stealing_pool *pool = WorkStealingPoolInit(arena, nThreads - 1);
+    u32 maxJobs = nThreads * Read_Gen_Jobs_Per_Thread;
+    u32 nSlots = writePool->nBuffers + 1;
+    read_gen_writer *writer = PushStructP(arena, read_gen_writer);
+    read_gen_slot *slots = PushArrayP(arena, read_gen_slot, nSlots);
+    ForLoop(nSlots)
+    {
+        slots[index].jobs = PushArrayP(arena, read_gen_job, maxJobs);
+        slots[index].writer = writer;
+        slots[index].nJobs = 0;
+        ForLoop2(maxJobs) slots[index].jobs[index2].output = PushArrayP(arena, u08, Read_Gen_Job_Records * Read_Gen_Record_Size);
+        TaskGroupInit(&slots[index].group);
+        TaskGroupClose(pool, &slots[index].group);
+    }
+
+    writer->writePool = writePool;
+    writer->writeBuffer = GetNextBuffer_Write(writePool);
+    const char *samHeader = "@HD\tVN:1.6\tSO:unsorted\n";
+    u08 header[64];
+    writer->size = gen->format == readGenFASTQ ? 0 : strlen(samHeader);
+    memcpy(header, samHeader, writer->size);
+    if (gen->format == readGenBAM)
+    {
+        // magic, l_text, text, n_ref
+        memcpy(header, "BAM\1", 4);
+        WriteLE32(header + 4, (u32)writer->size);
+        memcpy(header + 8, samHeader, writer->size);
+        WriteLE32(header + 8 + writer->size, 0);
+        writer->size += 12;
+    }
+    writer->writeBuffer = CopyToWriteBuffer(writePool, writer->writeBuffer, header, writer->size);
+
+    u32 slotPtr = 0;
+    u64 record = 0;
+    task_group *previous = 0;
+    while (record < gen->nReads && !Global_Write_Error)
+    {
+        read_gen_slot *slot = slots + slotPtr;
+        FenceIn(WorkStealingWait(pool, &slots[(slotPtr + nSlots - 2) % nSlots].group));
+        slotPtr = (slotPtr + 1) % nSlots;
+
+        slot->nJobs = 0;
+        while (slot->nJobs < maxJobs && record < gen->nReads)
+        {
+            read_gen_job *job = slot->jobs + slot->nJobs++;
+            job->gen = gen;
+            job->first = record;
+            job->nRecords = Min(Read_Gen_Job_Records, gen->nReads - record);
+            record += job->nRecords;
+        }
+
+        TaskGroupInit(&slot->group, previous);
+        WorkStealingParallelFor(pool, &slot->group, slot->nJobs, 1, RunReadGenJobs, slot);
+        WorkStealingThen(pool, &slot->group, AppendReadGenSlot, slot);
+        previous = &slot->group;
+    }
+    ForLoop(nSlots) WorkStealingWait(pool, &slots[index].group);
+    WorkStealingPoolDestroy(pool);
+
+    GetNextBuffer_Write(writePool);
+    GetNextBuffer_Write(writePool);
+
+    return(writer->size);
+}
+
+// Writes the clear barcodes counted by the generator in the text format of SamHaplotag's clear barcode log; returns 0 on a write error
+global_function
+u08
+WriteClearBarCodeLog(read_generator *gen, s32 handle)
+{
+    const char *header = "Barcode\tCorrect Reads\tCorrected Reads\n";
+    if (WriteToLogFile(handle, (void *)header, strlen(header))) return(0);
+
+    ForLoop(gen->nBarCodes) if (gen->correct[index] || gen->corrected[index])
+    {
+        u08 line[64];
+        FormatPackedBarCode(line, gen->barcodes[index]);
+        u32 size = 12 + (u32)stbsp_snprintf((char *)line + 12, 52, "\t%u\t%u\n", gen->correct[index], gen->corrected[index]);
+        if (WriteToLogFile(handle, line, size)) return(0);
+    }
+
+    return(1);
+}
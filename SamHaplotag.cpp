@@ -27,6 +27,7 @@ SOFTWARE.
 #define ProgramVersion String(PV)
 
 #include "BC.cpp"
+#include "BGZF.cpp"
 
 global_function
 u08
@@ -116,134 +117,1589 @@ barcode
     u32 unclear;
 };
 
+// Barcode counter
+// A flat power-of-two table of barcodes, counters held inline, found by linear probing from a multiplicative hash. Four entries share a cache line, so most probes touch a single line.
+// Packed barcodes never have the top bit of a group set, so Empty_BarCode can't collide with a real one. The table doubles once it is three-quarters full.
+#define Empty_BarCode 0xffffffff
+#define BarCode_Table_Initial_Size_Log2 16
+
+struct
+barcode_hash_table
+{
+    barcode *table;
+    memory_arena *arena;
+    u32 sizeLog2;
+    u32 count;
+};
+
+global_function
+barcode *
+PushBarCodeTable(memory_arena *arena, u32 sizeLog2)
+{
+    u32 size = 1 << sizeLog2;
+    barcode *table = PushArrayP(arena, barcode, size, 6);
+    AdviseHugePages(table, sizeof(barcode) * size);
+    ForLoop(size)
+    {
+        table[index].barcode = Empty_BarCode;
+        table[index].correct = 0;
+        table[index].corrected = 0;
+        table[index].unclear = 0;
+    }
+    return(table);
+}
+
+global_function
+barcode_hash_table *
+CreateBarCodeHashTable(memory_arena *arena)
+{
+    barcode_hash_table *table = PushStructP(arena, barcode_hash_table);
+    table->arena = arena;
+    table->sizeLog2 = BarCode_Table_Initial_Size_Log2;
+    table->count = 0;
+    table->table = PushBarCodeTable(arena, table->sizeLog2);
+
+    return(table);
+}
+
+global_function
+u32
+BarCodeHash(u32 code, u32 sizeLog2)
+{
+    return((code * 0x9e3779b1) >> (32 - sizeLog2));
+}
+
+global_function
+void
+GrowBarCodeHashTable(barcode_hash_table *table)
+{
+    barcode *oldTable = table->table;
+    u32 oldSize = 1 << table->sizeLog2;
+
+    ++table->sizeLog2;
+    table->table = PushBarCodeTable(table->arena, table->sizeLog2);
+    u32 mask = (1 << table->sizeLog2) - 1;
+
+    ForLoop(oldSize) if (oldTable[index].barcode != Empty_BarCode)
+    {
+        u32 slot = BarCodeHash(oldTable[index].barcode, table->sizeLog2);
+        while (table->table[slot].barcode != Empty_BarCode) slot = (slot + 1) & mask;
+        table->table[slot] = oldTable[index];
+    }
+}
+
+global_function
+barcode *
+GetBarCodeFromHashTable(barcode_hash_table *table, u32 code)
+{
+    u32 mask = (1 << table->sizeLog2) - 1;
+    u32 slot = BarCodeHash(code, table->sizeLog2);
+    barcode *result;
+
+    while ((result = table->table + slot)->barcode != code)
+    {
+        if (result->barcode == Empty_BarCode)
+        {
+            if (4 * (table->count + 1) > 3 * (mask + 1))
+            {
+                GrowBarCodeHashTable(table);
+                return(GetBarCodeFromHashTable(table, code));
+            }
+
+            result->barcode = code;
+            ++table->count;
+            break;
+        }
+        slot = (slot + 1) & mask;
+    }
+
+    return(result);
+}
+
+// Returns the table's barcodes in ascending order of packed barcode, by an LSD radix sort on the 4 bytes of the key
+global_function
+barcode *
+SortBarCodes(barcode_hash_table *table, memory_arena *arena)
+{
+    u32 count = table->count;
+    barcode *in = PushArrayP(arena, barcode, count);
+    barcode *out = PushArrayP(arena, barcode, count);
+
+    u32 histograms[4][256] = {};
+    u32 nBarCodes = 0;
+    ForLoop(1 << table->sizeLog2) if (table->table[index].barcode != Empty_BarCode)
+    {
+        u32 code = table->table[index].barcode;
+        ForLoop2(4) ++histograms[index2][(code >> (8 * index2)) & 0xff];
+        in[nBarCodes++] = table->table[index];
+    }
+
+    ForLoop(4)
+    {
+        u32 shift = 8 * index;
+        u32 *histogram = histograms[index];
+        if (!count || histogram[(in[0].barcode >> shift) & 0xff] == count) continue; // every key has the same digit here
+
+        u32 offset = 0;
+        ForLoop2(256)
+        {
+            u32 n = histogram[index2];
+            histogram[index2] = offset;
+            offset += n;
+        }
+
+        ForLoop2(count) out[histogram[(in[index2].barcode >> shift) & 0xff]++] = in[index2];
+
+        barcode *tmp = in;
+        in = out;
+        out = tmp;
+    }
+
+    return(in);
+}
+
+// Writes barcodes (in ascending order) as a barcode statistics file, returns non-zero on error
+global_function
+u08
+WriteBarCodeStats(s32 handle, barcode *barcodes, u32 nBarCodes, memory_arena *arena)
+{
+    u64 size = sizeof(barcode_stats_header) + (16 * (u64)nBarCodes);
+    u08 *data = PushArrayP(arena, u08, size);
+
+    barcode_stats_header *header = (barcode_stats_header *)data;
+    memcpy(header->magic, BarCode_Stats_Magic, sizeof(header->magic));
+    header->nBarCodes = nBarCodes;
+    header->pad = 0;
+
+    u32 *columns = (u32 *)(header + 1);
+    ForLoop(nBarCodes)
+    {
+        columns[index] = barcodes[index].barcode;
+        columns[nBarCodes + index] = barcodes[index].correct;
+        columns[(2 * nBarCodes) + index] = barcodes[index].corrected;
+        columns[(3 * nBarCodes) + index] = barcodes[index].unclear;
+    }
+
+    return(WriteToLogFile(handle, data, size));
+}
+
+// Counts a read's barcode groups (as written to BX, corrected groups have 128 set)
+global_function
+void
+CountBarCode(barcode_hash_table *table, u08 a, u08 b, u08 c, u08 d)
+{
+    u32 barcodePack = (((u32)(a & 127)) << 24) | (((u32)(c & 127)) << 16) | (((u32)(b & 127)) << 8) | ((u32)(d & 127));
+    barcode *barcode = GetBarCodeFromHashTable(table, barcodePack);
+
+    ++((a && b && c && d) ? (((a | b | c | d) & 128) ? barcode->corrected : barcode->correct) : barcode->unclear);
+}
+
+// Adds the counts in src to dest; src can be merged again later once its counts have been cleared
+global_function
+void
+MergeBarCodeHashTable(barcode_hash_table *dest, barcode_hash_table *src)
+{
+    // src is walked in hash order, so dest must be at least as large or its probe runs pile up
+    while (dest->sizeLog2 < src->sizeLog2 || 4 * (dest->count + src->count) > 3 * (1u << dest->sizeLog2)) GrowBarCodeHashTable(dest);
+
+    ForLoop(1 << src->sizeLog2) if (src->table[index].barcode != Empty_BarCode)
+    {
+        barcode *from = src->table + index;
+        barcode *to = GetBarCodeFromHashTable(dest, from->barcode);
+        to->correct += from->correct;
+        to->corrected += from->corrected;
+        to->unclear += from->unclear;
+    }
+}
+
+// Record scanner
+// Finds the tab positions of a whole SAM record a block at a time, then tests each field against 'BC:Z:' and 'QT:Z:' with a single 4-byte compare.
+// Anything the scanner is not certain about (records crossing the end of the buffer, odd field lengths, etc.) is left to the per-byte state machine.
+#define Max_Record_Fields 256
+
+global_function
+s64
+IndexRecordFields_Scalar(u08 *base, u08 *ptr, u08 *end, u32 *tabs, u32 nTabs, u32 *nTabsOut)
+{
+    for (   ;
+            ptr < end;
+            ++ptr )
+    {
+        if (*ptr == '\n')
+        {
+            *nTabsOut = nTabs;
+            return((s64)(ptr - base));
+        }
+        if (*ptr == '\t')
+        {
+            if (nTabs == Max_Record_Fields) return(-1);
+            tabs[nTabs++] = (u32)(ptr - base);
+        }
+    }
+
+    return(-1);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+global_function
+s64
+IndexRecordFields_SSE2(u08 *base, u08 *end, u32 *tabs, u32 *nTabsOut)
+{
+    __m128i tab = _mm_set1_epi8('\t');
+    __m128i newLine = _mm_set1_epi8('\n');
+    u08 *ptr = base;
+    u32 nTabs = 0;
+
+    while ((ptr + 16) <= end)
+    {
+        __m128i block = _mm_loadu_si128((__m128i *)ptr);
+        u32 tabMask = (u32)_mm_movemask_epi8(_mm_cmpeq_epi8(block, tab));
+        u32 newLineMask = (u32)_mm_movemask_epi8(_mm_cmpeq_epi8(block, newLine));
+        if (newLineMask) tabMask &= (newLineMask & (~newLineMask + 1)) - 1;
+
+        while (tabMask)
+        {
+            if (nTabs == Max_Record_Fields) return(-1);
+            tabs[nTabs++] = (u32)(ptr - base) + (u32)__builtin_ctz(tabMask);
+            tabMask &= tabMask - 1;
+        }
+
+        if (newLineMask)
+        {
+            *nTabsOut = nTabs;
+            return((s64)(ptr - base) + __builtin_ctz(newLineMask));
+        }
+
+        ptr += 16;
+    }
+
+    return(IndexRecordFields_Scalar(base, ptr, end, tabs, nTabs, nTabsOut));
+}
+
+__attribute__((target("avx2")))
+global_function
+s64
+IndexRecordFields_AVX2(u08 *base, u08 *end, u32 *tabs, u32 *nTabsOut)
+{
+    __m256i tab = _mm256_set1_epi8('\t');
+    __m256i newLine = _mm256_set1_epi8('\n');
+    u08 *ptr = base;
+    u32 nTabs = 0;
+
+    while ((ptr + 32) <= end)
+    {
+        __m256i block = _mm256_loadu_si256((__m256i *)ptr);
+        u32 tabMask = (u32)_mm256_movemask_epi8(_mm256_cmpeq_epi8(block, tab));
+        u32 newLineMask = (u32)_mm256_movemask_epi8(_mm256_cmpeq_epi8(block, newLine));
+        if (newLineMask) tabMask &= (newLineMask & (~newLineMask + 1)) - 1;
+
+        while (tabMask)
+        {
+            if (nTabs == Max_Record_Fields) return(-1);
+            tabs[nTabs++] = (u32)(ptr - base) + (u32)__builtin_ctz(tabMask);
+            tabMask &= tabMask - 1;
+        }
+
+        if (newLineMask)
+        {
+            *nTabsOut = nTabs;
+            return((s64)(ptr - base) + __builtin_ctz(newLineMask));
+        }
+
+        ptr += 32;
+    }
+
+    return(IndexRecordFields_Scalar(base, ptr, end, tabs, nTabs, nTabsOut));
+}
+#endif
+
+global_function
+s64
+IndexRecordFields_NoSIMD(u08 *base, u08 *end, u32 *tabs, u32 *nTabsOut)
+{
+    return(IndexRecordFields_Scalar(base, base, end, tabs, 0, nTabsOut));
+}
+
+global_variable
+s64
+(*IndexRecordFields)(u08 *base, u08 *end, u32 *tabs, u32 *nTabsOut) = IndexRecordFields_NoSIMD;
+
+global_function
+const char *
+InitialiseRecordScanner()
+{
+    const char *result = "scalar";
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+    {
+        IndexRecordFields = IndexRecordFields_AVX2;
+        result = "AVX2";
+    }
+    else
+    {
+        IndexRecordFields = IndexRecordFields_SSE2;
+        result = "SSE2";
+    }
+#endif
+    return(result);
+}
+
 struct
-barcode_hash_table_node
+sam_record
 {
-    barcode *barcode;
-    barcode_hash_table_node *next;
+    u08 *name;
+    u08 *BC;
+    u08 *QT;
+    u64 length;
+    u32 nameLength;
+    u32 flags;
 };
 
+#define Tag_BC (((u32)'B') | (((u32)'C') << 8) | (((u32)':') << 16) | (((u32)'Z') << 24))
+#define Tag_QT (((u32)'Q') | (((u32)'T') << 8) | (((u32)':') << 16) | (((u32)'Z') << 24))
+
+global_function
+u08
+IsTagPrefix(u08 *field, u32 length, const char *tag)
+{
+    ForLoop(length) if (field[index] != (u08)tag[index]) return(0);
+    return(1);
+}
+
+// Returns 0 if the record must go through the per-byte state machine instead.
+// Matches the state machine exactly, including the quirk that a field which is a strict prefix of a tag (e.g. 'BC') hides the tag check on the following field.
+global_function
+u08
+ScanSamRecord(u08 *record, u08 *end, sam_record *result)
+{
+    // FLAG is read first; a record that won't be tagged only needs its end found
+    u08 *ptr = record;
+    u08 *nameEnd = 0;
+    while (ptr < end && *ptr != '\n' && (*ptr != '\t' || !nameEnd))
+    {
+        if (*ptr == '\t') nameEnd = ptr;
+        ++ptr;
+    }
+    if (ptr == end || *ptr != '\t') return(0);
+
+    u32 flagLength = (u32)(ptr - nameEnd - 1);
+    if (!flagLength || flagLength > 5) return(0);
+
+    u32 flags = StringToInt(ptr, flagLength);
+    if (!(flags & 64))
+    {
+        u08 *newLine = (u08 *)memchr(ptr, '\n', (size_t)(end - ptr));
+        if (!newLine) return(0);
+
+        result->length = (u64)(newLine - record) + 1;
+        result->name = record;
+        result->nameLength = Min((u32)(nameEnd - record), 63);
+        result->flags = flags;
+        result->BC = 0;
+        result->QT = 0;
+        return(1);
+    }
+
+    u32 tabs[Max_Record_Fields];
+    u32 nTabs;
+    s64 newLine = IndexRecordFields(record, end, tabs, &nTabs);
+    if (newLine < 0 || nTabs < 2) return(0);
+
+    result->length = (u64)newLine + 1;
+    result->name = record;
+    result->nameLength = Min(tabs[0], 63);
+    result->flags = flags;
+    result->BC = 0;
+    result->QT = 0;
+
+    u08 skipBC = 0;
+    u08 skipQT = 0;
+    ForLoop(nTabs - 1)
+    {
+        u08 *field = record + tabs[index + 1] + 1;
+        u32 fieldLength = ((index + 2) < nTabs ? tabs[index + 2] : (u32)newLine) - tabs[index + 1] - 1;
+
+        if (fieldLength >= 5)
+        {
+            u32 tag;
+            memcpy(&tag, field, sizeof(tag));
+            u08 colon = field[4] == ':';
+
+            if (!result->BC && !skipBC && colon && tag == Tag_BC)
+            {
+                if (fieldLength != 32) return(0);
+                result->BC = field + 5;
+            }
+            else if (!result->QT && !skipQT && colon && tag == Tag_QT)
+            {
+                if (fieldLength != 32) return(0);
+                result->QT = field + 5;
+            }
+            skipBC = skipQT = 0;
+        }
+        else
+        {
+            skipBC = !skipBC && IsTagPrefix(field, fieldLength, "BC:Z:");
+            skipQT = !skipQT && IsTagPrefix(field, fieldLength, "QT:Z:");
+        }
+    }
+
+    return(1);
+}
+
+// SAM tags are written as '\tXX:Z:value', BAM aux fields as 'XXZvalue\0'
+#define BamHaplotagTagsSize(outputRXQX) (((outputRXQX) ? (2 * (3 + 27 + 1)) : 0) + 3 + 12 + 1)
+
+global_function
+void
+WriteTagStart(buffer *writeBuffer, u08 tag0, u08 tag1, u08 bam)
+{
+    if (!bam) writeBuffer->buffer[writeBuffer->size++] = '\t';
+    writeBuffer->buffer[writeBuffer->size++] = tag0;
+    writeBuffer->buffer[writeBuffer->size++] = tag1;
+    if (!bam) writeBuffer->buffer[writeBuffer->size++] = ':';
+    writeBuffer->buffer[writeBuffer->size++] = 'Z';
+    if (!bam) writeBuffer->buffer[writeBuffer->size++] = ':';
+}
+
+global_function
+buffer *
+WriteHaplotagTags(u08 *BCBuffer, u08 *QTBuffer, u08 revComp, u08 outputRXQX, u08 bam, buffer_pool *writePool, buffer *writeBuffer, barcode_hash_table *counts)
+{
+    u32 totalNewSpace = (outputRXQX ? (2 * (6 + 27)) : 0) + 6 + 12;
+    if (writePool && (BufferSize - writeBuffer->size - 1) < totalNewSpace) writeBuffer = GetNextBuffer_Write(writePool);
+
+    u08 BDBuffer[16] = {};
+    ForLoop(13) BDBuffer[index] = revComp ? Comp(BCBuffer[26 - index]) : BCBuffer[14 + index];
+
+    if (outputRXQX)
+    {
+        // RX
+        WriteTagStart(writeBuffer, 'R', 'X', bam);
+        ForLoop(13) writeBuffer->buffer[writeBuffer->size++] = BCBuffer[index];
+        writeBuffer->buffer[writeBuffer->size++] = '+';
+        ForLoop(13) writeBuffer->buffer[writeBuffer->size++] = BDBuffer[index];
+        if (bam) writeBuffer->buffer[writeBuffer->size++] = 0;
+
+        // QX
+        WriteTagStart(writeBuffer, 'Q', 'X', bam);
+        ForLoop(13) writeBuffer->buffer[writeBuffer->size++] = QTBuffer[index];
+        writeBuffer->buffer[writeBuffer->size++] = '+';
+        ForLoop(13) writeBuffer->buffer[writeBuffer->size++] = QTBuffer[revComp ? (26 - index) : (14 + index)];
+        if (bam) writeBuffer->buffer[writeBuffer->size++] = 0;
+    }
+
+    // BX
+    u08 groups[4];
+    DecodeBarCode(BCBuffer, BDBuffer, groups);
+    u08 a = groups[0];
+    u08 b = groups[1];
+    u08 c = groups[2];
+    u08 d = groups[3];
+
+    // mates re-use a read1's tags, its barcode is only counted once
+    if (counts) CountBarCode(counts, a, b, c, d);
+
+    WriteTagStart(writeBuffer, 'B', 'X', bam);
+    FormatBarCode(writeBuffer->buffer + writeBuffer->size, a, c, b, d);
+    writeBuffer->size += 12;
+    if (bam) writeBuffer->buffer[writeBuffer->size++] = 0;
+
+    return(writeBuffer);
+}
+
+// Per-byte record state machine
+// Used for any record the SIMD scanner declines. BC and QT are copied out of the record into BCBuffer and QTBuffer, exactly as the original streaming parser did.
+global_function
+void
+ScanSamRecord_Bytewise(u08 *record, sam_record *result, u08 *BCBuffer, u08 *QTBuffer)
+{
+    enum tagStat {null, readTag1, readTag2, readTag3, readTag4, readTag5, readingData, done};
+    tagStat BC = null;
+    tagStat QT = null;
+    tagStat FL = null;
+
+    u08 flagBuffer[5];
+    u08 tagPtr = 0;
+    u32 namePtr = 0;
+    u08 nameDone = 0;
+
+    result->flags = 0;
+
+    u08 *ptr = record;
+    for (   u08 character = *ptr;
+            character != '\n';
+            character = *++ptr )
+    {
+        if (!nameDone)
+        {
+            if (character == '\t' || namePtr == 63) nameDone = 1;
+            else ++namePtr;
+        }
+
+        if (FL == null && character == '\t') FL = readingData;
+        else if (FL == readingData)
+        {
+            if (character != '\t')
+            {
+                if (tagPtr == sizeof(flagBuffer)) FL = done;
+                else flagBuffer[tagPtr++] = character;
+            }
+            else
+            {
+                if (tagPtr) result->flags = StringToInt(flagBuffer + tagPtr, (u32)tagPtr);
+
+                tagPtr = 0;
+                FL = done;
+            }
+        }
+
+        if (BC == null && character == '\t') BC = readTag1;
+        else if (BC == readTag1) BC = character == 'B' ? readTag2 : null;
+        else if (BC == readTag2) BC = character == 'C' ? readTag3 : null;
+        else if (BC == readTag3) BC = character == ':' ? readTag4 : null;
+        else if (BC == readTag4) BC = character == 'Z' ? readTag5 : null;
+        else if (BC == readTag5) BC = character == ':' ? readingData : null;
+        else if (BC == readingData)
+        {
+            BCBuffer[tagPtr++] = character;
+            if (tagPtr == 27)
+            {
+                tagPtr = 0;
+                BC = done;
+            }
+        }
+
+        if (QT == null && character == '\t') QT = readTag1;
+        else if (QT == readTag1) QT = character == 'Q' ? readTag2 : null;
+        else if (QT == readTag2) QT = character == 'T' ? readTag3 : null;
+        else if (QT == readTag3) QT = character == ':' ? readTag4 : null;
+        else if (QT == readTag4) QT = character == 'Z' ? readTag5 : null;
+        else if (QT == readTag5) QT = character == ':' ? readingData : null;
+        else if (QT == readingData)
+        {
+            QTBuffer[tagPtr++] = character;
+            if (tagPtr == 27)
+            {
+                tagPtr = 0;
+                QT = done;
+            }
+        }
+    }
+
+    result->length = (u64)(ptr - record) + 1;
+    result->name = record;
+    result->nameLength = namePtr;
+    result->BC = BC == done ? BCBuffer : 0;
+    result->QT = QT == done ? QTBuffer : 0;
+}
+
+// Mate cache
+// With --tag-mates the raw BC/QT of each tagged read1 is kept under its read name, so that read2 records can be given the same tags.
+// Entries sit in Mate_Cache_Ways-way buckets picked by a hash of the name and a full bucket evicts its oldest entry, preferring ones whose read2 has already been seen. Memory use is fixed, and mates need to be near each other in the input, as in collated or interleaved ('samtools view' of unaligned BAM) order.
+// Only evicting an entry that was never matched counts as an eviction, so the count is the number of read1s whose mate could no longer be tagged.
+#define Mate_Cache_Size_Log2 18
+#define Mate_Cache_Ways 4
+#define Mate_Cache_Name_Prefix 55
+#define MateCacheHashSeed 0x5a0d7c3bd96e1f27
+
 struct
-barcode_hash_table
+mate_cache_entry
 {
-    barcode_hash_table_node **table;
-    u32 size;
+    u64 nameHash;
+    u64 age;
+    u16 nameLength;
+    u08 matched;
+    u08 name[Mate_Cache_Name_Prefix];
+    u08 BC[27];
+    u08 QT[27];
+};
+
+struct
+mate_cache
+{
+    mate_cache_entry *entries;
+    u64 age;
+    u64 hits;
+    u64 misses;
+    u64 evictions;
+};
+
+global_function
+mate_cache *
+CreateMateCache(memory_arena *arena)
+{
+    mate_cache *cache = PushStructP(arena, mate_cache);
+    u32 size = 1 << Mate_Cache_Size_Log2;
+    cache->entries = PushArrayP(arena, mate_cache_entry, size, 6);
+    memset(cache->entries, 0, size * sizeof(mate_cache_entry));
+    cache->age = 0;
+    cache->hits = 0;
+    cache->misses = 0;
+    cache->evictions = 0;
+
+    return(cache);
+}
+
+global_function
+mate_cache_entry *
+MateCacheBucket(mate_cache *cache, u64 nameHash)
+{
+    return(cache->entries + ((nameHash >> (64 - Mate_Cache_Size_Log2)) & ~(u64)(Mate_Cache_Ways - 1)));
+}
+
+global_function
+u08
+MateCacheEntryIs(mate_cache_entry *entry, u64 nameHash, u08 *name, u32 nameLength)
+{
+    return(entry->age && entry->nameHash == nameHash && entry->nameLength == nameLength && !memcmp(entry->name, name, Min(nameLength, Mate_Cache_Name_Prefix)));
+}
+
+global_function
+void
+AddMate(mate_cache *cache, u08 *name, u32 nameLength, u08 *BC, u08 *QT)
+{
+    u64 nameHash = FastHash64(name, nameLength, MateCacheHashSeed);
+    mate_cache_entry *bucket = MateCacheBucket(cache, nameHash);
+
+    mate_cache_entry *entry = bucket;
+    ForLoop(Mate_Cache_Ways)
+    {
+        mate_cache_entry *way = bucket + index;
+        if (!way->age || MateCacheEntryIs(way, nameHash, name, nameLength))
+        {
+            entry = way;
+            break;
+        }
+        if (way->matched > entry->matched || (way->matched == entry->matched && way->age < entry->age)) entry = way;
+    }
+    if (entry->age && !entry->matched && !MateCacheEntryIs(entry, nameHash, name, nameLength)) ++cache->evictions;
+
+    entry->nameHash = nameHash;
+    entry->age = ++cache->age;
+    entry->nameLength = (u16)nameLength;
+    entry->matched = 0;
+    memcpy(entry->name, name, Min(nameLength, Mate_Cache_Name_Prefix));
+    memcpy(entry->BC, BC, sizeof(entry->BC));
+    memcpy(entry->QT, QT, sizeof(entry->QT));
+}
+
+global_function
+mate_cache_entry *
+FindMate(mate_cache *cache, u08 *name, u32 nameLength)
+{
+    u64 nameHash = FastHash64(name, nameLength, MateCacheHashSeed);
+    mate_cache_entry *bucket = MateCacheBucket(cache, nameHash);
+
+    mate_cache_entry *result = 0;
+    ForLoop(Mate_Cache_Ways) if (MateCacheEntryIs(bucket + index, nameHash, name, nameLength))
+    {
+        result = bucket + index;
+        result->matched = 1;
+        break;
+    }
+    ++(result ? cache->hits : cache->misses);
+
+    return(result);
+}
+
+global_function
+u32
+SamNameLength(u08 *record, u64 length)
+{
+    u08 *tab = (u08 *)memchr(record, '\t', length - 1);
+    return((u32)(tab ? (u64)(tab - record) : (length - 1)));
+}
+
+struct
+missing_tags
+{
+    u32 record;
+    u32 nameOffset;
+    u08 nameLength;
+    u08 haveBC;
+    u08 haveQT;
+    u08 pad;
+};
+
+struct tag_engine;
+
+// A run of whole SAM records to tag.
+// With writePool set the job streams into the shared write pool; without it output goes into the job's own buffer, which the caller has sized with TagJobOutputSize. Barcodes are counted into counts.
+struct
+tag_job
+{
+    u08 *input;
+    u64 inputSize;
+    buffer_pool *writePool;
+    buffer *output;
+    barcode_hash_table *counts;
+    tag_engine *engine;
+    missing_tags *missing;
+    mate_cache *mates;
+    u32 nMissing;
+    u32 nRecords;
+    u08 revComp;
+    u08 outputRXQX;
+    u08 referenceInput;
+    u08 pad[5];
+};
+
+// Worst case growth: a tagged record carries 27-character BC:Z and QT:Z tags, so it is at least 67 bytes, and gains at most 84 bytes of tags (under 3x); any other record is copied unchanged
+#define TagJobOutputSize(inputSize) ((4 * (inputSize)) + 256)
+#define TagJobMissingCount(inputSize) (((inputSize) / 4) + 1)
+
+global_function
+void
+TagRecords(tag_job *job)
+{
+    u08 BCBuffer[27];
+    u08 QTBuffer[27];
+
+    u08 *ptr = job->input;
+    u08 *end = job->input + job->inputSize;
+    job->nMissing = 0;
+    job->nRecords = 0;
+
+    while (ptr < end)
+    {
+        sam_record record;
+        if (!ScanSamRecord(ptr, end, &record)) ScanSamRecord_Bytewise(ptr, &record, BCBuffer, QTBuffer);
+
+        if (record.flags & 64)
+        {
+            job->output = job->referenceInput ? AppendToWriteBuffer(job->writePool, job->output, ptr, record.length - 1) : CopyToWriteBuffer(job->writePool, job->output, ptr, record.length - 1);
+            if (record.BC && record.QT)
+            {
+                job->output = WriteHaplotagTags(record.BC, record.QT, job->revComp, job->outputRXQX, 0, job->writePool, job->output, job->counts);
+                if (job->mates) AddMate(job->mates, ptr, SamNameLength(ptr, record.length), record.BC, record.QT);
+            }
+            else
+            {
+                missing_tags *missing = job->missing + job->nMissing++;
+                missing->record = job->nRecords;
+                missing->nameOffset = (u32)(ptr - job->input);
+                missing->nameLength = (u08)record.nameLength;
+                missing->haveBC = record.BC != 0;
+                missing->haveQT = record.QT != 0;
+            }
+            job->output->buffer[job->output->size++] = '\n';
+            if (job->writePool && BufferSize == job->output->size) job->output = GetNextBuffer_Write(job->writePool);
+        }
+        else
+        {
+            mate_cache_entry *mate = (job->mates && (record.flags & 128)) ? FindMate(job->mates, ptr, SamNameLength(ptr, record.length)) : 0;
+            if (mate)
+            {
+                job->output = job->referenceInput ? AppendToWriteBuffer(job->writePool, job->output, ptr, record.length - 1) : CopyToWriteBuffer(job->writePool, job->output, ptr, record.length - 1);
+                job->output = WriteHaplotagTags(mate->BC, mate->QT, job->revComp, job->outputRXQX, 0, job->writePool, job->output, 0);
+                job->output->buffer[job->output->size++] = '\n';
+                if (job->writePool && BufferSize == job->output->size) job->output = GetNextBuffer_Write(job->writePool);
+            }
+            else job->output = job->referenceInput ? AppendToWriteBuffer(job->writePool, job->output, ptr, record.length) : CopyToWriteBuffer(job->writePool, job->output, ptr, record.length);
+        }
+
+        ptr += record.length;
+        ++job->nRecords;
+    }
+}
+
+struct
+read_counter
+{
+    u64 total;
+    stage_stats *parse;
+    char printNBuffers[2][16];
+    u08 printNBufferPtr;
+    u08 pad[7];
+};
+
+global_function
+void
+CountReads(read_counter *counter, u64 n)
+{
+#define Log2_Print_Interval 14
+    u64 mask = (1 << Log2_Print_Interval) - 1;
+    u64 next = (counter->total | mask) + 1;
+    counter->total += n;
+
+    for (   ;
+            next <= counter->total;
+            next += (mask + 1) )
+    {
+        u08 currPtr = counter->printNBufferPtr;
+        u08 otherPtr = (currPtr + 1) & 1;
+        stbsp_snprintf(counter->printNBuffers[currPtr], sizeof(counter->printNBuffers[currPtr]), "%$" PRIu64, next);
+
+        if (strcmp(counter->printNBuffers[currPtr], counter->printNBuffers[otherPtr]))
+        {
+            PrintStatus("%s reads processed", counter->printNBuffers[currPtr]);
+        }
+
+        counter->printNBufferPtr = otherPtr;
+    }
+    counter->parse->records = counter->total;
+}
+
+// Missing-tag log
+// Read names are collected in a buffer pool and written out on its I/O thread. Only the first Max_Missing_Tag_Warnings reads are also reported on stderr, the rest are counted.
+#define Max_Missing_Tag_Warnings 16
+
+struct
+missing_tags_log
+{
+    buffer_pool *pool;
+    buffer *current;
+    u64 nMissing;
+};
+
+global_function
+missing_tags_log *
+CreateMissingTagsLog(memory_arena *arena, s32 handle)
+{
+    missing_tags_log *log = PushStructP(arena, missing_tags_log);
+    log->pool = CreatePool(arena);
+    log->pool->handle = handle;
+    log->pool->task = OutputLogBuffer;
+    log->current = GetNextBuffer_Write(log->pool);
+    log->nMissing = 0;
+
+    const char *header = "Read\n";
+    log->current = CopyToWriteBuffer(log->pool, log->current, (u08 *)header, strlen(header));
+
+    return(log);
+}
+
+// Flushes the log, returns non-zero if any of it could not be written
+global_function
+u08
+CloseMissingTagsLog(missing_tags_log *log)
+{
+    GetNextBuffer_Write(log->pool);
+    FenceIn(ThreadPoolWait(log->pool->pool));
+
+    if (log->nMissing > Max_Missing_Tag_Warnings) PrintWarning("%" PRIu64 " reads had missing BC/QT tags (%" PRIu64 " not shown)", log->nMissing, log->nMissing - Max_Missing_Tag_Warnings);
+    return(log->pool->writeError);
+}
+
+// Reports a finished job's reads and missing tags, in input order
+global_function
+u08
+ReportTagJob(tag_job *job, read_counter *counter, missing_tags_log *log)
+{
+    u32 nCounted = 0;
+    ForLoop(job->nMissing)
+    {
+        missing_tags *missing = job->missing + index;
+        CountReads(counter, missing->record - nCounted);
+        nCounted = missing->record + 1;
+
+        u08 *name = job->input + missing->nameOffset;
+        if (++log->nMissing <= Max_Missing_Tag_Warnings)
+        {
+            u08 nameBuffer[256];
+            ForLoop2(missing->nameLength) nameBuffer[index2] = name[index2];
+            nameBuffer[missing->nameLength] = 0;
+
+            PrintWarning("Read %s has no %s tag%s", nameBuffer, (!missing->haveBC && !missing->haveQT) ? "BC/QT" : (!missing->haveBC ? "BC" : "QT"), (!missing->haveBC && !missing->haveQT) ? "s" : "");
+            if (log->nMissing == Max_Missing_Tag_Warnings) PrintWarning("Further reads with missing tags are only written to the log");
+        }
+
+        if (BufferSize - log->current->size > missing->nameLength)
+        {
+            memcpy(log->current->buffer + log->current->size, name, missing->nameLength);
+            log->current->size += missing->nameLength;
+            log->current->buffer[log->current->size++] = '\n';
+        }
+        else
+        {
+            log->current = CopyToWriteBuffer(log->pool, log->current, name, missing->nameLength);
+            log->current = CopyToWriteBuffer(log->pool, log->current, (u08 *)"\n", 1);
+        }
+
+        CountReads(counter, 1);
+    }
+    CountReads(counter, job->nRecords - nCounted);
+
+    return(log->pool->writeError);
+}
+
+global_function
+u08 *
+FindLastNewLine(u08 *start, u08 *end)
+{
+    while (end > start && *(end - 1) != '\n') --end;
+    return(end);
+}
+
+// Record-parallel tagging
+// Each block of whole records is cut at newlines into chunks that are tagged concurrently into one of the engine's output slots. Outputs are handed to a zero-copy write pool in input order, which writes them out with writev and never lends the slot's pages to a pipe.
+// The write pool can hold nBuffers - 1 handed-over buffers, so with one slot per write buffer a slot is only reused once every block written from it has gone out.
+// Every worker thread counts barcodes into its own shard, with its own arena; shards are merged into the main table by MergeTagEngineCounts.
+// A shard is created by the thread that claims it, so its table is first touched, and placed, on that thread's NUMA node.
+// Chunks run on a work-stealing pool by default, so a thread that finishes its cheap chunks takes over part of another's, and the main thread is one of the tagging threads, taking chunks while it waits; with a FIFO thread_pool each chunk is a job in one shared queue.
+#define Tag_Jobs_Per_Thread 4
+#define Min_Tag_Job_Size KiloByte(64)
+
+struct
+tag_slot
+{
+    tag_job *jobs;
+    u08 *output;
+    missing_tags *missing;
+    buffer *outputs;
+    u32 nJobs;
+    u32 pad;
+};
+
+struct
+tag_engine
+{
+    thread_pool *pool;
+    work_stealing_pool *stealPool;
+    task_group group;
+    tag_slot *slots;
+    barcode_hash_table **shards;
+    memory_arena **shardArenas;
+    u32 nSlots;
+    u32 slotPtr;
+    u32 maxJobs;
+    u32 nShards;
+    threadSig nShardsClaimed;
     u32 pad;
+    stage_stats stats;
 };
 
-global_function
-barcode_hash_table *
-CreateBarCodeHashTable(memory_arena *arena)
-{
-    u32 size = 0x14CCCF;
+global_variable
+thread_local
+barcode_hash_table *
+Worker_Shard = 0;
+
+global_function
+tag_engine *
+CreateTagEngine(memory_arena *arena, u32 nThreads, u32 nSlots, u08 workStealing)
+{
+    tag_engine *engine = PushStructP(arena, tag_engine);
+    engine->pool = workStealing ? 0 : ThreadPoolInit(arena, nThreads);
+    // the main thread is one of the tagging threads while it waits on a work-stealing pool
+    engine->stealPool = workStealing ? WorkStealingPoolInit(arena, nThreads - 1) : 0;
+    engine->slotPtr = 0;
+    engine->maxJobs = nThreads * Tag_Jobs_Per_Thread;
+    engine->nShards = nThreads;
+    engine->nShardsClaimed = 0;
+    memset(&engine->stats, 0, sizeof(engine->stats));
+    engine->shards = PushArrayP(arena, barcode_hash_table *, engine->nShards);
+    engine->shardArenas = PushArrayP(arena, memory_arena *, engine->nShards);
+    ForLoop(engine->nShards)
+    {
+        engine->shardArenas[index] = PushStructP(arena, memory_arena);
+        CreateMemoryArenaP(engine->shardArenas[index], MegaByte(4));
+        engine->shards[index] = 0;
+    }
+
+    engine->nSlots = nSlots;
+    engine->slots = PushArrayP(arena, tag_slot, nSlots);
+    ForLoop(nSlots)
+    {
+        tag_slot *slot = engine->slots + index;
+        slot->jobs = PushArrayP(arena, tag_job, engine->maxJobs);
+        slot->outputs = PushArrayP(arena, buffer, engine->maxJobs);
+        slot->output = PushArrayP(arena, u08, (u64)TagJobOutputSize(BufferSize) + (256 * engine->maxJobs));
+        slot->missing = PushArrayP(arena, missing_tags, (u64)TagJobMissingCount(BufferSize) + engine->maxJobs);
+        slot->nJobs = 0;
+    }
+
+    return(engine);
+}
+
+global_function
+void
+RunTagJob(void *in)
+{
+    tag_job *job = (tag_job *)in;
+    if (!Worker_Shard)
+    {
+        u32 shard = __atomic_fetch_add(&job->engine->nShardsClaimed, 1, __ATOMIC_RELAXED);
+        Worker_Shard = job->engine->shards[shard] = CreateBarCodeHashTable(job->engine->shardArenas[shard]);
+    }
+    job->counts = Worker_Shard;
+
+    u64 start = GetNanoSeconds();
+    TagRecords(job);
+    Assert(job->output->size <= TagJobOutputSize(job->inputSize));
+    __atomic_fetch_add(&job->engine->stats.busyTime, GetNanoSeconds() - start, __ATOMIC_RELAXED);
+    TraceEvent("TagRecords", 0, "tag", start, job->inputSize);
+}
+
+global_function
+void
+RunTagJobs(tag_slot *slot, u64 begin, u64 end)
+{
+    for (u64 index = begin; index < end; ++index) RunTagJob(slot->jobs + index);
+}
+
+// Adds the workers' counts to table and clears them, so it can be called again once the engine is idle
+global_function
+void
+MergeTagEngineCounts(tag_engine *engine, barcode_hash_table *table)
+{
+    // TagBlockParallel has already waited for a work-stealing pool
+    if (engine->pool) ThreadPoolWait(engine->pool);
+    ThreadFence;
+    ForLoop(engine->nShards)
+    {
+        barcode_hash_table *shard = engine->shards[index];
+        if (!shard) continue;
+        MergeBarCodeHashTable(table, shard);
+        ForLoop2(1 << shard->sizeLog2)
+        {
+            shard->table[index2].correct = 0;
+            shard->table[index2].corrected = 0;
+            shard->table[index2].unclear = 0;
+        }
+    }
+}
+
+global_function
+tag_slot *
+TagBlockParallel(tag_engine *engine, u08 *start, u08 *end, u08 revComp, u08 outputRXQX)
+{
+    tag_slot *slot = engine->slots + engine->slotPtr;
+    engine->slotPtr = (engine->slotPtr + 1) % engine->nSlots;
+
+    u64 size = (u64)(end - start);
+    u64 target = Max(size / engine->maxJobs, Min_Tag_Job_Size);
+    slot->nJobs = 0;
+
+    u08 *ptr = start;
+    while (ptr < end)
+    {
+        u08 *chunkEnd = end;
+        if (slot->nJobs < (engine->maxJobs - 1) && (u64)(end - ptr) > target)
+        {
+            u08 *newLine = (u08 *)memchr(ptr + target, '\n', (u64)(end - ptr) - target);
+            if (newLine) chunkEnd = newLine + 1;
+        }
+
+        u32 jobIndex = slot->nJobs++;
+        u64 offset = (u64)(ptr - start);
+        tag_job *job = slot->jobs + jobIndex;
+        job->input = ptr;
+        job->inputSize = (u64)(chunkEnd - ptr);
+        job->writePool = 0;
+        job->engine = engine;
+        job->output = slot->outputs + jobIndex;
+        job->output->buffer = slot->output + TagJobOutputSize(offset) + (256 * jobIndex) - 256;
+        job->output->size = 0;
+        job->output->spans = 0;
+        job->missing = slot->missing + TagJobMissingCount(offset) + jobIndex - 1;
+        job->revComp = revComp;
+        job->outputRXQX = outputRXQX;
+        job->referenceInput = 0;
+
+        if (engine->pool) ThreadPoolAddTask(engine->pool, RunTagJob, job);
+        ptr = chunkEnd;
+    }
+
+    if (engine->stealPool)
+    {
+        TaskGroupInit(&engine->group);
+        WorkStealingParallelFor(engine->stealPool, &engine->group, slot->nJobs, 1, RunTagJobs, slot);
+        TaskGroupClose(engine->stealPool, &engine->group);
+    }
+
+    BeginWait(&engine->stats);
+    if (engine->stealPool) WorkStealingWait(engine->stealPool, &engine->group);
+    else ThreadPoolWait(engine->pool);
+    ThreadFence;
+    EndWait(&engine->stats);
+
+    CountBuffer(&engine->stats, size);
+    ForLoop(slot->nJobs) engine->stats.records += slot->jobs[index].nRecords;
+    return(slot);
+}
+
+global_function
+u32
+FormatPGLine(string_hash_table *ids, memory_arena *arena, u08 *lastID, s32 argCount, const char **argBuffer, u08 *pgLine, u32 size)
+{
+    u08 idBuff[64];
+    stbsp_snprintf((char *)idBuff, sizeof(idBuff), "%s", ProgramName);
+    u32 c = 0;
+    while (IsStringInHashTable(ids, arena, idBuff)) stbsp_snprintf((char *)idBuff, sizeof(idBuff), "%s.%u", ProgramName, ++c);
+
+    u32 n = lastID ?    (u32)stbsp_snprintf((char *)pgLine, (s32)size, "@PG\tID:%s\tPN:%s\tPP:%s\tVN:%s\tCL:", idBuff, ProgramName, (char *)lastID, ProgramVersion) :
+                        (u32)stbsp_snprintf((char *)pgLine, (s32)size, "@PG\tID:%s\tPN:%s\tVN:%s\tCL:", idBuff, ProgramName, ProgramVersion);
+
+    ForLoop((u32)argCount) n += (u32)stbsp_snprintf((char *)pgLine + n, (s32)(size - n), "%s ", argBuffer[index]);
+    pgLine[n - 1] = '\n';
+
+    return(n);
+}
+
+struct
+carry_buffer
+{
+    u08 *data;
+    u64 size;
+    u64 capacity;
+};
+
+global_function
+carry_buffer *
+CreateCarryBuffer(memory_arena *arena)
+{
+    carry_buffer *carry = PushStructP(arena, carry_buffer);
+    carry->capacity = MegaByte(1);
+    carry->data = PushArrayP(arena, u08, carry->capacity);
+    carry->size = 0;
+
+    return(carry);
+}
+
+global_function
+void
+AppendToCarryBuffer(memory_arena *arena, carry_buffer *carry, u08 *data, u64 size)
+{
+    if ((carry->size + size) > carry->capacity)
+    {
+        carry->capacity = 2 * (carry->size + size);
+        u08 *newData = PushArrayP(arena, u08, carry->capacity);
+        memcpy(newData, carry->data, carry->size);
+        carry->data = newData;
+    }
+    memcpy(carry->data + carry->size, data, size);
+    carry->size += size;
+}
+
+// BAM
+// After the header, a BAM stream is a series of [u32 block_size][record] entries. A record has a 32 byte fixed part, then the read name, cigar, sequence, qualities and aux fields.
+#define Bam_Record_Fixed_Size 32
+
+// Returns the size of the BAM header at the start of data, or 0 if it is not all there yet
+global_function
+u64
+BamHeaderSize(u08 *data, u64 size)
+{
+    if (size < 8) return(0);
+    u64 ptr = 8 + (u64)ReadLE32(data + 4);
+
+    if (size < (ptr + 4)) return(0);
+    u32 nRef = ReadLE32(data + ptr);
+    ptr += 4;
+
+    ForLoop(nRef)
+    {
+        if (size < (ptr + 4)) return(0);
+        ptr += 4 + (u64)ReadLE32(data + ptr);
+        if (size < (ptr + 4)) return(0);
+        ptr += 4;
+    }
+
+    return(ptr);
+}
+
+global_function
+u08 *
+FindLastBamRecord(u08 *start, u08 *end, u08 *error)
+{
+    u08 *ptr = start;
+    while ((end - ptr) >= 4)
+    {
+        u32 recordSize = ReadLE32(ptr);
+        if (recordSize < Bam_Record_Fixed_Size)
+        {
+            *error = 1;
+            break;
+        }
+        if ((u64)(end - ptr - 4) < recordSize) break;
+        ptr += 4 + recordSize;
+    }
+
+    return(ptr);
+}
+
+// Walks the aux fields of a record for BC:Z and QT:Z values long enough to hold a haplotag barcode
+global_function
+void
+FindBamBarcodeTags(u08 *record, u32 recordSize, u08 **BC, u08 **QT)
+{
+    *BC = 0;
+    *QT = 0;
+
+    u64 seqLength = ReadLE32(record + 16);
+    u64 offset = Bam_Record_Fixed_Size + record[8] + (4 * (u64)ReadLE16(record + 12)) + ((seqLength + 1) >> 1) + seqLength;
+    if (offset > recordSize) return;
+
+    u08 *aux = record + offset;
+    u08 *end = record + recordSize;
+    while ((end - aux) >= 3)
+    {
+        u08 type = aux[2];
+        u08 *value = aux + 3;
+        u64 available = (u64)(end - value);
+        u64 size;
+
+        switch (type)
+        {
+            case 'A':
+            case 'c':
+            case 'C':
+                size = 1;
+                break;
+
+            case 's':
+            case 'S':
+                size = 2;
+                break;
+
+            case 'i':
+            case 'I':
+            case 'f':
+                size = 4;
+                break;
+
+            case 'Z':
+            case 'H':
+                {
+                    u08 *nul = (u08 *)memchr(value, 0, available);
+                    if (!nul) return;
+                    size = (u64)(nul - value) + 1;
+
+                    if (type == 'Z' && size > 27)
+                    {
+                        if (!*BC && aux[0] == 'B' && aux[1] == 'C') *BC = value;
+                        if (!*QT && aux[0] == 'Q' && aux[1] == 'T') *QT = value;
+                    }
+                }
+                break;
+
+            case 'B':
+                {
+                    if (available < 5) return;
+                    u64 elementSize;
+                    switch (value[0])
+                    {
+                        case 'c':
+                        case 'C':
+                            elementSize = 1;
+                            break;
+
+                        case 's':
+                        case 'S':
+                            elementSize = 2;
+                            break;
+
+                        case 'i':
+                        case 'I':
+                        case 'f':
+                            elementSize = 4;
+                            break;
+
+                        default:
+                            return;
+                    }
+                    size = 5 + (elementSize * ReadLE32(value + 1));
+                }
+                break;
 
-    barcode_hash_table *table = PushStructP(arena, barcode_hash_table);
-    table->size = size;
-    table->table = PushArrayP(arena, barcode_hash_table_node *, size);
-    memset(table->table, 0, size * sizeof(barcode_hash_table_node *));
+            default:
+                return;
+        }
 
-    return(table);
+        if (size > available) return;
+        aux = value + size;
+    }
 }
 
+// BAM version of TagRecords; output is always copied
 global_function
-barcode *
-GetBarCodeFromHashTable(barcode_hash_table *table, memory_arena *arena, u32 code)
+void
+TagBamRecords(tag_job *job)
 {
-#define BarCodeHashTableSeed 0xf30b503a1896576e
-    u32 hash = FastHash32(&code, sizeof(code), BarCodeHashTableSeed) % table->size;
-    barcode_hash_table_node *node = table->table[hash];
-    barcode_hash_table_node *prevNode = 0;
-    barcode *result = 0;
+    u08 *ptr = job->input;
+    u08 *end = job->input + job->inputSize;
+    job->nMissing = 0;
+    job->nRecords = 0;
 
-    while (node)
+    while (ptr < end)
     {
-        prevNode = node;
-        if (code == node->barcode->barcode)
+        u32 recordSize = ReadLE32(ptr);
+        u08 *record = ptr + 4;
+
+        u08 *BC = 0;
+        u08 *QT = 0;
+        u32 flags = ReadLE16(record + 14);
+        u08 read1 = (flags & 64) != 0;
+        u08 *name = record + Bam_Record_Fixed_Size;
+        u32 nameLength = record[8] ? (record[8] - 1) : 0;
+        if (read1) FindBamBarcodeTags(record, recordSize, &BC, &QT);
+
+        mate_cache_entry *mate = (!read1 && job->mates && (flags & 128)) ? FindMate(job->mates, name, nameLength) : 0;
+        if (mate)
         {
-            result = node->barcode;
-            break;
+            BC = mate->BC;
+            QT = mate->QT;
         }
-        node = node->next;
+
+        if (BC && QT)
+        {
+            u08 newRecordSize[4];
+            WriteLE32(newRecordSize, recordSize + BamHaplotagTagsSize(job->outputRXQX));
+            job->output = CopyToWriteBuffer(job->writePool, job->output, newRecordSize, sizeof(newRecordSize));
+            job->output = CopyToWriteBuffer(job->writePool, job->output, record, recordSize);
+            job->output = WriteHaplotagTags(BC, QT, job->revComp, job->outputRXQX, 1, job->writePool, job->output, mate ? 0 : job->counts);
+            if (job->mates && !mate) AddMate(job->mates, name, nameLength, BC, QT);
+        }
+        else
+        {
+            if (read1)
+            {
+                missing_tags *missing = job->missing + job->nMissing++;
+                missing->record = job->nRecords;
+                missing->nameOffset = (u32)(name - job->input);
+                missing->nameLength = (u08)Min(nameLength, 63);
+                missing->haveBC = BC != 0;
+                missing->haveQT = QT != 0;
+            }
+            job->output = CopyToWriteBuffer(job->writePool, job->output, ptr, 4 + (u64)recordSize);
+        }
+
+        ptr = record + recordSize;
+        ++job->nRecords;
     }
+}
 
-    if (!result)
+// Copies the BAM header with a @PG line for this program added to its text
+global_function
+buffer *
+WriteBamHeader(memory_arena *arena, u08 *header, u64 headerSize, s32 argCount, const char **argBuffer, buffer_pool *writePool, buffer *writeBuffer)
+{
+    u32 textLength = ReadLE32(header + 4);
+    u08 *text = header + 8;
+    u32 usedLength = (u32)strnlen((const char *)text, textLength);
+
+    string_hash_table *ids = CreateStringHashTable(arena);
+    u08 *lastID = 0;
+    for (   u08 *line = text;
+            line < (text + usedLength);
+            )
     {
-        barcode_hash_table_node *newNode = PushStructP(arena, barcode_hash_table_node);
-        newNode->barcode = PushStructP(arena, barcode);
-        newNode->next = 0;
-        newNode->barcode->barcode = code;
-        newNode->barcode->correct = 0;
-        newNode->barcode->corrected = 0;
-        newNode->barcode->unclear = 0;
-        (prevNode ? prevNode->next : table->table[hash]) = newNode;
+        u08 *lineEnd = (u08 *)memchr(line, '\n', (u64)(text + usedLength - line));
+        if (!lineEnd) lineEnd = text + usedLength;
+
+        if ((lineEnd - line) > 7 && !memcmp(line, "@PG\tID:", 7))
+        {
+            u08 *id = line + 7;
+            u32 idLength = 0;
+            while ((id + idLength) < lineEnd && id[idLength] > 32 && idLength < 63) ++idLength;
+
+            u08 *str = PushArrayP(arena, u08, idLength + 1);
+            memcpy(str, id, idLength);
+            str[idLength] = 0;
+            AddStringToHashTable(ids, arena, str);
+            lastID = str;
+        }
 
-        result = newNode->barcode;
+        line = lineEnd + 1;
     }
 
-    return(result);
+    u08 pgLine[513];
+    u32 n = 0;
+    if (usedLength && text[usedLength - 1] != '\n') pgLine[n++] = '\n';
+    n += FormatPGLine(ids, arena, lastID, argCount, argBuffer, pgLine + n, sizeof(pgLine) - n);
+
+    u08 newTextLength[4];
+    WriteLE32(newTextLength, usedLength + n);
+
+    writeBuffer = CopyToWriteBuffer(writePool, writeBuffer, header, 4);
+    writeBuffer = CopyToWriteBuffer(writePool, writeBuffer, newTextLength, sizeof(newTextLength));
+    writeBuffer = CopyToWriteBuffer(writePool, writeBuffer, text, usedLength);
+    writeBuffer = CopyToWriteBuffer(writePool, writeBuffer, pgLine, n);
+    writeBuffer = CopyToWriteBuffer(writePool, writeBuffer, text + textLength, headerSize - 8 - textLength);
+
+    return(writeBuffer);
 }
 
-struct
-transfer_buffer_pool
+enum
+bam_status
 {
-    buffer_pool bufferPool;
-    barcode_hash_table *table;
-    wavl_tree *tree;
-    memory_arena *arena;
+    bamOK,
+    bamInputError,
+    bamWriteError,
+    bamLogError
 };
 
+// Tags a BAM stream. The read and write pools carry uncompressed BAM; BGZF is handled by the pools' codecs.
 global_function
-transfer_buffer_pool *
-CreateTransferPool(memory_arena *arena, barcode_hash_table *table, wavl_tree *tree)
+bam_status
+TagBamStream(memory_arena *arena, buffer_pool *readPool, buffer_pool *writePool, barcode_hash_table *counts, read_counter *counter, missing_tags_log *missingTagsLog, mate_cache *mates, u08 revComp, u08 outputRXQX, s32 argCount, const char **argBuffer)
 {
-    transfer_buffer_pool *pool = PushStructP(arena, transfer_buffer_pool);
-    pool->bufferPool.pool = ThreadPoolInit(arena, 1);
-    pool->table = table;
-    pool->tree = tree;
-    pool->arena = arena;
+    // the header, and records that straddle two read buffers, are put back together here
+    carry_buffer *carry = CreateCarryBuffer(arena);
+    u08 headerDone = 0;
+    u08 error = 0;
+
+    tag_job job = {};
+    job.writePool = writePool;
+    job.counts = counts;
+    job.missing = PushArrayP(arena, missing_tags, TagJobMissingCount(BufferSize));
+    job.mates = mates;
+    job.revComp = revComp;
+    job.outputRXQX = outputRXQX;
+
+    buffer *readBuffer = GetNextBuffer_Read(readPool);
+    job.output = GetNextBuffer_Write(writePool);
+    do
+    {
+        readBuffer = GetNextBuffer_Read(readPool);
+        CountBuffer(counter->parse, readBuffer->size);
+        u64 parseStart = TraceStart();
+        if (Global_Write_Error) return(bamWriteError);
+
+        u08 *ptr = readBuffer->buffer;
+        u08 *end = readBuffer->buffer + readBuffer->size;
+
+        if (!headerDone)
+        {
+            AppendToCarryBuffer(arena, carry, ptr, readBuffer->size);
+            ptr = end;
+
+            if (carry->size >= 4 && memcmp(carry->data, "BAM\1", 4)) return(bamInputError);
+
+            u64 headerSize = BamHeaderSize(carry->data, carry->size);
+            if (headerSize)
+            {
+                headerDone = 1;
+                job.output = WriteBamHeader(arena, carry->data, headerSize, argCount, argBuffer, writePool, job.output);
+
+                u08 *records = carry->data + headerSize;
+                u08 *recordsEnd = FindLastBamRecord(records, carry->data + carry->size, &error);
+                if (error) return(bamInputError);
+
+                job.input = records;
+                job.inputSize = (u64)(recordsEnd - records);
+                TagBamRecords(&job);
+                if (ReportTagJob(&job, counter, missingTagsLog)) return(bamLogError);
+
+                carry->size = (u64)(carry->data + carry->size - recordsEnd);
+                memmove(carry->data, recordsEnd, carry->size);
+            }
+        }
+
+        while (carry->size && ptr < end)
+        {
+            u64 recordSize = 4 + (carry->size >= 4 ? (u64)ReadLE32(carry->data) : 0);
+            u64 size = Min(recordSize - carry->size, (u64)(end - ptr));
+            AppendToCarryBuffer(arena, carry, ptr, size);
+            ptr += size;
+
+            if (carry->size >= 4)
+            {
+                recordSize = 4 + (u64)ReadLE32(carry->data);
+                if (recordSize < (4 + Bam_Record_Fixed_Size)) return(bamInputError);
+                if (carry->size == recordSize)
+                {
+                    job.input = carry->data;
+                    job.inputSize = carry->size;
+                    TagBamRecords(&job);
+                    carry->size = 0;
+                    if (ReportTagJob(&job, counter, missingTagsLog)) return(bamLogError);
+                }
+            }
+        }
+
+        if (ptr < end)
+        {
+            u08 *recordsEnd = FindLastBamRecord(ptr, end, &error);
+            if (error) return(bamInputError);
+
+            job.input = ptr;
+            job.inputSize = (u64)(recordsEnd - ptr);
+            TagBamRecords(&job);
+            if (ReportTagJob(&job, counter, missingTagsLog)) return(bamLogError);
+
+            AppendToCarryBuffer(arena, carry, recordsEnd, (u64)(end - recordsEnd));
+        }
+        TraceEvent("parse", 0, "main", parseStart, readBuffer->size);
+    } while (readBuffer->size);
 
-    pool->bufferPool.bufferPtr = 0;
-    pool->bufferPool.buffers[0] = PushStructP(arena, buffer);
-    pool->bufferPool.buffers[0]->buffer = PushArrayP(arena, u08, BufferSize);
-    pool->bufferPool.buffers[0]->size = 0;
-    pool->bufferPool.buffers[1] = PushStructP(arena, buffer);
-    pool->bufferPool.buffers[1]->buffer = PushArrayP(arena, u08, BufferSize);
-    pool->bufferPool.buffers[1]->size = 0;
+    if (((bgzf_codec *)readPool->codec)->error || !headerDone || carry->size) return(bamInputError);
 
-    return(pool);
+    return(bamOK);
 }
 
+// Decodes BC/BD pairs held 32 bytes apart, BC in the first 16 and BD in the second
 global_function
 void
-ProcessBuffer(void *in)
+DecodeBarCodeKernel(kernel_benchmark *bench, u64 n, void (*decode)(u08 *, u08 *, u08 *))
 {
-    transfer_buffer_pool *pool = (transfer_buffer_pool *)in;
-    buffer *buffer = pool->bufferPool.buffers[pool->bufferPool.bufferPtr];
-    ForLoop64(buffer->size / 4)
+    u32 sum = 0;
+    ForLoop64(n)
     {
-        u08 a = buffer->buffer[4 * index];
-        u08 b = buffer->buffer[(4 * index) + 1];
-        u08 c = buffer->buffer[(4 * index) + 2];
-        u08 d = buffer->buffer[(4 * index) + 3];
+        u08 groups[4];
+        decode(bench->bytes + (32 * index), bench->bytes + (32 * index) + 16, groups);
+        sum += (u32)groups[0] + (u32)groups[1] + (u32)groups[2] + (u32)groups[3];
+    }
+    Benchmark_Sink = Benchmark_Sink + sum;
+}
 
-        u32 barcodePack = (((u32)(a & 127)) << 24) | (((u32)(c & 127)) << 16) | (((u32)(b & 127)) << 8) | ((u32)(d & 127));
-        barcode *barcode = GetBarCodeFromHashTable(pool->table, pool->arena, barcodePack);
-        WavlTreeInsertValue(pool->arena, pool->tree, barcodePack + 1, 0);
+global_function
+void
+DecodeBarCodeScalarKernel(void *in, u64 n)
+{
+    DecodeBarCodeKernel((kernel_benchmark *)in, n, DecodeBarCode_Scalar);
+}
 
-        ++((a && b && c && d) ? (((a | b | c | d) & 128) ? barcode->corrected : barcode->correct) : barcode->unclear);
-    }
+#if defined(__x86_64__) || defined(__i386__)
+global_function
+void
+DecodeBarCodeSSSE3Kernel(void *in, u64 n)
+{
+    DecodeBarCodeKernel((kernel_benchmark *)in, n, DecodeBarCode_SSSE3);
 }
+#endif
 
 global_function
-buffer *
-GetNextTransferBuffer(transfer_buffer_pool *pool)
+void
+GetBarCodeFromHashTableKernel(void *in, u64 n)
 {
-    FenceIn(ThreadPoolWait(pool->bufferPool.pool));
-    buffer *buffer = pool->bufferPool.buffers[pool->bufferPool.bufferPtr];
-    pool->bufferPool.bufferPtr = (pool->bufferPool.bufferPtr + 1) & 1;
-    ThreadPoolAddTask(pool->bufferPool.pool, ProcessBuffer, pool);
-    buffer->size = 0;
-    return(buffer);
+    kernel_benchmark *bench = (kernel_benchmark *)in;
+    barcode_hash_table *table = (barcode_hash_table *)bench->table;
+    ForLoop64(n) ++GetBarCodeFromHashTable(table, bench->barcodes[index])->correct;
+    Benchmark_Sink = Benchmark_Sink + table->count;
+}
+
+global_function
+void
+RunKernelBenchmarks()
+{
+    memory_arena arena;
+    CreateMemoryArena(arena, MegaByte(256));
+
+    // barcodes are random bases with 1 in 64 an N, so most groups miss the table as they do in real data
+    kernel_benchmark *decode = CreateKernelBenchmark(&arena, Kernel_Benchmark_Items, 1, 32);
+    u64 state = 0xbc;
+    ForLoop(32 * Kernel_Benchmark_Items)
+    {
+        u64 random = NextRandom(&state);
+        decode->bytes[index] = (u08)((random & 63) ? "ATGC"[(random >> 8) & 3] : 'N');
+    }
+    RunKernelBenchmark("DecodeBarCode_Scalar", DecodeBarCodeScalarKernel, decode, 26);
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("ssse3")) RunKernelBenchmark("DecodeBarCode_SSSE3", DecodeBarCodeSSSE3Kernel, decode, 26);
+#endif
+
+    kernel_benchmark *count = CreateKernelBenchmark(&arena, Kernel_Benchmark_Items, 1, 0);
+    count->table = CreateBarCodeHashTable(&arena);
+    RunKernelBenchmark("GetBarCodeFromHashTable", GetBarCodeFromHashTableKernel, count, sizeof(u32));
+
+    kernel_benchmark *format = CreateKernelBenchmark(&arena, Kernel_Benchmark_Items, 1, 12);
+    RunKernelBenchmark("FormatBarCode", FormatBarCodeKernel, format, 12);
+
+    FreeMemoryArena(arena);
 }
 
 MainArgs
@@ -254,11 +1710,21 @@ MainArgs
     char *missingTagsLogName = (char *)"SamHaplotag_Missing_BC_QT_tags";
     char *clearBCLogName = (char *)"SamHaplotag_Clear_BC";
     char *unclearBCLogName = (char *)"SamHaplotag_UnClear_BC";
+    char *statsName = (char *)"SamHaplotag_BC_Stats";
 
     u08 revComp = 0;
     u08 outputRXQX = 0;
     u08 showHelp = 0;
+    u08 zeroCopy = 0;
+    u08 tagMates = 0;
+    u08 benchmark = 0;
+    u08 workStealing = 1;
+    pipeline_options pipeline = {};
+    u32 nThreads = 1;
+    u32 correctionRadius = 1;
     const char *prefix = 0;
+    const char *whitelist = 0;
+    const char *inputName = 0;
 
     ForLoop(ArgCount - 1)
     {
@@ -270,6 +1736,18 @@ MainArgs
                 if (*ptr == 'r') revComp = 1;
                 else if (*ptr == 'x') outputRXQX = 1;
                 else if (*ptr == 'h') showHelp = 1;
+                else if (*ptr == 'z') zeroCopy = 1;
+                else if (*ptr == 'm') tagMates = 1;
+                else if (*ptr == 't')
+                {
+                    if (!(*(ptr + 1)) && index < (ArgCount - 2) && StringToInt_Check((char *)ArgBuffer[index + 2], &nThreads) && nThreads) ++index;
+                    else
+                    {
+                        PrintError("Error, threads option requires a positive integer argument");
+                        exitCode = EXIT_FAILURE;
+                        goto End;
+                    }
+                }
                 else if (*ptr == 'p')
                 {
                     if (!(*(ptr + 1)) && index < (ArgCount - 2)) prefix = ArgBuffer[index++ + 2];
@@ -280,12 +1758,59 @@ MainArgs
                         goto End;
                     }
                 }
+                else if (*ptr == 'w')
+                {
+                    if (!(*(ptr + 1)) && index < (ArgCount - 2)) whitelist = ArgBuffer[index++ + 2];
+                    else
+                    {
+                        PrintError("Error, whitelist option requires an argument");
+                        exitCode = EXIT_FAILURE;
+                        goto End;
+                    }
+                }
+                else if (*ptr == 'i')
+                {
+                    if (!(*(ptr + 1)) && index < (ArgCount - 2)) inputName = ArgBuffer[index++ + 2];
+                    else
+                    {
+                        PrintError("Error, input option requires an argument");
+                        exitCode = EXIT_FAILURE;
+                        goto End;
+                    }
+                }
                 ++ptr;
             }
         }
         else if (!strcmp(ArgBuffer[index + 1], "--revcomp")) revComp = 1;
         else if (!strcmp(ArgBuffer[index + 1], "--rxqx")) outputRXQX = 1;
         else if (!strcmp(ArgBuffer[index + 1], "--help")) showHelp = 1;
+        else if (!strcmp(ArgBuffer[index + 1], "--zero-copy")) zeroCopy = 1;
+        else if (!strcmp(ArgBuffer[index + 1], "--tag-mates")) tagMates = 1;
+        else if (!strcmp(ArgBuffer[index + 1], "--benchmark")) benchmark = 1;
+        else if (!strcmp(ArgBuffer[index + 1], "--threads"))
+        {
+            if (index < (ArgCount - 2) && StringToInt_Check((char *)ArgBuffer[index + 2], &nThreads) && nThreads) ++index;
+            else
+            {
+                PrintError("Error, threads option requires a positive integer argument");
+                exitCode = EXIT_FAILURE;
+                goto End;
+            }
+        }
+        else if (!strcmp(ArgBuffer[index + 1], "--scheduler"))
+        {
+            if (index < (ArgCount - 2) && (!strcmp(ArgBuffer[index + 2], "steal") || !strcmp(ArgBuffer[index + 2], "fifo")))
+            {
+                workStealing = ArgBuffer[index + 2][0] == 's';
+                ++index;
+            }
+            else
+            {
+                PrintError("Error, scheduler option requires 'steal' or 'fifo'");
+                exitCode = EXIT_FAILURE;
+                goto End;
+            }
+        }
         else if (!strcmp(ArgBuffer[index + 1], "--prefix"))
         {
             if (index < (ArgCount - 2)) prefix = ArgBuffer[index++ + 2];
@@ -296,33 +1821,94 @@ MainArgs
                 goto End;
             }
         }
+        else if (!strcmp(ArgBuffer[index + 1], "--whitelist"))
+        {
+            if (index < (ArgCount - 2)) whitelist = ArgBuffer[index++ + 2];
+            else
+            {
+                PrintError("Error, whitelist option requires an argument");
+                exitCode = EXIT_FAILURE;
+                goto End;
+            }
+        }
+        else if (!strcmp(ArgBuffer[index + 1], "--input"))
+        {
+            if (index < (ArgCount - 2)) inputName = ArgBuffer[index++ + 2];
+            else
+            {
+                PrintError("Error, input option requires an argument");
+                exitCode = EXIT_FAILURE;
+                goto End;
+            }
+        }
+        else if (IsPipelineOption(ArgBuffer[index + 1]))
+        {
+            if (!ParsePipelineOption(&pipeline, ArgCount, ArgBuffer, &index))
+            {
+                exitCode = EXIT_FAILURE;
+                goto End;
+            }
+        }
+        else if (!strcmp(ArgBuffer[index + 1], "--correction-radius"))
+        {
+            if (index < (ArgCount - 2) && StringToInt_Check((char *)ArgBuffer[index + 2], &correctionRadius) && correctionRadius <= 6) ++index;
+            else
+            {
+                PrintError("Error, correction-radius option requires an integer argument from 0 to 6");
+                exitCode = EXIT_FAILURE;
+                goto End;
+            }
+        }
     }
 
     if (showHelp) 
     {
-        fprintf(stderr, ProgramName " " ProgramVersion "\nUsage: <sam format> | " ProgramName " | <sam format>\n\n");
+        fprintf(stderr, ProgramName " " ProgramVersion "\nUsage: <sam/bam format> | " ProgramName " | <sam/bam format>\n\n");
         
-        fprintf(stderr, "Reads/writes SAM formatted reads from <stdin>/<stdout>.\n");
+        fprintf(stderr, "Reads/writes SAM formatted reads from <stdin>/<stdout>. BAM input is detected automatically and is written back out as BAM.\n");
+        fprintf(stderr, "Input that is a regular file (redirected <stdin> or '-i FILE') is memory-mapped and parsed in place.\n");
         fprintf(stderr, "Any reads flagged as <read1> with both BC and QT tags will have additional haplotag BX tag added.\n\n");
         
         fprintf(stderr, "BC tags must be of the form /^[ATGCN]{13}\\-[ATGCN]{13}$/ and QT tags of the form /^[!-~]{13}\\w[!-~]{13}$/.\n");
         fprintf(stderr, "e.g. '... BC:Z:NGGTACATGAGAC-NTATCGGCCTTCA\tQT:Z:!FFFFFFFFFFFF !,,,F,FFF:F:F ...'\n\n");
         
-        fprintf(stderr, "Three log files: '%s', '%s' and '%s' are created with an optional '<prefix>_' at the start of each file-name if supplied as an option.\n\n", clearBCLogName, unclearBCLogName, missingTagsLogName);
+        fprintf(stderr, "Three log files: '%s', '%s' and '%s' are created with an optional '<prefix>_' at the start of each file-name if supplied as an option.\n", clearBCLogName, unclearBCLogName, missingTagsLogName);
+        fprintf(stderr, "The barcode counts are also written in binary to '%s', which can be given to 10xSpoof and 16BaseBCGen in place of '%s'.\n\n", statsName, clearBCLogName);
         
         fprintf(stderr, "Options:\n");
         fprintf(stderr, "   -r/--revcomp:       Reverse-complement second barcode (BD) group\n");
         fprintf(stderr, "   -x/--rxqx:          Output additional raw barcode/quality RX/QX tags\n");
         fprintf(stderr, "   -p/--prefix PREFIX: Add prefix to log files\n");
+        fprintf(stderr, "   -i/--input FILE:    Read from FILE instead of <stdin>\n");
+        fprintf(stderr, "   -t/--threads N:     Tag records (SAM) or compress/decompress (BAM) on N threads (default 1); output is identical to a single-threaded run\n");
+        fprintf(stderr, "   --scheduler steal|fifo: Share tagging between threads with a work-stealing pool (default) or a FIFO thread pool\n");
+        fprintf(stderr, "   -z/--zero-copy:     Write unmodified input straight from the read buffers (writev); SAM only\n");
+        fprintf(stderr, "   -m/--tag-mates:     Also give read2 records the tags of their read1, which must come first and close by (e.g. collated or interleaved input); tags on one thread\n");
+        fprintf(stderr, "   -w/--whitelist FILE: Use the barcodes in FILE ('<A-D><1-96> <6 bases>' per line) instead of the built-in set; generated tables are cached in FILE.bctable\n");
+        fprintf(stderr, "   --correction-radius N: Correct whitelist barcodes with up to N mismatches (default 1)\n");
+        fprintf(stderr, "   --io-buffers N:     Input/output buffers per stream (default %u); more buffers ride out longer stalls up- or downstream\n", Default_IO_Buffers);
+        fprintf(stderr, "   --io-buffer-size MB: Size of each input/output buffer (default %u)\n", Default_IO_Buffer_Size_MB);
+        fprintf(stderr, "   --cpus LIST:        Pin the main thread, then the I/O, tagging and BGZF threads as they are created, to the CPUs in LIST (e.g. 0-7,16-23) in order\n");
+        fprintf(stderr, "   --pin:              As --cpus, with every CPU the process may run on, those on the main thread's NUMA node first\n");
+        fprintf(stderr, "   --trace FILE:       Write a Chrome trace JSON timeline of the I/O tasks, parse blocks, tagging jobs and waits to FILE at exit (chrome://tracing, ui.perfetto.dev)\n");
+        fprintf(stderr, "   --benchmark:        Time the barcode kernels on generated data, printing one JSON object per kernel to <stdout>, and exit\n");
         fprintf(stderr, "   -h/--help:          Show help\n\n");
 
+        fprintf(stderr, "A report of each pipeline stage (input, parse, tag, output, log: busy and waited time, buffers, bytes and records), and of memory arena use (in use, peak and committed bytes), is printed at exit, and whenever the process receives SIGUSR1 (e.g. 'pkill -USR1 " ProgramName "').\n\n");
+
         fprintf(stderr, "Usage example:\n");
         fprintf(stderr, "samtools view -h@ 16 -F 0xF00 reads_123.cram | " ProgramName " -p 123 | samtools view -@ 16 -o tagged_reads_123.cram\n");
         
         goto End;
     }
+
+    if (benchmark)
+    {
+        RunKernelBenchmarks();
+        goto End;
+    }
     
-    char logNameBuffer[256];
+    char logNameBuffer[512];
     if (prefix)
     {
         s32 ptr1 = 1 + stbsp_snprintf((char *)logNameBuffer, (s32)sizeof(logNameBuffer), "%s_%s", prefix, missingTagsLogName);
@@ -331,84 +1917,165 @@ MainArgs
         s32 ptr2 = 1 + stbsp_snprintf((char *)logNameBuffer + ptr1, (s32)sizeof(logNameBuffer) - ptr1, "%s_%s", prefix, clearBCLogName);
         clearBCLogName = (char *)logNameBuffer + ptr1;
 
-        stbsp_snprintf((char *)logNameBuffer + ptr1 + ptr2, (s32)sizeof(logNameBuffer) - ptr1 - ptr2, "%s_%s", prefix, unclearBCLogName);
+        s32 ptr3 = 1 + stbsp_snprintf((char *)logNameBuffer + ptr1 + ptr2, (s32)sizeof(logNameBuffer) - ptr1 - ptr2, "%s_%s", prefix, unclearBCLogName);
         unclearBCLogName = (char *)logNameBuffer + ptr1 + ptr2;
+
+        stbsp_snprintf((char *)logNameBuffer + ptr1 + ptr2 + ptr3, (s32)sizeof(logNameBuffer) - ptr1 - ptr2 - ptr3, "%s_%s", prefix, statsName);
+        statsName = (char *)logNameBuffer + ptr1 + ptr2 + ptr3;
     }
 
     PrintStatus("Starting...");
+    if (!StartPipeline(&pipeline))
+    {
+        exitCode = EXIT_FAILURE;
+        goto End;
+    }
     PrintStatus("Run options:");
     PrintStatus("\tReverse-complement BD group: %s", revComp ? "yes" : "no");
     PrintStatus("\tOutput RX/QX tags: %s", outputRXQX ? "yes" : "no");
     PrintStatus("\tLog prefix: %s", prefix ? prefix : "<NA>");
-
-    s32 missingTagsLog, clearBCLog, unclearBCLog;
-    if (    (missingTagsLog = open((const char *)missingTagsLogName, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR)) > 0 &&
-            (clearBCLog = open((const char *)clearBCLogName, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR)) > 0 &&
-            (unclearBCLog = open((const char *)unclearBCLogName, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR)) > 0
-       )
+    PrintStatus("\tZero-copy output: %s", zeroCopy ? "yes" : "no");
+    PrintStatus("\tTagging threads: %u", nThreads);
+    if (nThreads > 1) PrintStatus("\tTagging scheduler: %s", workStealing ? "work-stealing" : "FIFO");
+    PrintStatus("\tTag mates: %s", tagMates ? "yes" : "no");
+    PrintStatus("\tI/O buffers: %u x %" PRIu64 " MB", IO_Buffers, (u64)BufferSize >> 20);
+    PrintStatus("\tRecord scanner: %s", InitialiseRecordScanner());
+    PrintStatus("\tBarcode decoder: %s", InitialiseBarCodeDecoder());
+    PrintStatus("\tBarcode whitelist: %s", whitelist ? whitelist : "<built-in>");
+    if (whitelist)
     {
-        char *header = (char *)"Read\n";
-        if (WriteToLogFile(missingTagsLog, header, strlen(header)))
+        PrintStatus("\tCorrection radius: %u", correctionRadius);
+        if (!LoadBarCodeWhitelist(whitelist, correctionRadius))
         {
-            logError = 1;
+            exitCode = EXIT_FAILURE;
             goto End;
         }
+    }
 
+    s32 missingTagsLog, clearBCLog, unclearBCLog, statsFile;
+    if (    (missingTagsLog = open((const char *)missingTagsLogName, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR)) > 0 &&
+            (clearBCLog = open((const char *)clearBCLogName, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR)) > 0 &&
+            (unclearBCLog = open((const char *)unclearBCLogName, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR)) > 0 &&
+            (statsFile = open((const char *)statsName, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR)) > 0
+       )
+    {
         memory_arena workingSet;
         CreateMemoryArena(workingSet, MegaByte(512));
+        RegisterArena(&workingSet, "working");
 
-        barcode_hash_table *barcodeHashTable = CreateBarCodeHashTable(&workingSet);
-        wavl_tree *barcodeTree = InitialiseWavlTree(&workingSet);
+        missing_tags_log *missingTags = CreateMissingTagsLog(&workingSet, missingTagsLog);
 
-        transfer_buffer_pool *transferBufferPool = CreateTransferPool(&workingSet, barcodeHashTable, barcodeTree);
+        barcode_hash_table *barcodeHashTable = CreateBarCodeHashTable(&workingSet);
 
         buffer_pool *readPool = CreatePool(&workingSet);
 #ifdef DEBUG
         readPool->handle = open("test_in", O_RDONLY);
 #else
-        readPool->handle = STDIN_FILENO;
+        readPool->handle = inputName ? open(inputName, O_RDONLY) : STDIN_FILENO;
 #endif        
+        if (readPool->handle < 0)
+        {
+            PrintError("Error opening '%s'", inputName);
+            exitCode = EXIT_FAILURE;
+            goto End;
+        }
+        MapInputFile(readPool);
+
         buffer_pool *writePool = CreatePool(&workingSet);
         writePool->handle = STDOUT_FILENO;
 
-        char printNBuffers[2][16] = {{0}};
-        u08 printNBufferPtr = 0;
+        // BGZF compressed input is taken to be BAM, and BAM is written back out
+        u08 peek[BGZF_Header_Size];
+        u64 peekSize = 0;
+        if (readPool->map)
+        {
+            peekSize = Min(sizeof(peek), readPool->mapSize - readPool->mapOffset);
+            memcpy(peek, readPool->map + readPool->mapOffset, peekSize);
+        }
+        else for (  ssize_t bytesRead;
+                    peekSize < sizeof(peek) && (bytesRead = read(readPool->handle, peek + peekSize, sizeof(peek) - peekSize)) > 0;
+                    peekSize += (u64)bytesRead ) {}
+
+        u08 bamInput = IsBGZF(peek, peekSize);
+        if (bamInput)
+        {
+            EnableBGZFInput(&workingSet, readPool, nThreads, peek, peekSize);
+            EnableBGZFOutput(&workingSet, writePool, nThreads);
+        }
+        else if (!readPool->map)
+        {
+            readPool->preload = peek;
+            readPool->preloadSize = peekSize;
+        }
+        PrintStatus("Input format: %s", bamInput ? "BAM" : "SAM");
+
+        // mates can be split across the engine's jobs, so mate tagging is done in order on the main thread
+        mate_cache *mates = tagMates ? CreateMateCache(&workingSet) : 0;
+        tag_engine *tagEngine = (nThreads > 1 && !bamInput && !mates) ? CreateTagEngine(&workingSet, nThreads, writePool->nBuffers, workStealing) : 0;
+        if (!bamInput && (zeroCopy || tagEngine)) EnableZeroCopy(&workingSet, writePool, tagEngine ? 0 : readPool);
+        EnableIORing(&workingSet, readPool, 0);
+        EnableIORing(&workingSet, writePool, 1);
+        PrintStatus("Input: %s", readPool->map ? "memory-mapped" : (readPool->ring ? "io_uring" : "streamed"));
+        PrintStatus("Output: %s", writePool->ring ? "io_uring" : "streamed");
+
+        read_counter counter = {};
+        RegisterStage(&readPool->stats, "input");
+        counter.parse = CreateStage(&workingSet, "parse");
+        if (tagEngine) RegisterStage(&tagEngine->stats, "tag");
+        if (tagEngine) RegisterArenas(tagEngine->shardArenas, tagEngine->nShards, "shards");
+        RegisterStage(&writePool->stats, "output");
+        RegisterStage(&missingTags->pool->stats, "log");
+        BeginParse(counter.parse);
+
+        if (bamInput)
+        {
+            switch (TagBamStream(&workingSet, readPool, writePool, barcodeHashTable, &counter, missingTags, mates, revComp, outputRXQX, ArgCount, ArgBuffer))
+            {
+                case bamOK:
+                    break;
+
+                case bamInputError:
+                    PrintError("Error reading BAM input");
+                    exitCode = EXIT_FAILURE;
+                    goto End;
 
-        u08 headerMode = 1;
-        u08 atEnd = 1;
-        u64 total = 0;
+                case bamWriteError:
+                    PrintError("Error writing");
+                    exitCode = EXIT_FAILURE;
+                    goto End;
 
-        u08 nameBuffer[64];
-        u08 namePtr = 0;
+                case bamLogError:
+                    logError = 1;
+                    goto End;
+            }
+        }
+        else
+        {
+            u08 headerMode = 1;
+            u08 atEnd = 1;
 
-        u32 flags = 0;
+            u08 tagPtr = 0;
+            enum tagStat {null, readTag1, readTag2, readTag3, readTag4, readTag5, readingData, done};
 
-        u08 BCBuffer[27];
-        u08 QTBuffer[27];
-        u08 flagBuffer[5];
-        u08 tagPtr = 0;
-        enum tagStat {null, readTag1, readTag2, readTag3, readTag4, readTag5, readingData, done};
-        tagStat BC = null;
-        tagStat QT = null;
-        tagStat FL = null;
+            u08 IDLine[64];
+            tagStat PG = null;
+            tagStat ID = null;
+            string_hash_table *ids = CreateStringHashTable(&workingSet);
+            u08 *lastID = 0;
 
-        u08 IDLine[64];
-        tagStat PG = null;
-        tagStat ID = null;
-        string_hash_table *ids = CreateStringHashTable(&workingSet);
-        u08 *lastID = 0;
+            // records that straddle two read buffers are put back together here
+            carry_buffer *carry = CreateCarryBuffer(&workingSet);
 
-        buffer *readBuffer = GetNextBuffer_Read(readPool);
-        buffer *writeBuffer = GetNextBuffer_Write(writePool);
-        buffer *transferBuffer = GetNextTransferBuffer(transferBufferPool);
-        do
-        {
-            readBuffer = GetNextBuffer_Read(readPool);
+            missing_tags *missing = PushArray(workingSet, missing_tags, TagJobMissingCount(BufferSize));
 
-            for (   u64 bufferIndex = 0;
-                    bufferIndex < readBuffer->size;
-                    ++bufferIndex )
+            buffer *readBuffer = GetNextBuffer_Read(readPool);
+            buffer *writeBuffer = GetNextBuffer_Write(writePool);
+            do
             {
+                readBuffer = GetNextBuffer_Read(readPool);
+                CountBuffer(counter.parse, readBuffer->size);
+                u64 parseStart = TraceStart();
+
                 if (Global_Write_Error)
                 {
                     PrintError("Error writing");
@@ -416,35 +2083,29 @@ MainArgs
                     goto End;
                 }
 
-                u08 character = readBuffer->buffer[bufferIndex];
+                u08 *ptr = readBuffer->buffer;
+                u08 *end = readBuffer->buffer + readBuffer->size;
 
-                if (headerMode && atEnd) 
+                for (   ;
+                        headerMode && ptr < end;
+                        ++ptr )
                 {
-                    headerMode = character == '@';
-                    if (!headerMode)
+                    u08 character = *ptr;
+
+                    if (atEnd && character != '@') 
                     {
+                        headerMode = 0;
                         tagPtr = 0;
-                        
-                        u08 idBuff[64];
-                        stbsp_snprintf((char *)idBuff, sizeof(idBuff), "%s", ProgramName);
-                        u32 c = 0;
-                        while (IsStringInHashTable(ids, &workingSet, idBuff)) stbsp_snprintf((char *)idBuff, sizeof(idBuff), "%s.%u", ProgramName, ++c);
-                        
+
                         u08 pgLine[512];
-                        u32 n = lastID ?    (u32)stbsp_snprintf((char *)pgLine, sizeof(pgLine), "@PG\tID:%s\tPN:%s\tPP:%s\tVN:%s\tCL:", idBuff, ProgramName, (char *)lastID, ProgramVersion) :
-                                            (u32)stbsp_snprintf((char *)pgLine, sizeof(pgLine), "@PG\tID:%s\tPN:%s\tVN:%s\tCL:", idBuff, ProgramName, ProgramVersion);
-                        
-                        ForLoop(ArgCount) n += (u32)stbsp_snprintf((char *)pgLine + n, sizeof(pgLine) - n, "%s ", ArgBuffer[index]);
-                        pgLine[n - 1] = '\n';
+                        u32 n = FormatPGLine(ids, &workingSet, lastID, ArgCount, ArgBuffer, pgLine, sizeof(pgLine));
 
                         if ((BufferSize - writeBuffer->size - 1) < n) writeBuffer = GetNextBuffer_Write(writePool);
                         ForLoop(n) writeBuffer->buffer[writeBuffer->size++] = pgLine[index];
+                        break;
                     }
-                }
-                atEnd = character == '\n';
+                    atEnd = character == '\n';
 
-                if (headerMode)
-                {
                     if (character == '@') PG = readTag1;
                     else if (PG == readTag1) PG = character == 'P' ? readTag2 : null;
                     else if (PG == readTag2) PG = character == 'G' ? readTag3 : null;
@@ -475,180 +2136,119 @@ MainArgs
                             lastID = str;
                         }
                     }
+
+                    writeBuffer->buffer[writeBuffer->size++] = character;
+                    if (BufferSize == writeBuffer->size) writeBuffer = GetNextBuffer_Write(writePool);
                 }
-                else
+
+                if (!headerMode && ptr < end)
                 {
-                    if (namePtr < (sizeof(nameBuffer) - 1)) 
+                    u08 *recordsStart = ptr;
+                    if (carry->size)
                     {
-                        if (character == '\t')
-                        {
-                            nameBuffer[namePtr] = 0;
-                            namePtr = sizeof(nameBuffer);
-                        }
-                        else
-                        {
-                            nameBuffer[namePtr++] = character;
-                            if (namePtr == (sizeof(nameBuffer) - 1)) nameBuffer[namePtr] = 0;
-                        }
+                        u08 *newLine = (u08 *)memchr(ptr, '\n', (u64)(end - ptr));
+                        recordsStart = newLine ? (newLine + 1) : end;
                     }
+                    u08 *recordsEnd = FindLastNewLine(recordsStart, end);
 
-                    if (!atEnd)
+                    ForLoop(2)
                     {
-                        if (FL == null && character == '\t') FL = readingData;
-                        else if (FL == readingData)
-                        {
-                            if (character != '\t')
-                            {
-                                flagBuffer[tagPtr++] = character;
-                            }
-                            else
-                            {
-                                flags = StringToInt(flagBuffer + tagPtr, (u32)tagPtr);
-
-                                tagPtr = 0;
-                                FL = done;
-                            }
-                        }
+                        u08 *from = index ? recordsEnd : ptr;
+                        AppendToCarryBuffer(&workingSet, carry, from, (u64)((index ? end : recordsStart) - from));
 
-                        if (BC == null && character == '\t') BC = readTag1;
-                        else if (BC == readTag1) BC = character == 'B' ? readTag2 : null;
-                        else if (BC == readTag2) BC = character == 'C' ? readTag3 : null;
-                        else if (BC == readTag3) BC = character == ':' ? readTag4 : null;
-                        else if (BC == readTag4) BC = character == 'Z' ? readTag5 : null;
-                        else if (BC == readTag5) BC = character == ':' ? readingData : null;
-                        else if (BC == readingData)
+                        if (!index && carry->size && carry->data[carry->size - 1] == '\n')
                         {
-                            BCBuffer[tagPtr++] = character;
-                            if (tagPtr == sizeof(BCBuffer))
+                            tag_job job = {};
+                            job.input = carry->data;
+                            job.inputSize = carry->size;
+                            job.writePool = writePool;
+                            job.output = writeBuffer;
+                            job.counts = barcodeHashTable;
+                            job.missing = missing;
+                            job.mates = mates;
+                            job.revComp = revComp;
+                            job.outputRXQX = outputRXQX;
+                            job.referenceInput = 0;
+
+                            TagRecords(&job);
+                            writeBuffer = job.output;
+                            carry->size = 0;
+
+                            if (ReportTagJob(&job, &counter, missingTags))
                             {
-                                tagPtr = 0;
-                                BC = done;
+                                logError = 1;
+                                goto End;
                             }
                         }
 
-                        if (QT == null && character == '\t') QT = readTag1;
-                        else if (QT == readTag1) QT = character == 'Q' ? readTag2 : null;
-                        else if (QT == readTag2) QT = character == 'T' ? readTag3 : null;
-                        else if (QT == readTag3) QT = character == ':' ? readTag4 : null;
-                        else if (QT == readTag4) QT = character == 'Z' ? readTag5 : null;
-                        else if (QT == readTag5) QT = character == ':' ? readingData : null;
-                        else if (QT == readingData)
-                        {
-                            QTBuffer[tagPtr++] = character;
-                            if (tagPtr == sizeof(QTBuffer))
-                            {
-                                tagPtr = 0;
-                                QT = done;
-                            }
-                        }
-                    }
-                    else
-                    {
-                        if (flags & 64)
+                        if (!index && recordsEnd > recordsStart)
                         {
-                            if (BC == done && QT == done)
+                            if (tagEngine)
                             {
-                                u32 totalNewSpace = (outputRXQX ? (2 * (6 + 27)) : 0) + 6 + 12;
-                                if ((BufferSize - writeBuffer->size - 1) < totalNewSpace) writeBuffer = GetNextBuffer_Write(writePool);
-
-                                u08 BDBuffer[13];
-                                ForLoop(13) BDBuffer[index] = revComp ? Comp(BCBuffer[sizeof(BCBuffer) - index - 1]) : BCBuffer[14 + index];
-                                
-                                if (outputRXQX)
+                                tag_slot *slot = TagBlockParallel(tagEngine, recordsStart, recordsEnd, revComp, outputRXQX);
+                                ForLoop2(slot->nJobs)
                                 {
-                                    // RX
-                                    writeBuffer->buffer[writeBuffer->size++] = '\t';
-                                    writeBuffer->buffer[writeBuffer->size++] = 'R';
-                                    writeBuffer->buffer[writeBuffer->size++] = 'X';
-                                    writeBuffer->buffer[writeBuffer->size++] = ':';
-                                    writeBuffer->buffer[writeBuffer->size++] = 'Z';
-                                    writeBuffer->buffer[writeBuffer->size++] = ':';
-                                    ForLoop(13) writeBuffer->buffer[writeBuffer->size++] = BCBuffer[index];
-                                    writeBuffer->buffer[writeBuffer->size++] = '+';
-                                    ForLoop(13) writeBuffer->buffer[writeBuffer->size++] = BDBuffer[index];
-
-                                    // QX
-                                    writeBuffer->buffer[writeBuffer->size++] = '\t';
-                                    writeBuffer->buffer[writeBuffer->size++] = 'Q';
-                                    writeBuffer->buffer[writeBuffer->size++] = 'X';
-                                    writeBuffer->buffer[writeBuffer->size++] = ':';
-                                    writeBuffer->buffer[writeBuffer->size++] = 'Z';
-                                    writeBuffer->buffer[writeBuffer->size++] = ':';
-                                    ForLoop(13) writeBuffer->buffer[writeBuffer->size++] = QTBuffer[index];
-                                    writeBuffer->buffer[writeBuffer->size++] = '+';
-                                    ForLoop(13) writeBuffer->buffer[writeBuffer->size++] = QTBuffer[revComp ? (sizeof(QTBuffer) - index - 1) : (14 + index)];
+                                    tag_job *job = slot->jobs + index2;
+                                    writeBuffer = AppendToWriteBuffer(writePool, writeBuffer, job->output->buffer, job->output->size);
+
+                                    if (ReportTagJob(job, &counter, missingTags))
+                                    {
+                                        logError = 1;
+                                        goto End;
+                                    }
                                 }
-
-                                // BX
-                                u08 BXBuffer[13];
-
-                                u08 a = GetBC_A(BCBuffer + 7);
-                                u08 b = GetBC_B(BDBuffer + 7);
-                                u08 c = GetBC_C(BCBuffer);
-                                u08 d = GetBC_D(BDBuffer);
-
-                                transferBuffer->buffer[transferBuffer->size++] = a;
-                                transferBuffer->buffer[transferBuffer->size++] = b;
-                                transferBuffer->buffer[transferBuffer->size++] = c;
-                                transferBuffer->buffer[transferBuffer->size++] = d;
-                                if (transferBuffer->size == BufferSize) transferBuffer = GetNextTransferBuffer(transferBufferPool);
-
-                                stbsp_snprintf((char *)BXBuffer, 13, "A%02uC%02uB%02uD%02u", a&127, c&127, b&127, d&127);
-                                writeBuffer->buffer[writeBuffer->size++] = '\t';
-                                writeBuffer->buffer[writeBuffer->size++] = 'B';
-                                writeBuffer->buffer[writeBuffer->size++] = 'X';
-                                writeBuffer->buffer[writeBuffer->size++] = ':';
-                                writeBuffer->buffer[writeBuffer->size++] = 'Z';
-                                writeBuffer->buffer[writeBuffer->size++] = ':';
-                                ForLoop(12) writeBuffer->buffer[writeBuffer->size++] = BXBuffer[index];
                             }
                             else
                             {
-                                PrintWarning("Read %s has no %s tag%s", nameBuffer, (BC != done && QT != done) ? "BC/QT" : (BC != done ? "BC" : "QT"), (BC != done && QT != done) ? "s" : "");
-
-                                if (WriteToLogFile(missingTagsLog, nameBuffer, strlen((char *)nameBuffer)) || WriteToLogFile(missingTagsLog, (void *)"\n", 1))
+                                tag_job job = {};
+                                job.input = recordsStart;
+                                job.inputSize = (u64)(recordsEnd - recordsStart);
+                                job.writePool = writePool;
+                                job.output = writeBuffer;
+                                job.counts = barcodeHashTable;
+                                job.missing = missing;
+                                job.mates = mates;
+                                job.revComp = revComp;
+                                job.outputRXQX = outputRXQX;
+                                job.referenceInput = 1;
+
+                                TagRecords(&job);
+                                writeBuffer = job.output;
+
+                                if (ReportTagJob(&job, &counter, missingTags))
                                 {
                                     logError = 1;
                                     goto End;
                                 }
                             }
                         }
-                        
-                        FL = BC = QT = null;
-                        tagPtr = namePtr = 0;
                     }
                 }
 
-                writeBuffer->buffer[writeBuffer->size++] = character;
-                if (BufferSize == writeBuffer->size) writeBuffer = GetNextBuffer_Write(writePool);
+                // spans into this read buffer, or into the tag engine's output slots, have to be handed over before they can be reused
+                if (zeroCopy || tagEngine) writeBuffer = GetNextBuffer_Write(writePool);
+                TraceEvent("parse", 0, "main", parseStart, readBuffer->size);
+            } while (readBuffer->size);
 
-                if (!headerMode && atEnd)
-                {
-#define Log2_Print_Interval 14
-                    if (!(++total & ((1 << Log2_Print_Interval) - 1)))
-                    {
-                        u08 currPtr = printNBufferPtr;
-                        u08 otherPtr = (currPtr + 1) & 1;
-                        stbsp_snprintf(printNBuffers[currPtr], sizeof(printNBuffers[currPtr]), "%$" PRIu64, total);
+            // a final record without a new-line is passed through untagged
+            if (carry->size) writeBuffer = CopyToWriteBuffer(writePool, writeBuffer, carry->data, carry->size);
+        }
 
-                        if (strcmp(printNBuffers[currPtr], printNBuffers[otherPtr]))
-                        {
-                            PrintStatus("%s reads processed", printNBuffers[currPtr]);
-                        }
+        EndParse(counter.parse);
+        GetNextBuffer_Write(writePool);
+        if (tagEngine) MergeTagEngineCounts(tagEngine, barcodeHashTable);
 
-                        printNBufferPtr = otherPtr;
-                    }
-                }
-            }
-        } while (readBuffer->size);
+        if (CloseMissingTagsLog(missingTags))
+        {
+            logError = 1;
+            goto End;
+        }
 
-        GetNextBuffer_Write(writePool);
-        GetNextTransferBuffer(transferBufferPool);
-        GetNextTransferBuffer(transferBufferPool);
+        if (mates) PrintStatus("Mate cache: %" PRIu64 " hits, %" PRIu64 " misses, %" PRIu64 " evictions", mates->hits, mates->misses, mates->evictions);
 
-        WavlTreeFreeze_LowToHigh(barcodeTree);
+        barcode *sortedBarCodes = SortBarCodes(barcodeHashTable, &workingSet);
         
-        header = (char *)"Barcode\tCorrect Reads\tCorrected Reads\n";
+        char *header = (char *)"Barcode\tCorrect Reads\tCorrected Reads\n";
         if (WriteToLogFile(clearBCLog, header, strlen(header)))
         {
             logError = 1;
@@ -661,27 +2261,34 @@ MainArgs
             goto End;
         }
         
-        TraverseLinkedList(WavlTreeGetBottom(barcodeTree)->next, wavl_node)
+        ForLoop(barcodeHashTable->count)
         {
-            barcode *barcode = GetBarCodeFromHashTable(barcodeHashTable, &workingSet, node->value - 1);
+            barcode *barcode = sortedBarCodes + index;
             u08 lineBuffer[128];
 
-            u08 a = (u08)((barcode->barcode >> 24) & ((1 << 8) - 1));
-            u08 c = (u08)((barcode->barcode >> 16) & ((1 << 8) - 1));
-            u08 b = (u08)((barcode->barcode >> 8) & ((1 << 8) - 1));
-            u08 d = (u08)(barcode->barcode & ((1 << 8) - 1));
-
-            if (barcode->unclear) stbsp_snprintf((char *)lineBuffer, sizeof(lineBuffer), "A%02uC%02uB%02uD%02u\t%u\n", a, c, b, d, barcode->unclear);
-            else stbsp_snprintf((char *)lineBuffer, sizeof(lineBuffer), "A%02uC%02uB%02uD%02u\t%u\t%u\n", a, c, b, d, barcode->correct, barcode->corrected);
+            FormatPackedBarCode(lineBuffer, barcode->barcode);
+            u32 n = 12;
+            if (barcode->unclear) n += (u32)stbsp_snprintf((char *)lineBuffer + n, (s32)sizeof(lineBuffer) - (s32)n, "\t%u\n", barcode->unclear);
+            else n += (u32)stbsp_snprintf((char *)lineBuffer + n, (s32)sizeof(lineBuffer) - (s32)n, "\t%u\t%u\n", barcode->correct, barcode->corrected);
 
-            if (WriteToLogFile(barcode->unclear ? unclearBCLog : clearBCLog, (char *)lineBuffer, strlen((char *)lineBuffer)))
+            if (WriteToLogFile(barcode->unclear ? unclearBCLog : clearBCLog, (char *)lineBuffer, n))
             {
                 logError = 1;
                 goto End;
             }
         }
 
+        if (WriteBarCodeStats(statsFile, sortedBarCodes, barcodeHashTable->count, &workingSet))
+        {
+            logError = 1;
+            goto End;
+        }
+
         GetNextBuffer_Write(writePool);
+        if (bamInput) FinishBGZFOutput(writePool);
+        PrintBufferPoolStats(readPool, 0);
+        PrintBufferPoolStats(writePool, 1);
+        WritePipelineReport();
         
         if (Global_Write_Error)
         {
@@ -696,6 +2303,11 @@ MainArgs
     }
 
 End:
+    if (Trace_Enabled && WriteTrace())
+    {
+        PrintError("Error writing trace file");
+        exitCode = EXIT_FAILURE;
+    }
     if (logError)
     {
         PrintError("Error writing log file");